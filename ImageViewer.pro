@@ -8,14 +8,31 @@ QT       += core gui
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
+#single instance, later launches hand their files over a local socket
+QT       += network
+
 TARGET = ImageViewer
 TEMPLATE = app
 
 
-SOURCES += main.cpp\
-        mainwindow.cpp
+include(core.pri)
 
-HEADERS  += mainwindow.h
+SOURCES += main.cpp\
+        mainwindow.cpp \
+        imagecanvas.cpp \
+        thumbnailstrip.cpp \
+        filterdialog.cpp \
+        statisticspanel.cpp \
+        singleinstance.cpp \
+        duplicatesdialog.cpp
+
+HEADERS  += mainwindow.h \
+        imagecanvas.h \
+        thumbnailstrip.h \
+        filterdialog.h \
+        statisticspanel.h \
+        singleinstance.h \
+        duplicatesdialog.h
 
 FORMS    += mainwindow.ui
 
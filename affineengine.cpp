@@ -0,0 +1,239 @@
+#include "affineengine.h"
+#include "parallel.h"
+#include "simd.h"
+#include "trace.h"
+
+#include <QThread>
+#include <QtMath>
+
+#include <cstring>
+#include <functional>
+
+namespace {
+
+//output pixels rendered by one task, in both directions
+const int OUT_TILE = 128;
+//fraction bits of the sampling positions
+const int SHIFT = 16;
+
+//32-bit pixels the sampler reads, width and height in pixels
+struct Source{
+    const uchar *bits;
+    int bpl;
+    int width;
+    int height;
+};
+
+//pixels of the source around one output tile, placed at origin in source coordinates
+typedef std::function<QImage(const QRect &area)> Fetch;
+
+QImage prepare(const QImage &image){
+    if(image.format() == QImage::Format_RGB32 || image.format() == QImage::Format_ARGB32_Premultiplied)
+        return image;
+    return image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+}
+
+//blend of two premultiplied pixels, f out of 256. two channels per multiply
+inline quint32 lerp(quint32 a, quint32 b, int f){
+    quint32 rb = (((a & 0xff00ff) * (256 - f) + (b & 0xff00ff) * f) >> 8) & 0xff00ff;
+    quint32 ag = (((a >> 8) & 0xff00ff) * (256 - f) + ((b >> 8) & 0xff00ff) * f) & 0xff00ff00;
+    return rb | ag;
+}
+
+//pixels outside the source are transparent, that gives antialiased edges
+inline quint32 pixelAt(const Source &s, int x, int y){
+    if(uint(x) >= uint(s.width) || uint(y) >= uint(s.height))
+        return 0;
+    return reinterpret_cast<const QRgb *>(s.bits + qint64(y) * s.bpl)[x];
+}
+
+inline quint32 bilinear(const Source &s, int x, int y, int fx, int fy){
+    if(uint(x) < uint(s.width - 1) && uint(y) < uint(s.height - 1)){
+        const QRgb *p = reinterpret_cast<const QRgb *>(s.bits + qint64(y) * s.bpl) + x;
+        const QRgb *q = reinterpret_cast<const QRgb *>(reinterpret_cast<const uchar *>(p) + s.bpl);
+        return lerp(lerp(p[0], p[1], fx), lerp(q[0], q[1], fx), fy);
+    }
+    return lerp(lerp(pixelAt(s, x, y), pixelAt(s, x + 1, y), fx),
+                lerp(pixelAt(s, x, y + 1), pixelAt(s, x + 1, y + 1), fx), fy);
+}
+
+#ifdef IV_SSE2
+inline __m128i mix(__m128i a, __m128i b, __m128i f){
+    const __m128i one = _mm_set1_epi16(256);
+    return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, _mm_sub_epi16(one, f)), _mm_mullo_epi16(b, f)), 8);
+}
+
+//two output pixels at once, a and b point at the top left source pixel of each
+inline void bilinear2Sse2(const QRgb *a, const QRgb *b, int bpl, int fxa, int fya, int fxb, int fyb, QRgb *dst){
+    const __m128i zero = _mm_setzero_si128();
+    const QRgb *a1 = reinterpret_cast<const QRgb *>(reinterpret_cast<const uchar *>(a) + bpl);
+    const QRgb *b1 = reinterpret_cast<const QRgb *>(reinterpret_cast<const uchar *>(b) + bpl);
+    //left pixels of both in the low half, right ones in the high half
+    __m128i top = _mm_unpacklo_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(a)),
+                                     _mm_loadl_epi64(reinterpret_cast<const __m128i *>(b)));
+    __m128i bottom = _mm_unpacklo_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(a1)),
+                                        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(b1)));
+    __m128i wx = _mm_set_epi16(fxb, fxb, fxb, fxb, fxa, fxa, fxa, fxa);
+    __m128i wy = _mm_set_epi16(fyb, fyb, fyb, fyb, fya, fya, fya, fya);
+    __m128i t = mix(_mm_unpacklo_epi8(top, zero), _mm_unpackhi_epi8(top, zero), wx);
+    __m128i u = mix(_mm_unpacklo_epi8(bottom, zero), _mm_unpackhi_epi8(bottom, zero), wx);
+    __m128i p = mix(t, u, wy);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), _mm_packus_epi16(p, p));
+}
+#endif
+
+//positions are fixed point, stepped by (du, dv) per output pixel
+void sampleRow(const Source &s, qint64 u, qint64 v, qint64 du, qint64 dv, QRgb *dst, int n){
+    int i = 0;
+#ifdef IV_SSE2
+    for(; i + 1 < n; i += 2, u += 2 * du, v += 2 * dv){
+        qint64 u1 = u + du, v1 = v + dv;
+        int xa = int(u >> SHIFT), ya = int(v >> SHIFT);
+        int xb = int(u1 >> SHIFT), yb = int(v1 >> SHIFT);
+        int fxa = int(u >> (SHIFT - 8)) & 0xff, fya = int(v >> (SHIFT - 8)) & 0xff;
+        int fxb = int(u1 >> (SHIFT - 8)) & 0xff, fyb = int(v1 >> (SHIFT - 8)) & 0xff;
+        if(uint(xa) < uint(s.width - 1) && uint(ya) < uint(s.height - 1)
+                && uint(xb) < uint(s.width - 1) && uint(yb) < uint(s.height - 1)){
+            bilinear2Sse2(reinterpret_cast<const QRgb *>(s.bits + qint64(ya) * s.bpl) + xa,
+                          reinterpret_cast<const QRgb *>(s.bits + qint64(yb) * s.bpl) + xb,
+                          s.bpl, fxa, fya, fxb, fyb, dst + i);
+        }else{
+            dst[i] = bilinear(s, xa, ya, fxa, fya);
+            dst[i + 1] = bilinear(s, xb, yb, fxb, fyb);
+        }
+    }
+#endif
+    for(; i < n; i++, u += du, v += dv)
+        dst[i] = bilinear(s, int(u >> SHIFT), int(v >> SHIFT), int(u >> (SHIFT - 8)) & 0xff, int(v >> (SHIFT - 8)) & 0xff);
+}
+
+//whole pixel steps, a transposed and/or flipped copy
+void copyRow(const Source &s, int x, int y, int dx, int dy, QRgb *dst, int n){
+    for(int i = 0; i < n; i++, x += dx, y += dy)
+        dst[i] = pixelAt(s, x, y);
+}
+
+QImage render(const QTransform &matrix, const QSize &size, QImage::Format format, const QRect &sourceRect,
+              AffineEngine::Progress *progress, const Fetch &fetch, QAtomicInt *done, QAtomicInt *total){
+    bool invertible;
+    QTransform inverse = matrix.inverted(&invertible);
+    TraceSpan span("AffineEngine::transformed", size);
+    QImage out(size, format);
+    if(!invertible || out.isNull())
+        return QImage();
+    span.addBytes(out.sizeInBytes());
+
+    bool exact = AffineEngine::isExact(matrix);
+    uchar *outBits = out.bits();
+    int outBpl = out.bytesPerLine();
+    int columns = (size.width() + OUT_TILE - 1) / OUT_TILE;
+    int tiles = columns * ((size.height() + OUT_TILE - 1) / OUT_TILE);
+    if(total){
+        done->store(0);
+        total->store(tiles);
+    }
+
+    //tiles are handed out one by one, empty corners of a rotation cost nothing
+    QAtomicInt next(0);
+    auto work = [&](int, int){
+        int i;
+        while((i = next.fetchAndAddRelaxed(1)) < tiles){
+            if(progress && progress->isCanceled())
+                return;
+            QRect r = QRect((i % columns) * OUT_TILE, (i / columns) * OUT_TILE, OUT_TILE, OUT_TILE)
+                    .intersected(QRect(QPoint(0, 0), size));
+            //source pixels that can reach this tile, one more for the bilinear neighbours
+            QRect area = inverse.mapRect(QRectF(r)).toAlignedRect().adjusted(-1, -1, 1, 1).intersected(sourceRect);
+            QImage block = area.isEmpty() ? QImage() : fetch(area);
+            Source s = {block.constBits(), block.bytesPerLine(), block.width(), block.height()};
+
+            for(int y = r.top(); y <= r.bottom(); y++){
+                QRgb *dst = reinterpret_cast<QRgb *>(outBits + qint64(y) * outBpl) + r.left();
+                if(block.isNull()){
+                    memset(dst, 0, r.width() * 4);
+                    continue;
+                }
+                //pixel centers of the output to pixel positions of the block
+                QPointF p = inverse.map(QPointF(r.left() + 0.5, y + 0.5)) - QPointF(area.x() + 0.5, area.y() + 0.5);
+                if(exact)
+                    copyRow(s, qRound(p.x()), qRound(p.y()), qRound(inverse.m11()), qRound(inverse.m12()), dst, r.width());
+                else
+                    sampleRow(s, qRound64(p.x() * (1 << SHIFT)), qRound64(p.y() * (1 << SHIFT)),
+                              qRound64(inverse.m11() * (1 << SHIFT)), qRound64(inverse.m12() * (1 << SHIFT)), dst, r.width());
+            }
+            if(done)
+                done->fetchAndAddRelaxed(1);
+        }
+    };
+    parallelFor(qMin(QThread::idealThreadCount(), tiles), 1, work);
+
+    if(progress && progress->isCanceled())
+        return QImage();
+    return out;
+}
+
+}
+
+AffineEngine::Progress::Progress() :
+    done(0), total(0), canceled(0)
+{
+}
+
+void AffineEngine::Progress::cancel(){
+    canceled.store(1);
+}
+
+bool AffineEngine::Progress::isCanceled() const{
+    return canceled.load() != 0;
+}
+
+int AffineEngine::Progress::percent() const{
+    int t = total.load();
+    return t > 0 ? done.load() * 100 / t : 0;
+}
+
+void AffineEngine::Progress::report(int done, int total){
+    this->total.store(total);
+    this->done.store(done);
+}
+
+QImage AffineEngine::transformed(const QImage &image, const QTransform &matrix, const QSize &size, Progress *progress){
+    if(image.isNull() || size.isEmpty())
+        return QImage();
+    //the whole image is in memory already: 32-bit pixels are read in place,
+    //compact formats are converted one tile area at a time
+    const QImage &source = image;
+    bool direct = image.format() == QImage::Format_RGB32 || image.format() == QImage::Format_ARGB32_Premultiplied;
+    bool opaque = !image.hasAlphaChannel() && isExact(matrix);
+    return render(matrix, size, opaque ? QImage::Format_RGB32 : QImage::Format_ARGB32_Premultiplied, source.rect(), progress,
+                  [&source, direct](const QRect &area){
+                      if(!direct)
+                          return prepare(source.copy(area));
+                      return QImage(source.constBits() + qint64(area.y()) * source.bytesPerLine() + area.x() * 4,
+                                    area.width(), area.height(), source.bytesPerLine(), source.format());
+                  },
+                  progress ? &progress->done : 0, progress ? &progress->total : 0);
+}
+
+QImage AffineEngine::transformed(const QSharedPointer<TiledImage> &image, const QTransform &matrix, const QSize &size, Progress *progress){
+    if(!image || size.isEmpty())
+        return QImage();
+    //tiles only decode or copy the part of the source they map to
+    bool opaque = !QImage(1, 1, image->format()).hasAlphaChannel() && isExact(matrix);
+    return render(matrix, size, opaque ? QImage::Format_RGB32 : QImage::Format_ARGB32_Premultiplied, image->rect(), progress,
+                  [&image](const QRect &area){ return prepare(image->region(area)); },
+                  progress ? &progress->done : 0, progress ? &progress->total : 0);
+}
+
+bool AffineEngine::isExact(const QTransform &matrix){
+    if(matrix.type() == QTransform::TxProject)
+        return false;
+    qreal c[] = {matrix.m11(), matrix.m12(), matrix.m21(), matrix.m22()};
+    for(int i = 0; i < 4; i++){
+        if(qAbs(c[i]) > 1e-9 && qAbs(qAbs(c[i]) - 1) > 1e-9)
+            return false;
+    }
+    if(qAbs(qAbs(matrix.determinant()) - 1) > 1e-9)
+        return false;
+    return qAbs(matrix.dx() - qRound(matrix.dx())) < 1e-6 && qAbs(matrix.dy() - qRound(matrix.dy())) < 1e-6;
+}
@@ -0,0 +1,45 @@
+#ifndef AFFINEENGINE_H
+#define AFFINEENGINE_H
+
+#include <QImage>
+#include <QTransform>
+#include <QAtomicInt>
+#include <QSharedPointer>
+
+#include "tiledimage.h"
+
+// renders an image through an affine transform. the output is split into
+// tiles that are sampled bilinearly on the thread pool, each tile only
+// fetches the source pixels it maps to. transforms that just move whole
+// pixels around (multiples of 90 degrees, flips) are copied exactly.
+class AffineEngine
+{
+public:
+    // shared between a running render and whoever shows or cancels it
+    class Progress
+    {
+    public:
+        Progress();
+        void cancel();
+        bool isCanceled() const;
+        int percent() const;
+        //for work done outside the engine
+        void report(int done, int total);
+
+    private:
+        friend class AffineEngine;
+        QAtomicInt done;
+        QAtomicInt total;
+        QAtomicInt canceled;
+    };
+
+    //matrix maps source to output coordinates, the output is size pixels from the origin.
+    //a null image is returned when canceled
+    static QImage transformed(const QImage &image, const QTransform &matrix, const QSize &size, Progress *progress = 0);
+    static QImage transformed(const QSharedPointer<TiledImage> &image, const QTransform &matrix, const QSize &size, Progress *progress = 0);
+
+    //whether every output pixel is exactly one source pixel
+    static bool isExact(const QTransform &matrix);
+};
+
+#endif // AFFINEENGINE_H
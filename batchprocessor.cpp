@@ -0,0 +1,348 @@
+#include "batchprocessor.h"
+#include "trace.h"
+#include "losslessjpeg.h"
+
+#include <QImageReader>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QDir>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QThread>
+#include <QHash>
+#include <QSet>
+
+#include <iostream>
+
+namespace {
+
+QMutex printMutex;
+
+void print(const QString &line, bool error = false){
+    QMutexLocker locker(&printMutex);
+    (error ? std::cerr : std::cout) << line.toLocal8Bit().constData() << std::endl;
+}
+
+class BatchJob : public QRunnable
+{
+public:
+    BatchJob(const BatchProcessor *processor, const QString &fileName, QAtomicInt *failures) :
+        processor(processor), fileName(fileName), failures(failures)
+    {
+    }
+
+    void run(){
+        QString report;
+        bool ok = processor->processFile(fileName, &report);
+        if(!ok)
+            failures->fetchAndAddRelaxed(1);
+        print(report, !ok);
+    }
+
+private:
+    const BatchProcessor *processor;
+    QString fileName;
+    QAtomicInt *failures;
+};
+
+double milliseconds(qint64 nsecs){
+    return nsecs / 1000000.0;
+}
+
+//the same for every name of a file, a result that doesn't exist yet has no canonical path
+QString pathKey(const QString &fileName){
+    QFileInfo info(fileName);
+    return info.exists() ? info.canonicalFilePath() : QDir::cleanPath(info.absoluteFilePath());
+}
+
+}
+
+BatchProcessor::BatchProcessor() :
+    jobs(QThread::idealThreadCount())
+{
+}
+
+bool BatchProcessor::setScript(const QString &script, QString *error){
+    operations.clear();
+    format.clear();
+    options = ImageSaver::Options();
+
+    //crop values contain commas too, parts without '=' belong to the previous operation
+    QStringList steps;
+    foreach(const QString &part, script.split(',', Qt::SkipEmptyParts)){
+        if(part.contains('=') || steps.isEmpty())
+            steps.append(part.trimmed());
+        else
+            steps.last() += "," + part.trimmed();
+    }
+
+    foreach(const QString &step, steps){
+        QString name = step.section('=', 0, 0).trimmed().toLower();
+        QString value = step.section('=', 1).trimmed();
+        Operation op;
+        bool ok = false;
+        if(name == "rotate"){
+            op.kind = Operation::Rotate;
+            op.degrees = value.toDouble(&ok);
+        }else if(name == "crop"){
+            op.kind = Operation::Crop;
+            QStringList v = value.split(',');
+            if(v.size() == 4){
+                bool okx, oky, okw, okh;
+                op.rect = QRect(v[0].toInt(&okx), v[1].toInt(&oky), v[2].toInt(&okw), v[3].toInt(&okh));
+                ok = okx && oky && okw && okh && !op.rect.isEmpty();
+            }
+        }else if(name == "resize"){
+            op.kind = Operation::Resize;
+            if(value.endsWith('%')){
+                op.percent = value.left(value.size() - 1).toDouble(&ok);
+                ok = ok && op.percent > 0;
+            }else if(value.contains('x')){
+                bool okh;
+                op.size = QSize(value.section('x', 0, 0).toInt(&ok), value.section('x', 1).toInt(&okh));
+                ok = ok && okh && !op.size.isEmpty();
+            }else{
+                op.size = QSize(value.toInt(&ok), 0);
+                ok = ok && op.size.width() > 0;
+            }
+        }else if(name == "format"){
+            //format=jpg:q85, png:c9, jpg:q90:p for progressive
+            QStringList v = value.split(':');
+            format = v[0].toLower();
+            ok = !format.isEmpty();
+            for(int i = 1; ok && i < v.size(); i++){
+                if(v[i].startsWith('q'))
+                    options.quality = v[i].mid(1).toInt(&ok);
+                else if(v[i].startsWith('c'))
+                    options.compression = v[i].mid(1).toInt(&ok);
+                else if(v[i] == "p" || v[i] == "progressive")
+                    options.progressive = true;
+                else
+                    ok = false;
+            }
+        }
+        if(!ok){
+            *error = QString("invalid operation \"%1\"").arg(step);
+            return false;
+        }
+        if(name != "format")
+            operations.append(op);
+    }
+    return true;
+}
+
+void BatchProcessor::setOutputDir(const QString &dir){
+    outputDir = dir;
+}
+
+void BatchProcessor::setJobs(int jobs){
+    this->jobs = qMax(1, jobs);
+}
+
+void BatchProcessor::setOverwrite(bool overwrite){
+    this->overwrite = overwrite;
+}
+
+int BatchProcessor::process(const QStringList &files){
+    //a file per thread, at most 'jobs' decoded images are held at once
+    QThreadPool pool;
+    pool.setMaxThreadCount(jobs);
+    QAtomicInt failures(0);
+    QElapsedTimer timer;
+    timer.start();
+    foreach(const QString &file, files)
+        pool.start(new BatchJob(this, file, &failures));
+    pool.waitForDone();
+
+    double seconds = timer.nsecsElapsed() / 1e9;
+    int done = files.size() - failures.load();
+    print(QString("%1 images in %2 s, %3 images/s, %4 failed")
+          .arg(done).arg(seconds, 0, 'f', 2).arg(seconds > 0 ? done / seconds : 0, 0, 'f', 2).arg(failures.load()));
+    return failures.load();
+}
+
+QString BatchProcessor::targetFile(const QString &fileName) const{
+    QFileInfo info(fileName);
+    QString dir = outputDir.isEmpty() ? info.absolutePath() : outputDir;
+    return QDir(dir).filePath(info.completeBaseName() + "." + (format.isEmpty() ? info.suffix() : format));
+}
+
+bool BatchProcessor::checkTargets(const QStringList &files, QString *error) const{
+    //all targets are known before the first job starts, jobs run in parallel and
+    //one must not replace what another reads or writes
+    QHash<QString, QString> inputs;
+    foreach(const QString &file, files)
+        inputs.insert(pathKey(file), file);
+    QHash<QString, QString> targets;
+    foreach(const QString &file, files){
+        QString target = targetFile(file);
+        QString key = pathKey(target);
+        if(targets.contains(key)){
+            *error = QString("%1 and %2 would both be written to %3").arg(targets.value(key), file, target);
+            return false;
+        }
+        targets.insert(key, file);
+        if(!overwrite && inputs.contains(key)){
+            *error = QString("the result of %1 would replace %2, pass -o dir or --overwrite").arg(file, inputs.value(key));
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BatchProcessor::processFile(const QString &fileName, QString *report) const{
+    TraceSpan span("BatchProcessor::processFile");
+    QElapsedTimer timer;
+    timer.start();
+
+    QFileInfo info(fileName);
+    QString target = targetFile(fileName);
+    //-o pointing at the input folder, or format= naming the input's own suffix
+    if(!overwrite && QFileInfo(target).exists() && QFileInfo(target).canonicalFilePath() == info.canonicalFilePath()){
+        *report = QString("%1: skipped, the result would replace it (use -o or --overwrite)").arg(fileName);
+        return false;
+    }
+
+    //decode, large files stay tiled on disk like in the viewer
+    QSharedPointer<TiledImage> image;
+    QString error;
+    QImageReader reader(fileName);
+    reader.setAutoTransform(true);
+    if(TiledImage::needsTiling(reader.size())){
+        image = TiledImage::open(fileName, &error);
+    }else{
+        image = TiledImage::fromImage(reader.read());
+        error = reader.errorString();
+    }
+    if(!image){
+        *report = QString("%1: failed to decode, %2").arg(fileName, error);
+        return false;
+    }
+    //pixels as stored in the file, lossless jpeg edits can start from it
+    if(reader.transformation() == QImageIOHandler::TransformationNone)
+        image->setSourceFile(fileName);
+    qint64 decoded = timer.nsecsElapsed();
+    span.setSize(image->size());
+
+    EditPipeline edits(image);
+    foreach(const Operation &op, operations){
+        switch(op.kind){
+        case Operation::Crop:
+            edits.crop(op.rect);
+            break;
+        case Operation::Rotate:
+            edits.rotate(op.degrees);
+            break;
+        case Operation::Resize:{
+            QSize s = edits.size();
+            if(op.percent > 0)
+                edits.resize(QSize(qMax(1, qRound(s.width() * op.percent / 100)), qMax(1, qRound(s.height() * op.percent / 100))));
+            else if(op.size.height() == 0)
+                edits.resize(QSize(op.size.width(), qMax(1, qRound(1.0 * s.height() * op.size.width() / s.width()))));
+            else
+                edits.resize(op.size);
+            break;
+        }
+        }
+    }
+
+    //render here unless it's too large, then the saver streams it in bands. crops and
+    //quarter turns of a jpeg are left to the saver, it keeps their coefficients
+    QString suffix = QFileInfo(target).suffix().toLower();
+    QString jpegFile;
+    LosslessJpeg::Operation operation;
+    bool lossless = (suffix == "jpg" || suffix == "jpeg") && LosslessJpeg::plan(edits, &jpegFile, &operation);
+    if(!lossless && qint64(edits.size().width()) * edits.size().height() * 4 <= TiledImage::MATERIALIZE_LIMIT){
+        QImage pixels = edits.render();
+        if(pixels.isNull()){
+            *report = QString("%1: not enough memory to render").arg(fileName);
+            return false;
+        }
+        edits = EditPipeline(TiledImage::fromImage(pixels));
+    }
+    qint64 processed = timer.nsecsElapsed();
+
+    if(ImageSaver::write(edits, target, options, 0, &error) != ImageSaver::Saved){
+        *report = QString("%1: %2").arg(fileName, error);
+        return false;
+    }
+    qint64 encoded = timer.nsecsElapsed();
+
+    *report = QString("%1 -> %2  decode %3 ms  process %4 ms  encode %5 ms")
+            .arg(fileName, target)
+            .arg(milliseconds(decoded), 0, 'f', 1)
+            .arg(milliseconds(processed - decoded), 0, 'f', 1)
+            .arg(milliseconds(encoded - processed), 0, 'f', 1);
+    return true;
+}
+
+int BatchProcessor::run(const QStringList &arguments){
+    BatchProcessor processor;
+    QString script;
+    QStringList inputs;
+    bool usage = false;
+    for(int i = 1; i < arguments.size(); i++){
+        const QString &arg = arguments.at(i);
+        if(arg == "--batch" && i + 1 < arguments.size())
+            script = arguments.at(++i);
+        else if((arg == "-o" || arg == "--output") && i + 1 < arguments.size())
+            processor.setOutputDir(arguments.at(++i));
+        else if((arg == "-j" || arg == "--jobs") && i + 1 < arguments.size())
+            processor.setJobs(arguments.at(++i).toInt());
+        else if(arg == "--overwrite")
+            processor.setOverwrite(true);
+        else if(arg == "--trace" && i + 1 < arguments.size())
+            i++;    //handled by main
+        else if(arg.startsWith('-'))
+            usage = true;
+        else
+            inputs.append(arg);
+    }
+
+    QString error;
+    if(!usage && !script.isEmpty() && processor.setScript(script, &error)
+            && processor.outputDir.isEmpty() && processor.format.isEmpty() && !processor.overwrite)
+        error = "the results would replace the input files, pass -o dir, another format= or --overwrite";
+    if(usage || script.isEmpty() || inputs.isEmpty() || !error.isEmpty()){
+        if(!error.isEmpty())
+            print(error, true);
+        print("usage: ImageViewer --batch <rotate=deg,crop=x,y,w,h,resize=50%|WxH|W,format=jpg:q85> "
+              "[-o dir] [-j jobs] [--overwrite] files or folders...\n"
+              "results are written to -o dir, or next to the input with the format= suffix. "
+              "--overwrite lets them replace input files, two results never go to the same file", true);
+        return 2;
+    }
+    if(!processor.outputDir.isEmpty())
+        QDir().mkpath(processor.outputDir);
+
+    //folders are expanded to the images directly in them
+    QStringList filters;
+    foreach(const QByteArray &f, QImageReader::supportedImageFormats())
+        filters << "*." + QString(f);
+    QStringList files;
+    QSet<QString> listed;
+    foreach(const QString &input, inputs){
+        QStringList found;
+        if(QFileInfo(input).isDir()){
+            QDir dir(input);
+            foreach(const QString &name, dir.entryList(filters, QDir::Files, QDir::Name))
+                found.append(dir.filePath(name));
+        }else{
+            found.append(input);
+        }
+        //a file named twice, directly and through its folder, is processed once
+        foreach(const QString &file, found){
+            if(!listed.contains(pathKey(file))){
+                listed.insert(pathKey(file));
+                files.append(file);
+            }
+        }
+    }
+    if(!processor.checkTargets(files, &error)){
+        print(error, true);
+        return 2;
+    }
+    return processor.process(files) == 0 ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+#ifndef BATCHPROCESSOR_H
+#define BATCHPROCESSOR_H
+
+#include <QStringList>
+#include <QRect>
+#include <QList>
+
+#include "imagesaver.h"
+
+// headless processing of many files with one operation script, for example
+// "rotate=90,crop=x,y,w,h,resize=50%,format=jpg:q85". every file is decoded,
+// edited and encoded by one task on a bounded pool, with a task per thread
+// the decode, process and encode stages of different files overlap.
+class BatchProcessor
+{
+public:
+    struct Operation
+    {
+        enum Kind { Crop, Rotate, Resize };
+        Kind kind = Rotate;
+        QRect rect;
+        double degrees = 0;
+        QSize size;             //a height of 0 keeps the aspect ratio
+        double percent = 0;     //resize relative to the current size when set
+    };
+
+    BatchProcessor();
+
+    bool setScript(const QString &script, QString *error);
+    void setOutputDir(const QString &dir);
+    void setJobs(int jobs);
+    //lets a result replace its input, off by default
+    void setOverwrite(bool overwrite);
+
+    //returns the number of files that failed
+    int process(const QStringList &files);
+    //one file, the report is a line with its timings or the error
+    bool processFile(const QString &fileName, QString *report) const;
+    //where the result of a file is written
+    QString targetFile(const QString &fileName) const;
+    //false when two results would go to the same file or, without overwrite, a result would replace an input
+    bool checkTargets(const QStringList &files, QString *error) const;
+
+    //entry point of "--batch <script> [-o dir] [-j jobs] [--overwrite] files or folders..."
+    static int run(const QStringList &arguments);
+
+private:
+    QList<Operation> operations;
+    QString format;             //output suffix, empty keeps the input one
+    ImageSaver::Options options;
+    QString outputDir;
+    int jobs;
+    bool overwrite = false;
+};
+
+#endif // BATCHPROCESSOR_H
@@ -0,0 +1,16 @@
+#-------------------------------------------------
+#
+# benchmarks of the image operations, see benchmark.cpp
+#
+#-------------------------------------------------
+
+QT       += core gui testlib
+
+TARGET = imageviewer-bench
+TEMPLATE = app
+CONFIG   += console
+CONFIG   -= app_bundle
+
+include(../core.pri)
+
+SOURCES += benchmark.cpp
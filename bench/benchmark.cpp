@@ -0,0 +1,649 @@
+#include <QtTest>
+#include <QTemporaryDir>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QPainter>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QDateTime>
+#include <QThread>
+
+#include <algorithm>
+
+#include "tiledimage.h"
+#include "imagepyramid.h"
+#include "editpipeline.h"
+#include "undohistory.h"
+#include "imageloader.h"
+#include "imagefilter.h"
+#include "imagestatistics.h"
+#include "imagesaver.h"
+#include "thumbnailcache.h"
+#include "metadataindex.h"
+#include "imagehash.h"
+#include "resampler.h"
+
+// benchmarks of the image operations on synthetic images of 1, 24 and 100
+// megapixels. besides the usual QBENCHMARK output every case is written to
+// a json file with its median time, peak memory and image buffers allocated
+// per iteration, so runs of two versions
+// can be diffed. environment:
+//   BENCH_JSON   output file, benchmark.json by default
+//   BENCH_SIZES  sizes to run, e.g. "1,24", all by default
+// single cases run as usual for qt tests: imageviewer-bench rotate:24MP
+
+namespace {
+
+struct BenchSize
+{
+    const char *name;
+    int width;
+    int height;
+};
+
+const BenchSize SIZES[] = {
+    {"1MP", 1224, 817},
+    {"24MP", 6000, 4000},
+    {"100MP", 12248, 8165}
+};
+
+const char *FORMATS[] = {"jpg", "png", "bmp"};
+
+//what the viewer shows the image in
+const QSize VIEWPORT(1280, 800);
+
+//gradients with a bit of noise, encodes more like a photo than a flat fill
+QImage synthetic(const QSize &size){
+    QImage image(size, QImage::Format_RGB32);
+    for(int y = 0; y < size.height(); y++){
+        QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        quint32 seed = quint32(y) * 2654435761u;
+        for(int x = 0; x < size.width(); x++){
+            seed = seed * 1664525u + 1013904223u;
+            int n = (seed >> 24) & 15;
+            line[x] = qRgb((x * 255 / size.width() + n) & 255, (y * 255 / size.height() + n) & 255, ((x + y) / 8 + n) & 255);
+        }
+    }
+    return image;
+}
+
+//a value in kB from /proc/self/status, -1 where there is none
+qint64 statusKB(const QByteArray &key){
+    QFile status("/proc/self/status");
+    if(!status.open(QIODevice::ReadOnly))
+        return -1;
+    foreach(const QByteArray &line, status.readAll().split('\n')){
+        if(line.startsWith(key))
+            return line.mid(key.size()).trimmed().split(' ').first().toLongLong();
+    }
+    return -1;
+}
+
+//restarts the peak resident size from the current one (linux 4.0+)
+void resetPeak(){
+    QFile refs("/proc/self/clear_refs");
+    if(refs.open(QIODevice::WriteOnly))
+        refs.write("5");
+}
+
+//adds the time of one benchmark iteration when it goes out of scope
+class Lap
+{
+public:
+    explicit Lap(QVector<double> *times) : times(times) { timer.start(); }
+    ~Lap() { times->append(timer.nsecsElapsed() / 1e6); }
+
+private:
+    QVector<double> *times;
+    QElapsedTimer timer;
+};
+
+}
+
+class ImageBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void cleanupTestCase();
+    void cleanup();
+
+    void loadFile_data();
+    void loadFile();
+    void reopen_data();
+    void reopen();
+    void hash_data();
+    void hash();
+    void index_data();
+    void index();
+    void thumbnail_data();
+    void thumbnail();
+    void scaleImage_data();
+    void scaleImage();
+    void zoomFrame_data();
+    void zoomFrame();
+    void pan_data();
+    void pan();
+    void rotate_data();
+    void rotate();
+    void rotate90_data();
+    void rotate90();
+    void crop_data();
+    void crop();
+    void resize_data();
+    void resize();
+    void resizeQt_data();
+    void resizeQt();
+    void resample_data();
+    void resample();
+    void filter_data();
+    void filter();
+    void statistics_data();
+    void statistics();
+    void snapshot_data();
+    void snapshot();
+    void save_data();
+    void save();
+    void saveJpeg90_data();
+    void saveJpeg90();
+
+private:
+    void sizeData();
+    void formatData();
+    QSharedPointer<TiledImage> source(const QString &size);
+    QString file(const QString &size, const QString &format);
+    void startMeasuring();
+
+    QHash<QString, QSharedPointer<TiledImage> > sources;
+    QHash<QString, QString> files;
+    QTemporaryDir dir;
+    QVector<double> times;
+    qint64 baselineKB = -1;
+    qint64 baselineAllocations = 0;
+    QJsonArray results;
+};
+
+void ImageBenchmark::sizeData(){
+    QTest::addColumn<QString>("size");
+    QStringList wanted = qgetenv("BENCH_SIZES").isEmpty() ? QStringList() : QString(qgetenv("BENCH_SIZES")).split(',');
+    for(const BenchSize &s : SIZES){
+        if(wanted.isEmpty() || wanted.contains(QString(s.name).remove("MP")))
+            QTest::newRow(s.name) << QString(s.name);
+    }
+}
+
+void ImageBenchmark::formatData(){
+    QTest::addColumn<QString>("size");
+    QTest::addColumn<QString>("format");
+    QStringList wanted = qgetenv("BENCH_SIZES").isEmpty() ? QStringList() : QString(qgetenv("BENCH_SIZES")).split(',');
+    for(const BenchSize &s : SIZES){
+        if(!wanted.isEmpty() && !wanted.contains(QString(s.name).remove("MP")))
+            continue;
+        for(const char *format : FORMATS)
+            QTest::newRow(QString("%1 %2").arg(s.name, format).toLatin1().constData()) << QString(s.name) << QString(format);
+    }
+}
+
+QSharedPointer<TiledImage> ImageBenchmark::source(const QString &size){
+    if(!sources.contains(size)){
+        //only one size is kept, the large ones don't fit together
+        sources.clear();
+        for(const BenchSize &s : SIZES){
+            if(size == s.name)
+                sources.insert(size, TiledImage::fromImage(synthetic(QSize(s.width, s.height))));
+        }
+    }
+    return sources.value(size);
+}
+
+QString ImageBenchmark::file(const QString &size, const QString &format){
+    QString key = size + "." + format;
+    if(!files.contains(key)){
+        QString path = dir.filePath(key);
+        QImageWriter writer(path);
+        writer.write(source(size)->toImage());
+        files.insert(key, path);
+    }
+    return files.value(key);
+}
+
+void ImageBenchmark::startMeasuring(){
+    //inputs are ready, only the operation counts from here
+    times.clear();
+    resetPeak();
+    baselineKB = statusKB("VmRSS:");
+    baselineAllocations = TiledImage::allocationCount();
+}
+
+void ImageBenchmark::cleanup(){
+    if(times.isEmpty())
+        return;
+    std::sort(times.begin(), times.end());
+    qint64 peak = statusKB("VmHWM:");
+
+    QJsonObject result;
+    result["operation"] = QString(QTest::currentTestFunction());
+    result["case"] = QString(QTest::currentDataTag());
+    result["iterations"] = times.size();
+    result["msMedian"] = times.at(times.size() / 2);
+    result["msMin"] = times.first();
+    result["peakRssKB"] = peak;
+    result["peakDeltaKB"] = peak < 0 || baselineKB < 0 ? -1 : peak - baselineKB;
+    result["buffersPerIteration"] = double(TiledImage::allocationCount() - baselineAllocations) / times.size();
+    results.append(result);
+    times.clear();
+}
+
+void ImageBenchmark::cleanupTestCase(){
+    QJsonObject run;
+    run["qt"] = QString(qVersion());
+    run["threads"] = QThread::idealThreadCount();
+    run["date"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    run["results"] = results;
+
+    QString path = qEnvironmentVariableIsEmpty("BENCH_JSON") ? QString("benchmark.json") : QString(qgetenv("BENCH_JSON"));
+    QFile out(path);
+    if(out.open(QIODevice::WriteOnly))
+        out.write(QJsonDocument(run).toJson());
+    else
+        qWarning("can't write %s", qPrintable(path));
+}
+
+void ImageBenchmark::loadFile_data(){
+    formatData();
+}
+
+void ImageBenchmark::loadFile(){
+    //what the background loader does before the image is shown
+    QFETCH(QString, size);
+    QFETCH(QString, format);
+    QString path = file(size, format);
+    sources.clear();
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        QImageReader reader(path);
+        QSharedPointer<TiledImage> image = TiledImage::needsTiling(reader.size())
+                ? TiledImage::open(path) : TiledImage::fromImage(reader.read());
+        QVERIFY(image);
+        image->levels();
+    }
+}
+
+void ImageBenchmark::reopen_data(){
+    sizeData();
+}
+
+void ImageBenchmark::reopen(){
+    //opening a file over and over, shown, recorded for undo and encoded: one buffer each time, none kept
+    QFETCH(QString, size);
+    QString path = file(size, "jpg");
+    sources.clear();
+    QString saved = dir.filePath("reopened.bmp");
+    qint64 before = TiledImage::pixelBytes();
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        QSharedPointer<TiledImage> image = ImageLoader::decode(path);
+        QVERIFY(image);
+        UndoHistory history;
+        UndoHistory::Entry load;
+        load.kind = UndoHistory::Load;
+        load.checkpoint = EditPipeline(image);
+        history.push(load);
+        QString error;
+        QCOMPARE(ImageSaver::write(history.image(), saved, ImageSaver::Options(), 0, &error), ImageSaver::Saved);
+    }
+    QCOMPARE(TiledImage::pixelBytes(), before);
+}
+
+void ImageBenchmark::hash_data(){
+    formatData();
+}
+
+void ImageBenchmark::hash(){
+    //perceptual hashes from a reduced decode, what the duplicate finder does per file
+    QFETCH(QString, size);
+    QFETCH(QString, format);
+    QString path = file(size, format);
+    sources.clear();
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        ImageHash hash;
+        QVERIFY(ImageHash::fromFile(path, &hash));
+    }
+}
+
+void ImageBenchmark::index_data(){
+    QTest::addColumn<bool>("rescan");
+    QTest::newRow("cold") << false;
+    QTest::newRow("rescan") << true;
+}
+
+void ImageBenchmark::index(){
+    //headers of a folder of 2000 jpegs, from nothing and again with every file unchanged
+    QFETCH(bool, rescan);
+    QString folder = dir.filePath("index");
+    if(!QDir(folder).exists()){
+        QDir().mkpath(folder);
+        QString jpeg = file("1MP", "jpg");
+        for(int i = 0; i < 2000; i++)
+            QFile::copy(jpeg, QString("%1/%2.jpg").arg(folder).arg(i, 4, 10, QChar('0')));
+    }
+    QStringList files;
+    foreach(const QString &name, QDir(folder).entryList(QDir::Files, QDir::Name))
+        files << folder + "/" + name;
+    QTemporaryDir indexDir;
+    MetadataIndex warm(indexDir.path());
+    if(rescan){
+        QSignalSpy done(&warm, SIGNAL(finished()));
+        warm.scan(files);
+        QVERIFY(done.wait(60000));
+    }
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        //a new index reads the file of the last one, like the next run of the viewer
+        QTemporaryDir coldDir;
+        MetadataIndex index(rescan ? indexDir.path() : coldDir.path());
+        QSignalSpy done(&index, SIGNAL(finished()));
+        index.scan(files);
+        QVERIFY(done.wait(60000));
+        QCOMPARE(index.record(files.last()).size, QSize(1224, 817));
+    }
+}
+
+void ImageBenchmark::thumbnail_data(){
+    formatData();
+}
+
+void ImageBenchmark::thumbnail(){
+    //a cold start of the thumbnail strip, one file
+    QFETCH(QString, size);
+    QFETCH(QString, format);
+    QString path = file(size, format);
+    sources.clear();
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        QVERIFY(!ThumbnailCache::generate(path).isNull());
+    }
+}
+
+void ImageBenchmark::scaleImage_data(){
+    sizeData();
+}
+
+void ImageBenchmark::scaleImage(){
+    //one repaint of the viewport at fit to window zoomed in once, without cached tiles
+    QFETCH(QString, size);
+    QSharedPointer<TiledImage> image = source(size);
+    image->levels();
+    double s = qMin(1.0 * VIEWPORT.width() / image->width(), 1.0 * VIEWPORT.height() / image->height()) * 1.25;
+    QImage viewport(VIEWPORT, QImage::Format_ARGB32_Premultiplied);
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        ImagePyramid pyramid;
+        pyramid.setSource(image);
+        QPainter painter(&viewport);
+        pyramid.paint(&painter, QTransform::fromScale(s, s), viewport.rect());
+    }
+}
+
+void ImageBenchmark::zoomFrame_data(){
+    sizeData();
+}
+
+void ImageBenchmark::zoomFrame(){
+    //one frame of a zoom gesture: a new scale every time, within the 8 ms frame budget of the view
+    QFETCH(QString, size);
+    QSharedPointer<TiledImage> image = source(size);
+    image->levels();
+    double s = qMin(1.0 * VIEWPORT.width() / image->width(), 1.0 * VIEWPORT.height() / image->height()) * 1.25;
+    QImage viewport(VIEWPORT, QImage::Format_ARGB32_Premultiplied);
+    ImagePyramid pyramid;
+    pyramid.setSource(image);
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        s *= 1.01;
+        QPainter painter(&viewport);
+        pyramid.paint(&painter, QTransform::fromScale(s, s), viewport.rect(), -1, 8);
+    }
+}
+
+void ImageBenchmark::pan_data(){
+    sizeData();
+}
+
+void ImageBenchmark::pan(){
+    //what a frame of drag-panning paints: the viewport is moved, only the 16 px strip scrolled in is drawn
+    QFETCH(QString, size);
+    QSharedPointer<TiledImage> image = source(size);
+    image->levels();
+    double s = qMin(1.0 * VIEWPORT.width() / image->width(), 1.0 * VIEWPORT.height() / image->height()) * 4;
+    QImage viewport(VIEWPORT, QImage::Format_ARGB32_Premultiplied);
+    ImagePyramid pyramid;
+    pyramid.setSource(image);
+    QRect strip(VIEWPORT.width() - 16, 0, 16, VIEWPORT.height());
+    int offset = 0;
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        offset += 16;
+        QPainter painter(&viewport);
+        painter.setClipRect(strip);
+        pyramid.paint(&painter, QTransform::fromScale(s, s) * QTransform::fromTranslate(-offset, 0), strip);
+    }
+}
+
+void ImageBenchmark::rotate_data(){
+    sizeData();
+}
+
+void ImageBenchmark::rotate(){
+    QFETCH(QString, size);
+    EditPipeline edits(source(size));
+    edits.rotate(30);
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        QVERIFY(!edits.render().isNull());
+    }
+}
+
+void ImageBenchmark::rotate90_data(){
+    sizeData();
+}
+
+void ImageBenchmark::rotate90(){
+    QFETCH(QString, size);
+    EditPipeline edits(source(size));
+    edits.rotate(90);
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        QVERIFY(!edits.render().isNull());
+    }
+}
+
+void ImageBenchmark::crop_data(){
+    sizeData();
+}
+
+void ImageBenchmark::crop(){
+    QFETCH(QString, size);
+    QSharedPointer<TiledImage> image = source(size);
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        EditPipeline edits(image);
+        edits.crop(QRect(image->width() / 4, image->height() / 4, image->width() / 2, image->height() / 2));
+        QVERIFY(!edits.render().isNull());
+    }
+}
+
+void ImageBenchmark::resize_data(){
+    sizeData();
+}
+
+void ImageBenchmark::resize(){
+    //adjust size to half, through the resampler
+    QFETCH(QString, size);
+    EditPipeline edits(source(size));
+    edits.resize(edits.size() / 2);
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        QVERIFY(!edits.render().isNull());
+    }
+}
+
+void ImageBenchmark::resizeQt_data(){
+    sizeData();
+}
+
+void ImageBenchmark::resizeQt(){
+    //the same resize with QImage::scaled, for comparison with resize
+    QFETCH(QString, size);
+    QImage image = source(size)->toImage();
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        QVERIFY(!image.scaled(image.size() / 2, Qt::IgnoreAspectRatio, Qt::SmoothTransformation).isNull());
+    }
+}
+
+void ImageBenchmark::resample_data(){
+    //every pixel layout the resampler has kernels for
+    QTest::addColumn<QString>("size");
+    QTest::addColumn<int>("format");
+    QStringList wanted = qgetenv("BENCH_SIZES").isEmpty() ? QStringList() : QString(qgetenv("BENCH_SIZES")).split(',');
+    const char *names[] = {"rgb32", "rgb888", "gray8"};
+    const QImage::Format formats[] = {QImage::Format_RGB32, QImage::Format_RGB888, QImage::Format_Grayscale8};
+    for(const BenchSize &s : SIZES){
+        if(!wanted.isEmpty() && !wanted.contains(QString(s.name).remove("MP")))
+            continue;
+        for(int i = 0; i < 3; i++)
+            QTest::newRow(QString("%1 %2").arg(s.name, names[i]).toLatin1().constData()) << QString(s.name) << int(formats[i]);
+    }
+}
+
+void ImageBenchmark::resample(){
+    //both passes of the resampler alone, half the size with lanczos
+    QFETCH(QString, size);
+    QFETCH(int, format);
+    QImage image = source(size)->toImage().convertToFormat(QImage::Format(format));
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        QVERIFY(!Resampler::scaled(image, image.size() / 2, Resampler::Lanczos3).isNull());
+    }
+}
+
+void ImageBenchmark::filter_data(){
+    sizeData();
+}
+
+void ImageBenchmark::filter(){
+    //the full resolution pass when filters are committed
+    QFETCH(QString, size);
+    QImage image = source(size)->toImage();
+    ImageFilter::Settings settings;
+    settings.contrast = 20;
+    settings.gamma = 1.2;
+    settings.sharpen = 0.8;
+    settings.sharpenRadius = 2;
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        QVERIFY(!ImageFilter::apply(image, settings).isNull());
+    }
+}
+
+void ImageBenchmark::statistics_data(){
+    sizeData();
+}
+
+void ImageBenchmark::statistics(){
+    //the exact histograms of a whole image
+    QFETCH(QString, size);
+    QImage image = source(size)->toImage();
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        QVERIFY(ImageStatistics::compute(image).pixels == qint64(image.width()) * image.height());
+    }
+}
+
+void ImageBenchmark::snapshot_data(){
+    sizeData();
+}
+
+void ImageBenchmark::snapshot(){
+    //a session of edits recorded in the history, each one shown after it's done
+    QFETCH(QString, size);
+    QSharedPointer<TiledImage> image = source(size);
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        UndoHistory history;
+        UndoHistory::Entry load;
+        load.kind = UndoHistory::Load;
+        load.checkpoint = EditPipeline(image);
+        history.push(load);
+        for(int i = 0; i < 50; i++){
+            UndoHistory::Entry shot;
+            shot.kind = i % 2 ? UndoHistory::Crop : UndoHistory::Rotate;
+            shot.crop = QRect(1, 1, image->width() - 2 * i - 2, image->height() - 2 * i - 2);
+            shot.rotation = 5;
+            history.push(shot);
+            QVERIFY(!history.image().isNull());
+        }
+        while(history.undo())
+            QVERIFY(!history.image().isNull());
+    }
+}
+
+void ImageBenchmark::save_data(){
+    formatData();
+}
+
+void ImageBenchmark::save(){
+    QFETCH(QString, size);
+    QFETCH(QString, format);
+    EditPipeline edits(source(size));
+    QString path = dir.filePath("saved." + format);
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        QString error;
+        QCOMPARE(ImageSaver::write(edits, path, ImageSaver::Options(), 0, &error), ImageSaver::Saved);
+    }
+}
+
+void ImageBenchmark::saveJpeg90_data(){
+    sizeData();
+}
+
+void ImageBenchmark::saveJpeg90(){
+    //a quarter turn of a jpeg straight from disk, the lossless path when libjpeg is there
+    QFETCH(QString, size);
+    EditPipeline edits(ImageLoader::decode(file(size, "jpg")));
+    sources.clear();
+    edits.rotate(90);
+    QString path = dir.filePath("saved90.jpg");
+    startMeasuring();
+    QBENCHMARK{
+        Lap lap(&times);
+        QString error;
+        QCOMPARE(ImageSaver::write(edits, path, ImageSaver::Options(), 0, &error), ImageSaver::Saved);
+    }
+}
+
+QTEST_GUILESS_MAIN(ImageBenchmark)
+
+#include "benchmark.moc"
@@ -0,0 +1,59 @@
+# image core shared by the viewer and the benchmarks: decoding, tiles,
+# edits, resampling and saving. nothing in here depends on widgets.
+
+QT       += core gui concurrent
+
+INCLUDEPATH += $$PWD
+
+SOURCES += $$PWD/imagepyramid.cpp \
+        $$PWD/imageloader.cpp \
+        $$PWD/tiledimage.cpp \
+        $$PWD/undohistory.cpp \
+        $$PWD/editpipeline.cpp \
+        $$PWD/parallel.cpp \
+        $$PWD/resampler.cpp \
+        $$PWD/affineengine.cpp \
+        $$PWD/imagesaver.cpp \
+        $$PWD/batchprocessor.cpp \
+        $$PWD/trace.cpp \
+        $$PWD/decodecache.cpp \
+        $$PWD/thumbnailcache.cpp \
+        $$PWD/renderscheduler.cpp \
+        $$PWD/losslessjpeg.cpp \
+        $$PWD/imagefilter.cpp \
+        $$PWD/imagestatistics.cpp \
+        $$PWD/frameplayer.cpp \
+        $$PWD/memorygovernor.cpp \
+        $$PWD/metadataindex.cpp \
+        $$PWD/imagehash.cpp
+
+HEADERS += $$PWD/imagepyramid.h \
+        $$PWD/imageloader.h \
+        $$PWD/tiledimage.h \
+        $$PWD/undohistory.h \
+        $$PWD/editpipeline.h \
+        $$PWD/parallel.h \
+        $$PWD/resampler.h \
+        $$PWD/simd.h \
+        $$PWD/affineengine.h \
+        $$PWD/imagesaver.h \
+        $$PWD/batchprocessor.h \
+        $$PWD/trace.h \
+        $$PWD/decodecache.h \
+        $$PWD/thumbnailcache.h \
+        $$PWD/renderscheduler.h \
+        $$PWD/losslessjpeg.h \
+        $$PWD/imagefilter.h \
+        $$PWD/imagestatistics.h \
+        $$PWD/frameplayer.h \
+        $$PWD/memorygovernor.h \
+        $$PWD/metadataindex.h \
+        $$PWD/imagehash.h
+
+# lossless jpeg saving works on the dct coefficients and needs libjpeg,
+# without it jpegs are always encoded again
+packagesExist(libjpeg) {
+    DEFINES += HAVE_LIBJPEG
+    CONFIG += link_pkgconfig
+    PKGCONFIG += libjpeg
+}
@@ -0,0 +1,139 @@
+#include "decodecache.h"
+#include "imageloader.h"
+
+#include <QRunnable>
+#include <QFileInfo>
+
+namespace {
+
+class DecodeJob : public QRunnable
+{
+public:
+    DecodeJob(DecodeCache *cache, const QString &fileName) :
+        cache(cache), fileName(fileName)
+    {
+    }
+
+    void run(){
+        //the user went elsewhere meanwhile
+        bool skipped = !cache->isWanted(fileName);
+        QSharedPointer<TiledImage> image;
+        if(!skipped)
+            image = ImageLoader::decode(fileName);
+        QMetaObject::invokeMethod(cache, "deliver", Qt::QueuedConnection,
+                                  Q_ARG(QString, fileName), Q_ARG(QSharedPointer<TiledImage>, image),
+                                  Q_ARG(bool, skipped));
+    }
+
+private:
+    DecodeCache *cache;
+    QString fileName;
+};
+
+//cost in KB, the reduced levels are held in memory even for on-disk images
+int cost(const QSharedPointer<TiledImage> &image){
+    qint64 bytes = image->memoryBytes();
+    foreach(const QImage &level, image->levels())
+        bytes += level.sizeInBytes();
+    return int(qMax<qint64>(1, bytes / 1024));
+}
+
+}
+
+DecodeCache::DecodeCache(QObject *parent) :
+    QObject(parent), images(512 * 1024)
+{
+    qRegisterMetaType<QSharedPointer<TiledImage> >("QSharedPointer<TiledImage>");
+
+    //neighbours are decoded two at a time, the loader has threads of its own
+    pool.setMaxThreadCount(2);
+}
+
+DecodeCache::~DecodeCache()
+{
+    {
+        QMutexLocker locker(&wantedMutex);
+        wanted.clear();
+    }
+    pool.clear();
+    pool.waitForDone();
+}
+
+void DecodeCache::setMemoryBudget(qint64 bytes){
+    images.setMaxCost(int(qMax<qint64>(1, bytes / 1024)));
+}
+
+qint64 DecodeCache::memoryBudget() const{
+    return qint64(images.maxCost()) * 1024;
+}
+
+QSharedPointer<TiledImage> DecodeCache::image(const QString &fileName){
+    Entry *entry = images.object(fileName);
+    if(!entry)
+        return QSharedPointer<TiledImage>();
+    if(entry->modified != QFileInfo(fileName).lastModified()){
+        images.remove(fileName);
+        return QSharedPointer<TiledImage>();
+    }
+    return entry->image;
+}
+
+void DecodeCache::insert(const QString &fileName, const QSharedPointer<TiledImage> &image){
+    if(!image)
+        return;
+    Entry *entry = new Entry;
+    entry->image = image;
+    entry->modified = QFileInfo(fileName).lastModified();
+    images.insert(fileName, entry, cost(image));
+}
+
+void DecodeCache::clear(){
+    images.clear();
+}
+
+qint64 DecodeCache::release(qint64 bytes){
+    //a smaller budget makes the cache drop its least recently used images
+    int budget = images.maxCost();
+    int before = images.totalCost();
+    images.setMaxCost(int(qMax<qint64>(0, before - bytes / 1024)));
+    images.setMaxCost(budget);
+    return qint64(before - images.totalCost()) * 1024;
+}
+
+void DecodeCache::prefetch(const QStringList &fileNames){
+    {
+        QMutexLocker locker(&wantedMutex);
+        wanted = QSet<QString>(fileNames.begin(), fileNames.end());
+    }
+    //queued decodes of files that dropped out of the list skip themselves
+    for(int i = 0; i < fileNames.size(); i++){
+        const QString &fileName = fileNames.at(i);
+        if(pending.contains(fileName) || images.contains(fileName))
+            continue;
+        pending.insert(fileName);
+        pool.start(new DecodeJob(this, fileName), fileNames.size() - i);
+    }
+}
+
+bool DecodeCache::isPending(const QString &fileName) const{
+    return pending.contains(fileName);
+}
+
+bool DecodeCache::isWanted(const QString &fileName) const{
+    QMutexLocker locker(&wantedMutex);
+    return wanted.contains(fileName);
+}
+
+void DecodeCache::deliver(const QString &fileName, const QSharedPointer<TiledImage> &image, bool skipped){
+    pending.remove(fileName);
+    if(skipped){
+        //wanted again after the job had given up on it
+        if(isWanted(fileName)){
+            pending.insert(fileName);
+            pool.start(new DecodeJob(this, fileName), 1);
+        }
+        return;
+    }
+    insert(fileName, image);
+    emit ready(fileName, image);
+}
@@ -0,0 +1,64 @@
+#ifndef DECODECACHE_H
+#define DECODECACHE_H
+
+#include <QObject>
+#include <QCache>
+#include <QSet>
+#include <QMutex>
+#include <QDateTime>
+#include <QThreadPool>
+#include <QStringList>
+
+#include "tiledimage.h"
+
+// decoded images of the files around the one shown, so paging through a
+// folder doesn't wait for a decode. the files asked for are decoded on
+// background threads in the order they are likely to be needed, and the
+// least recently used images are dropped once the memory budget is
+// exceeded. a file that is no longer wanted is skipped before its decode
+// starts.
+class DecodeCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DecodeCache(QObject *parent = 0);
+    ~DecodeCache();
+
+    void setMemoryBudget(qint64 bytes);
+    qint64 memoryBudget() const;
+
+    //null when the file isn't decoded or has changed since
+    QSharedPointer<TiledImage> image(const QString &fileName);
+    void insert(const QString &fileName, const QSharedPointer<TiledImage> &image);
+    void clear();
+    //drops the least recently used images, returns the bytes they held
+    qint64 release(qint64 bytes);
+
+    //most wanted first, replaces the previous list
+    void prefetch(const QStringList &fileNames);
+    bool isPending(const QString &fileName) const;
+    bool isWanted(const QString &fileName) const;
+
+signals:
+    //a null image when the decode failed
+    void ready(const QString &fileName, const QSharedPointer<TiledImage> &image);
+
+private slots:
+    void deliver(const QString &fileName, const QSharedPointer<TiledImage> &image, bool skipped);
+
+private:
+    struct Entry
+    {
+        QSharedPointer<TiledImage> image;
+        QDateTime modified;
+    };
+
+    QCache<QString, Entry> images;
+    QSet<QString> pending;
+    QSet<QString> wanted;
+    mutable QMutex wantedMutex;
+    QThreadPool pool;
+};
+
+#endif // DECODECACHE_H
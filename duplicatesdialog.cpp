@@ -0,0 +1,182 @@
+#include "duplicatesdialog.h"
+#include "trace.h"
+
+#include <QVBoxLayout>
+#include <QHBoxLayout>
+#include <QGridLayout>
+#include <QFileDialog>
+#include <QDirIterator>
+#include <QImageReader>
+#include <QApplication>
+#include <QHeaderView>
+#include <QFileInfo>
+
+namespace {
+//longest side of the images compared side by side
+const int COMPARE_SIZE = 320;
+}
+
+DuplicatesDialog::DuplicatesDialog(QWidget *parent) :
+    QDialog(parent)
+{
+    setWindowTitle(tr("Find duplicates"));
+    index = new MetadataIndex(QString(), this);
+    connect(index, SIGNAL(progress(int,int)), this, SLOT(progress(int,int)));
+    connect(index, SIGNAL(finished()), this, SLOT(hashed()));
+
+    folder = new QLineEdit();
+    QPushButton *browseButton = new QPushButton(tr("Browse..."));
+    //at most this many of the 64 bits of either hash differ, 0 finds exact copies only
+    distance = new QSpinBox();
+    distance->setRange(0, 20);
+    distance->setValue(8);
+    distance->setPrefix(tr("distance "));
+    findButton = new QPushButton(tr("Find"));
+    progressBar = new QProgressBar();
+    progressBar->hide();
+    connect(browseButton, SIGNAL(clicked()), this, SLOT(browse()));
+    connect(findButton, SIGNAL(clicked()), this, SLOT(find()));
+
+    groups = new QTreeWidget();
+    groups->setHeaderLabels(QStringList() << tr("file") << tr("size") << tr("bytes"));
+    groups->header()->setSectionResizeMode(0, QHeaderView::Stretch);
+    groups->header()->setStretchLastSection(false);
+    connect(groups, SIGNAL(itemSelectionChanged()), this, SLOT(showSelected()));
+    connect(groups, SIGNAL(itemDoubleClicked(QTreeWidgetItem*,int)), this, SLOT(activate(QTreeWidgetItem*)));
+
+    left = new QLabel();
+    right = new QLabel();
+    leftInfo = new QLabel();
+    rightInfo = new QLabel();
+    foreach(QLabel *label, QList<QLabel *>() << left << right){
+        label->setFixedSize(COMPARE_SIZE, COMPARE_SIZE);
+        label->setAlignment(Qt::AlignCenter);
+    }
+
+    QHBoxLayout *top = new QHBoxLayout();
+    top->addWidget(folder);
+    top->addWidget(browseButton);
+    top->addWidget(distance);
+    top->addWidget(findButton);
+    QGridLayout *compare = new QGridLayout();
+    compare->addWidget(left, 0, 0);
+    compare->addWidget(right, 0, 1);
+    compare->addWidget(leftInfo, 1, 0);
+    compare->addWidget(rightInfo, 1, 1);
+    QVBoxLayout *vbox = new QVBoxLayout();
+    vbox->addLayout(top);
+    vbox->addWidget(progressBar);
+    vbox->addWidget(groups);
+    vbox->addLayout(compare);
+    setLayout(vbox);
+}
+
+void DuplicatesDialog::setFolder(const QString &folder){
+    this->folder->setText(QDir::toNativeSeparators(folder));
+}
+
+void DuplicatesDialog::browse(){
+    QString dir = QFileDialog::getExistingDirectory(this, tr("Folder"), QDir::fromNativeSeparators(folder->text()));
+    if(!dir.isEmpty())
+        setFolder(dir);
+}
+
+void DuplicatesDialog::find(){
+    TraceSpan span("DuplicatesDialog::list");
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    QStringList filters;
+    foreach(const QByteArray &format, QImageReader::supportedImageFormats())
+        filters << "*." + QString(format);
+    files.clear();
+    QDirIterator it(QDir::fromNativeSeparators(folder->text()), filters, QDir::Files, QDirIterator::Subdirectories);
+    while(it.hasNext())
+        files << it.next();
+    files.sort();
+    QApplication::restoreOverrideCursor();
+
+    groups->clear();
+    left->clear();
+    right->clear();
+    leftInfo->clear();
+    rightInfo->clear();
+    findButton->setEnabled(false);
+    progressBar->setRange(0, 0);
+    progressBar->show();
+    index->scan(files, true);
+}
+
+void DuplicatesDialog::progress(int done, int total){
+    progressBar->setRange(0, qMax(0, total));
+    progressBar->setValue(done);
+}
+
+void DuplicatesDialog::hashed(){
+    findButton->setEnabled(true);
+    progressBar->hide();
+
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    QVector<ImageHash> hashes;
+    QStringList names;
+    foreach(const QString &fileName, files){
+        MetadataIndex::Record record = index->record(fileName);
+        if(record.hashed){
+            hashes.append(record.hash);
+            names.append(fileName);
+        }
+    }
+    QVector<QVector<int> > found = ImageHash::group(hashes, distance->value());
+    foreach(const QVector<int> &group, found){
+        QTreeWidgetItem *top = new QTreeWidgetItem(groups, QStringList() << tr("%1 files").arg(group.size()));
+        foreach(int i, group){
+            MetadataIndex::Record record = index->record(names.at(i));
+            QSize size = record.orientedSize();
+            QTreeWidgetItem *item = new QTreeWidgetItem(top, QStringList()
+                                                        << QDir::toNativeSeparators(names.at(i))
+                                                        << QString("%1x%2").arg(size.width()).arg(size.height())
+                                                        << QString::number(record.fileSize));
+            item->setData(0, Qt::UserRole, names.at(i));
+        }
+        top->setExpanded(true);
+    }
+    QApplication::restoreOverrideCursor();
+    if(found.isEmpty())
+        leftInfo->setText(tr("No duplicates among %1 images").arg(names.size()));
+}
+
+void DuplicatesDialog::showSelected(){
+    QList<QTreeWidgetItem *> selected = groups->selectedItems();
+    if(selected.isEmpty())
+        return;
+    //the group itself compares its first two files
+    QTreeWidgetItem *item = selected.first();
+    QTreeWidgetItem *group = item->parent() ? item->parent() : item;
+    if(group->childCount() < 2)
+        return;
+    QTreeWidgetItem *first = group->child(0);
+    QTreeWidgetItem *other = item->parent() && item != first ? item : group->child(1);
+    showImage(left, leftInfo, first->data(0, Qt::UserRole).toString());
+    showImage(right, rightInfo, other->data(0, Qt::UserRole).toString());
+}
+
+void DuplicatesDialog::showImage(QLabel *label, QLabel *info, const QString &fileName){
+    MetadataIndex::Record record = index->record(fileName);
+    QImageReader reader(fileName);
+    reader.setAutoTransform(true);
+    //the scaled size is of the pixels as stored, before the rotation
+    QSize size = record.size;
+    if(size.isValid() && reader.supportsOption(QImageIOHandler::ScaledSize))
+        reader.setScaledSize(size.scaled(COMPARE_SIZE, COMPARE_SIZE, Qt::KeepAspectRatio).expandedTo(QSize(1, 1)));
+    QImage image = reader.read();
+    if(image.width() > COMPARE_SIZE || image.height() > COMPARE_SIZE)
+        image = image.scaled(COMPARE_SIZE, COMPARE_SIZE, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    label->setPixmap(QPixmap::fromImage(image));
+    info->setText(QString("%1\n%2x%3, %4 KB").arg(QFileInfo(fileName).fileName())
+                  .arg(record.orientedSize().width()).arg(record.orientedSize().height())
+                  .arg(record.fileSize / 1024));
+}
+
+void DuplicatesDialog::activate(QTreeWidgetItem *item){
+    QString fileName = item->data(0, Qt::UserRole).toString();
+    if(!fileName.isEmpty())
+        emit fileActivated(fileName);
+}
@@ -0,0 +1,55 @@
+#ifndef DUPLICATESDIALOG_H
+#define DUPLICATESDIALOG_H
+
+#include <QDialog>
+#include <QLineEdit>
+#include <QSpinBox>
+#include <QPushButton>
+#include <QProgressBar>
+#include <QTreeWidget>
+#include <QLabel>
+
+#include "metadataindex.h"
+
+// finds copies of the same picture in a folder and its subfolders: resized,
+// re-encoded or lightly edited ones. the hashes are kept in the metadata
+// index, a second search only decodes the files that changed. groups are
+// listed largest first; the selected file is shown next to the first one of
+// its group, a double click opens it in the viewer.
+class DuplicatesDialog : public QDialog
+{
+    Q_OBJECT
+
+public:
+    explicit DuplicatesDialog(QWidget *parent = 0);
+
+    void setFolder(const QString &folder);
+
+signals:
+    void fileActivated(const QString &fileName);
+
+private slots:
+    void browse();
+    void find();
+    void progress(int done, int total);
+    void hashed();
+    void showSelected();
+    void activate(QTreeWidgetItem *item);
+
+private:
+    void showImage(QLabel *label, QLabel *info, const QString &fileName);
+
+    MetadataIndex *index;
+    QLineEdit *folder;
+    QSpinBox *distance;
+    QPushButton *findButton;
+    QProgressBar *progressBar;
+    QTreeWidget *groups;
+    QLabel *left;
+    QLabel *leftInfo;
+    QLabel *right;
+    QLabel *rightInfo;
+    QStringList files;
+};
+
+#endif // DUPLICATESDIALOG_H
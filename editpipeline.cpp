@@ -0,0 +1,102 @@
+#include "editpipeline.h"
+#include "resampler.h"
+#include "trace.h"
+
+#include <QtMath>
+
+EditPipeline::EditPipeline()
+{
+}
+
+EditPipeline::EditPipeline(const QSharedPointer<TiledImage> &source) :
+    src(source), outputSize(source ? source->size() : QSize())
+{
+    //on-disk images are decoded as stored, the exif orientation is the first edit.
+    //like QImageReader's auto transform: mirror first, then turn
+    QImageIOHandler::Transformations orientation = source ? source->orientation() : QImageIOHandler::TransformationNone;
+    if(orientation & QImageIOHandler::TransformationMirror)
+        matrix *= QTransform(-1, 0, 0, 1, outputSize.width(), 0);
+    if(orientation & QImageIOHandler::TransformationFlip)
+        matrix *= QTransform(1, 0, 0, -1, 0, outputSize.height());
+    if(orientation & QImageIOHandler::TransformationRotate90)
+        rotate(90);
+}
+
+bool EditPipeline::isNull() const{
+    return src.isNull();
+}
+
+QSharedPointer<TiledImage> EditPipeline::source() const{
+    return src;
+}
+
+QTransform EditPipeline::transform() const{
+    return matrix;
+}
+
+QSize EditPipeline::size() const{
+    return outputSize;
+}
+
+QRect EditPipeline::rect() const{
+    return QRect(QPoint(0, 0), outputSize);
+}
+
+bool EditPipeline::isIdentity() const{
+    return matrix.isIdentity() && src && outputSize == src->size();
+}
+
+void EditPipeline::crop(const QRect &rect){
+    QRect r = rect.intersected(this->rect());
+    if(r.isEmpty())
+        return;
+    matrix *= QTransform::fromTranslate(-r.x(), -r.y());
+    outputSize = r.size();
+}
+
+void EditPipeline::rotate(double degrees){
+    //like QImage::transformed, the output grows to the bounding box of the rotated image
+    QTransform rm;
+    rm.rotate(degrees);
+    QRectF box = rm.mapRect(QRectF(rect()));
+    matrix *= rm * QTransform::fromTranslate(-box.x(), -box.y());
+    outputSize = box.toAlignedRect().size();
+}
+
+void EditPipeline::resize(const QSize &size){
+    if(size.isEmpty() || outputSize.isEmpty())
+        return;
+    matrix *= QTransform::fromScale(1.0 * size.width() / outputSize.width(),
+                                    1.0 * size.height() / outputSize.height());
+    outputSize = size;
+}
+
+QImage EditPipeline::render(AffineEngine::Progress *progress) const{
+    if(!src)
+        return QImage();
+    TraceSpan span("EditPipeline::render", outputSize);
+    if(isIdentity())
+        return src->toImage();
+
+    //a pure integer translation is a crop, no resampling needed
+    if(matrix.type() == QTransform::TxTranslate && matrix.dx() == qRound(matrix.dx()) && matrix.dy() == qRound(matrix.dy()))
+        return src->region(QRect(QPoint(-qRound(matrix.dx()), -qRound(matrix.dy())), outputSize));
+
+    if(qint64(outputSize.width()) * outputSize.height() * 4 > TiledImage::MATERIALIZE_LIMIT)
+        return QImage();
+
+    //crop and resize only: one separable resample of the cropped source area
+    if(matrix.type() <= QTransform::TxScale && matrix.m11() > 0 && matrix.m22() > 0){
+        QRectF area = matrix.inverted().mapRect(QRectF(rect()));
+        QRect aligned = area.toRect();
+        if(qAbs(area.x() - aligned.x()) < 0.01 && qAbs(area.y() - aligned.y()) < 0.01
+                && qAbs(area.width() - aligned.width()) < 0.01 && qAbs(area.height() - aligned.height()) < 0.01){
+            QImage pixels = src->region(aligned);
+            if(!pixels.isNull())
+                return Resampler::scaled(pixels, outputSize);
+        }
+    }
+
+    //rotations: a single resample straight from the source tiles, on all cores
+    return AffineEngine::transformed(src, matrix, outputSize, progress);
+}
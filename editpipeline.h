@@ -0,0 +1,39 @@
+#ifndef EDITPIPELINE_H
+#define EDITPIPELINE_H
+
+#include <QTransform>
+#include <QSharedPointer>
+
+#include "tiledimage.h"
+#include "affineengine.h"
+
+// non-destructive chain of crop, rotate and resize edits on a source image.
+// the edits are only recorded and folded into one affine transform from the
+// source to the output plus the output size (the clip). no pixels are
+// touched until render(), which resamples the source exactly once.
+class EditPipeline
+{
+public:
+    EditPipeline();
+    explicit EditPipeline(const QSharedPointer<TiledImage> &source);
+
+    bool isNull() const;
+    QSharedPointer<TiledImage> source() const;
+    QTransform transform() const;
+    QSize size() const;
+    QRect rect() const;
+    bool isIdentity() const;
+
+    void crop(const QRect &rect);
+    void rotate(double degrees);
+    void resize(const QSize &size);
+
+    QImage render(AffineEngine::Progress *progress = 0) const;
+
+private:
+    QSharedPointer<TiledImage> src;
+    QTransform matrix;
+    QSize outputSize;
+};
+
+#endif // EDITPIPELINE_H
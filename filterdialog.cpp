@@ -0,0 +1,84 @@
+#include "filterdialog.h"
+
+#include <QVBoxLayout>
+#include <QDialogButtonBox>
+#include <QPushButton>
+
+FilterDialog::FilterDialog(QWidget *parent) :
+    QDialog(parent)
+{
+    setWindowTitle(tr("Filters"));
+    QVBoxLayout *vbox = new QVBoxLayout();
+    QFormLayout *form = new QFormLayout();
+
+    //slider positions are integers, gamma, blur and sharpening are tenths or hundredths
+    brightness = addSlider(form, tr("Brightness"), -100, 100);
+    contrast = addSlider(form, tr("Contrast"), -100, 100);
+    gamma = addSlider(form, tr("Gamma"), 10, 300);
+    black = addSlider(form, tr("Black level"), 0, 254);
+    white = addSlider(form, tr("White level"), 1, 255);
+    grayscale = new QCheckBox(tr("Grayscale"));
+    form->addRow(grayscale);
+    blur = addSlider(form, tr("Blur radius"), 0, 200);
+    sharpen = addSlider(form, tr("Sharpen amount"), 0, 500);
+    sharpenRadius = addSlider(form, tr("Sharpen radius"), 5, 100);
+    connect(grayscale, SIGNAL(toggled(bool)), this, SLOT(changed()));
+
+    QDialogButtonBox *buttonBox = new QDialogButtonBox(QDialogButtonBox::Ok
+                                                        | QDialogButtonBox::Cancel
+                                                        | QDialogButtonBox::Reset);
+    connect(buttonBox, SIGNAL(accepted()), this, SLOT(accept()));
+    connect(buttonBox, SIGNAL(rejected()), this, SLOT(reject()));
+    connect(buttonBox->button(QDialogButtonBox::Reset), SIGNAL(clicked()), this, SLOT(resetSettings()));
+
+    vbox->addLayout(form);
+    vbox->addWidget(buttonBox);
+    setLayout(vbox);
+
+    delay.setSingleShot(true);
+    delay.setInterval(15);
+    connect(&delay, SIGNAL(timeout()), this, SIGNAL(settingsChanged()));
+    resetSettings();
+}
+
+QSlider *FilterDialog::addSlider(QFormLayout *form, const QString &label, int minimum, int maximum){
+    QSlider *slider = new QSlider(Qt::Horizontal);
+    slider->setRange(minimum, maximum);
+    slider->setMinimumWidth(200);
+    form->addRow(label, slider);
+    connect(slider, SIGNAL(valueChanged(int)), this, SLOT(changed()));
+    return slider;
+}
+
+ImageFilter::Settings FilterDialog::settings() const{
+    ImageFilter::Settings s;
+    s.brightness = brightness->value();
+    s.contrast = contrast->value();
+    s.gamma = gamma->value() / 100.0;
+    s.black = qMin(black->value(), white->value() - 1);
+    s.white = white->value();
+    s.grayscale = grayscale->isChecked();
+    s.blur = blur->value() / 10.0;
+    s.sharpen = sharpen->value() / 100.0;
+    s.sharpenRadius = sharpenRadius->value() / 10.0;
+    return s;
+}
+
+void FilterDialog::resetSettings(){
+    ImageFilter::Settings s;
+    brightness->setValue(s.brightness);
+    contrast->setValue(s.contrast);
+    gamma->setValue(qRound(s.gamma * 100));
+    black->setValue(s.black);
+    white->setValue(s.white);
+    grayscale->setChecked(s.grayscale);
+    blur->setValue(qRound(s.blur * 10));
+    sharpen->setValue(qRound(s.sharpen * 100));
+    sharpenRadius->setValue(qRound(s.sharpenRadius * 10));
+}
+
+void FilterDialog::changed(){
+    //the settings are read when the timer fires, changes meanwhile are folded into it
+    if(!delay.isActive())
+        delay.start();
+}
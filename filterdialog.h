@@ -0,0 +1,48 @@
+#ifndef FILTERDIALOG_H
+#define FILTERDIALOG_H
+
+#include <QDialog>
+#include <QSlider>
+#include <QCheckBox>
+#include <QFormLayout>
+#include <QTimer>
+
+#include "imagefilter.h"
+
+// sliders for the settings of an ImageFilter. changes are reported at most
+// every few milliseconds, so dragging a slider previews its latest position
+// instead of queueing a preview for every step.
+class FilterDialog : public QDialog
+{
+    Q_OBJECT
+
+public:
+    explicit FilterDialog(QWidget *parent = 0);
+
+    ImageFilter::Settings settings() const;
+
+signals:
+    void settingsChanged();
+
+public slots:
+    void resetSettings();
+
+private slots:
+    void changed();
+
+private:
+    QSlider *addSlider(QFormLayout *form, const QString &label, int minimum, int maximum);
+
+    QSlider *brightness;
+    QSlider *contrast;
+    QSlider *gamma;
+    QSlider *black;
+    QSlider *white;
+    QCheckBox *grayscale;
+    QSlider *blur;
+    QSlider *sharpen;
+    QSlider *sharpenRadius;
+    QTimer delay;
+};
+
+#endif // FILTERDIALOG_H
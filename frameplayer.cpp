@@ -0,0 +1,392 @@
+#include "frameplayer.h"
+#include "trace.h"
+
+#include <QImageReader>
+#include <QPainter>
+#include <QRunnable>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+
+#include <cstring>
+
+struct FramePlayer::Frame
+{
+    int index = -1;
+    //the pixels that changed and where they go, the whole frame when its size changed
+    QImage patch;
+    QPoint offset;
+    QSize size;
+    int delay = 0;
+};
+
+//shared by the player and the decoder of one position in the file
+struct FramePlayer::Queue
+{
+    QMutex mutex;
+    QWaitCondition space;
+    QQueue<Frame> frames;
+    qint64 bytes = 0;
+    qint64 budget = 0;
+    bool stop = false;
+    //the decoder is done, nothing more will be queued
+    bool finished = false;
+};
+
+namespace {
+
+//bounding box of the pixels that differ, the images have the same size and format
+QRect changedRect(const QImage &a, const QImage &b){
+    const int bpp = a.depth() / 8;
+    const int bytes = a.width() * bpp;
+    const int height = a.height();
+    int top = 0;
+    while(top < height && memcmp(a.constScanLine(top), b.constScanLine(top), bytes) == 0)
+        top++;
+    if(top == height)
+        return QRect();
+    int bottom = height - 1;
+    while(bottom > top && memcmp(a.constScanLine(bottom), b.constScanLine(bottom), bytes) == 0)
+        bottom--;
+    int left = a.width();
+    int right = -1;
+    for(int y = top; y <= bottom; y++){
+        const uchar *p = a.constScanLine(y);
+        const uchar *q = b.constScanLine(y);
+        int x = 0;
+        while(x < left && memcmp(p + x * bpp, q + x * bpp, bpp) == 0)
+            x++;
+        left = x;
+        x = a.width() - 1;
+        while(x > right && memcmp(p + x * bpp, q + x * bpp, bpp) == 0)
+            x--;
+        right = x;
+    }
+    return QRect(left, top, right - left + 1, bottom - top + 1);
+}
+
+//like browsers, tiny delays are taken for files that didn't set one
+int frameDelay(int ms){
+    return ms < 20 ? 100 : ms;
+}
+
+}
+
+class FramePlayer::Decoder : public QRunnable
+{
+public:
+    Decoder(QObject *player, const QSharedPointer<Queue> &queue, const QString &fileName, int from, bool loop) :
+        player(player), queue(queue), fileName(fileName), from(from), loop(loop)
+    {
+    }
+
+    void run(){
+        QImageReader reader(fileName);
+        int loops = 0;
+        int index = 0;
+        //pages can be jumped to, animation frames build on the ones before and are decoded and dropped
+        if(from > 0 && reader.jumpToImage(from))
+            index = from;
+        QImage previous;
+        while(true){
+            QImage image;
+            {
+                TraceSpan span("FramePlayer::decode");
+                image = reader.read();
+                span.setSize(image.size());
+            }
+            if(image.isNull()){
+                //the end, the animation starts over as often as the file asks for
+                if(index == 0 || !loop || (reader.loopCount() >= 0 && loops >= reader.loopCount()))
+                    break;
+                loops++;
+                reader.setFileName(fileName);
+                index = from = 0;
+                continue;
+            }
+            int delay = reader.nextImageDelay();
+            if(image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32
+                    && image.format() != QImage::Format_ARGB32_Premultiplied)
+                image = image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+            if(index < from){
+                previous = image;
+                index++;
+                continue;
+            }
+
+            Frame frame;
+            frame.index = index;
+            frame.size = image.size();
+            frame.delay = delay;
+            if(previous.size() != image.size() || previous.format() != image.format()){
+                frame.patch = image;
+            }else{
+                QRect changed = changedRect(previous, image);
+                frame.offset = changed.topLeft();
+                if(!changed.isEmpty())
+                    frame.patch = changed.size() == image.size() ? image : image.copy(changed);
+            }
+            previous = image;
+            if(!push(frame))
+                return;
+            index++;
+        }
+        {
+            QMutexLocker locker(&queue->mutex);
+            queue->finished = true;
+        }
+        QMetaObject::invokeMethod(player, "tick", Qt::QueuedConnection);
+    }
+
+private:
+    //waits for room in the queue, false once the player moved on
+    bool push(const Frame &frame){
+        QMutexLocker locker(&queue->mutex);
+        qint64 bytes = frame.patch.sizeInBytes();
+        while(!queue->stop && !queue->frames.isEmpty() && queue->bytes + bytes > queue->budget)
+            queue->space.wait(&queue->mutex);
+        if(queue->stop)
+            return false;
+        bool wasEmpty = queue->frames.isEmpty();
+        queue->frames.enqueue(frame);
+        queue->bytes += bytes;
+        locker.unlock();
+        //the player may be waiting for this one
+        if(wasEmpty)
+            QMetaObject::invokeMethod(player, "tick", Qt::QueuedConnection);
+        return true;
+    }
+
+    QObject *player;
+    QSharedPointer<Queue> queue;
+    QString fileName;
+    int from;
+    bool loop;
+};
+
+FramePlayer::FramePlayer(QObject *parent) :
+    QObject(parent)
+{
+    timer.setSingleShot(true);
+    timer.setTimerType(Qt::PreciseTimer);
+    connect(&timer, SIGNAL(timeout()), this, SLOT(tick()));
+    clock.start();
+
+    //one decoder at a time, a replaced one stops after its current frame
+    pool.setMaxThreadCount(1);
+}
+
+FramePlayer::~FramePlayer()
+{
+    close();
+    pool.waitForDone();
+}
+
+bool FramePlayer::open(const QString &fileName){
+    close();
+    QImageReader reader(fileName);
+    int frames = reader.imageCount();
+    if(frames == 1 || (frames <= 0 && !reader.supportsAnimation()))
+        return false;
+    this->fileName = fileName;
+    count = qMax(0, frames);
+    animation = reader.supportsAnimation();
+    //the first frame is on screen already, the loader decoded it
+    startDecoding(0);
+    steps = 1;
+    quiet = true;
+    return true;
+}
+
+void FramePlayer::close(){
+    pause();
+    if(queue){
+        QMutexLocker locker(&queue->mutex);
+        queue->stop = true;
+        queue->space.wakeAll();
+    }
+    queue.clear();
+    fileName.clear();
+    count = 0;
+    animation = false;
+    steps = 0;
+    quiet = false;
+    shown = -1;
+    composite = QImage();
+    dirty = QRect();
+}
+
+bool FramePlayer::isOpen() const{
+    return !queue.isNull();
+}
+
+bool FramePlayer::isAnimation() const{
+    return animation;
+}
+
+bool FramePlayer::isPlaying() const{
+    return playing;
+}
+
+int FramePlayer::frameCount() const{
+    return count;
+}
+
+int FramePlayer::currentFrame() const{
+    return shown;
+}
+
+void FramePlayer::setCacheBudget(qint64 bytes){
+    budget = bytes;
+    if(queue){
+        QMutexLocker locker(&queue->mutex);
+        queue->budget = bytes;
+        queue->space.wakeAll();
+    }
+}
+
+void FramePlayer::play(){
+    if(!isOpen() || playing)
+        return;
+    //played to the end, start over
+    if(steps == 0 && isDrained()){
+        startDecoding(0);
+        steps = 1;
+    }
+    playing = true;
+    deadline = clock.elapsed();
+    emit playingChanged(true);
+    tick();
+}
+
+void FramePlayer::pause(){
+    timer.stop();
+    if(!playing)
+        return;
+    playing = false;
+    emit playingChanged(false);
+}
+
+void FramePlayer::togglePlaying(){
+    if(playing)
+        pause();
+    else
+        play();
+}
+
+void FramePlayer::seek(int frame){
+    if(!isOpen() || frame < 0 || (count > 0 && frame >= count))
+        return;
+    startDecoding(frame);
+    steps = 1;
+    quiet = false;
+    tick();
+}
+
+void FramePlayer::nextFrame(){
+    if(!isOpen())
+        return;
+    pause();
+    //the decoder is ahead, the next frame is usually waiting
+    steps++;
+    quiet = false;
+    tick();
+}
+
+void FramePlayer::previousFrame(){
+    if(!isOpen())
+        return;
+    pause();
+    if(shown > 0)
+        seek(shown - 1);
+    else if(count > 0)
+        seek(count - 1);
+}
+
+void FramePlayer::startDecoding(int from){
+    if(queue){
+        QMutexLocker locker(&queue->mutex);
+        queue->stop = true;
+        queue->space.wakeAll();
+    }
+    queue = QSharedPointer<Queue>(new Queue);
+    queue->budget = budget;
+    pool.start(new Decoder(this, queue, fileName, from, animation));
+}
+
+bool FramePlayer::take(Frame *frame){
+    QMutexLocker locker(&queue->mutex);
+    if(queue->frames.isEmpty())
+        return false;
+    *frame = queue->frames.dequeue();
+    queue->bytes -= frame->patch.sizeInBytes();
+    queue->space.wakeAll();
+    return true;
+}
+
+bool FramePlayer::isDrained() const{
+    QMutexLocker locker(&queue->mutex);
+    return queue->finished && queue->frames.isEmpty();
+}
+
+QRect FramePlayer::show(const Frame &frame){
+    //only the changed rectangle is drawn over the frame before
+    QRect changed;
+    if(composite.size() != frame.size || frame.patch.size() == frame.size){
+        composite = frame.patch;
+        changed = composite.rect();
+    }else if(!frame.patch.isNull()){
+        QPainter painter(&composite);
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+        painter.drawImage(frame.offset, frame.patch);
+        changed = QRect(frame.offset, frame.patch.size());
+    }
+    shown = frame.index;
+    return changed;
+}
+
+void FramePlayer::tick(){
+    if(!queue)
+        return;
+    Frame frame;
+    bool changed = false;
+    if(steps > 0){
+        bool took = false;
+        while(steps > 0 && take(&frame)){
+            dirty |= show(frame);
+            steps--;
+            took = true;
+        }
+        //stepped past the last page
+        if(steps > 0 && isDrained())
+            steps = 0;
+        if(took && steps == 0){
+            changed = !quiet;
+            quiet = false;
+            deadline = clock.elapsed() + frameDelay(frame.delay);
+        }
+    }
+    if(playing && steps == 0){
+        qint64 now = clock.elapsed();
+        //frames are due at absolute times, after a late tick the frames due by now are
+        //drawn over each other and only the last one is shown
+        while(now >= deadline && take(&frame)){
+            dirty |= show(frame);
+            changed = true;
+            deadline += frameDelay(frame.delay);
+            //stalled for long, timing starts over instead of racing to catch up
+            if(now - deadline > 1000)
+                deadline = now;
+        }
+        if(now < deadline)
+            timer.start(int(deadline - now));
+        else if(isDrained())
+            pause();
+        //otherwise the decoder is behind, the frame it queues next calls tick()
+    }
+    if(changed){
+        QRect rect = dirty;
+        dirty = QRect();
+        emit frameChanged(shown, composite, rect);
+    }
+}
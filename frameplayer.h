@@ -0,0 +1,89 @@
+#ifndef FRAMEPLAYER_H
+#define FRAMEPLAYER_H
+
+#include <QObject>
+#include <QImage>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QSharedPointer>
+
+// plays the frames of an animation (gif, apng, webp) or steps through the
+// pages of a multi-page file (tiff). a background thread decodes the frames
+// ahead into a queue bounded by a memory budget; a frame is kept as the
+// rectangle that changed since the frame before it, so only the shown
+// frame and the one the decoder compares against are held in full. frames
+// are due at absolute times, a late timer doesn't delay the ones after it.
+class FramePlayer : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FramePlayer(QObject *parent = 0);
+    ~FramePlayer();
+
+    //false, and nothing to play, when the file has a single frame
+    bool open(const QString &fileName);
+    void close();
+    bool isOpen() const;
+    //whether the frames have delays, pages of a document don't
+    bool isAnimation() const;
+    bool isPlaying() const;
+    //0 when the format can't tell without decoding everything
+    int frameCount() const;
+    int currentFrame() const;
+
+    //bytes of decoded frames held ahead of the shown one
+    void setCacheBudget(qint64 bytes);
+
+public slots:
+    void play();
+    void pause();
+    void togglePlaying();
+    void seek(int frame);
+    void nextFrame();
+    void previousFrame();
+
+signals:
+    //changed is the part that differs from the frame announced before, the frame stays the
+    //player's buffer: holding on to it makes the next frame copy it in full
+    void frameChanged(int index, const QImage &frame, const QRect &changed);
+    void playingChanged(bool playing);
+
+private slots:
+    void tick();
+
+private:
+    struct Queue;
+    struct Frame;
+    class Decoder;
+
+    void startDecoding(int from);
+    bool take(Frame *frame);
+    //the decoder is done and everything it decoded was shown
+    bool isDrained() const;
+    //returns the rectangle it drew
+    QRect show(const Frame &frame);
+
+    QString fileName;
+    int count = 0;
+    bool animation = false;
+    bool playing = false;
+    //frames to take before the next one is shown, after a seek or a step
+    int steps = 0;
+    //the first frame is on screen already, it is taken without being announced
+    bool quiet = false;
+    int shown = -1;
+    QImage composite;
+    //drawn since the last frame announced, quiet frames add to it too
+    QRect dirty;
+    QSharedPointer<Queue> queue;
+    qint64 budget = 64 * 1024 * 1024;
+
+    QTimer timer;
+    QElapsedTimer clock;
+    qint64 deadline = 0;
+    QThreadPool pool;
+};
+
+#endif // FRAMEPLAYER_H
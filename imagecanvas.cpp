@@ -0,0 +1,277 @@
+#include "imagecanvas.h"
+#include "trace.h"
+
+#include <QPainter>
+#include <QPaintEvent>
+#include <QScrollBar>
+#include <QSignalBlocker>
+#include <QtMath>
+
+#include <cstring>
+
+ImageCanvas::ImageCanvas(QWidget *parent) :
+    QAbstractScrollArea(parent)
+{
+    setFrameStyle(QFrame::NoFrame);
+    //every pixel is painted, nothing to erase first
+    viewport()->setAttribute(Qt::WA_OpaquePaintEvent);
+    viewport()->setBackgroundRole(QPalette::Dark);
+    rubberBand = new QRubberBand(QRubberBand::Rectangle, viewport());
+    renderer = new RenderScheduler(this);
+    connect(renderer, SIGNAL(refined()), viewport(), SLOT(update()));
+}
+
+void ImageCanvas::setImage(const QImage &image){
+    setPipeline(EditPipeline(TiledImage::fromImage(image)));
+}
+
+void ImageCanvas::setPipeline(const EditPipeline &pipeline){
+    preview = false;
+    played = QImage();
+    edits = pipeline;
+    renderer->setSource(pipeline.source());
+    updateScrollBars();
+    viewport()->update();
+    emit pipelineChanged();
+}
+
+void ImageCanvas::setPreview(const QImage &preview, const QSize &fullSize){
+    //show a reduced image stretched over the geometry of the real one
+    this->preview = true;
+    played = QImage();
+    //shown until the next slider move, not worth narrowing
+    edits = EditPipeline(TiledImage::fromImage(preview, false));
+    edits.resize(fullSize);
+    renderer->setSource(edits.source());
+    updateScrollBars();
+    viewport()->update();
+    emit pipelineChanged();
+}
+
+void ImageCanvas::setFrame(const QImage &frame, const QRect &changed){
+    TraceSpan span("ImageCanvas::setFrame", changed.size());
+    QRect rect = changed.intersected(frame.rect());
+    if(played.size() != frame.size() || played.format() != frame.format()){
+        //the pipeline was shown until now, everything is redrawn once
+        played = frame.copy();
+        rect = frame.rect();
+    }else{
+        int bpp = frame.depth() / 8;
+        for(int y = rect.top(); y <= rect.bottom(); y++)
+            memcpy(played.scanLine(y) + rect.left() * bpp, frame.constScanLine(y) + rect.left() * bpp, rect.width() * bpp);
+    }
+    if(rect.isEmpty())
+        return;
+    //the frame covers the target, smoothing reaches a pixel beyond the changed ones
+    QRect target(imageOrigin(), scaledSize());
+    double sx = 1.0 * target.width() / frame.width();
+    double sy = 1.0 * target.height() / frame.height();
+    QRectF scaled(target.x() + rect.x() * sx, target.y() + rect.y() * sy, rect.width() * sx, rect.height() * sy);
+    viewport()->update(scaled.toAlignedRect().adjusted(-1, -1, 1, 1));
+}
+
+QImage ImageCanvas::frame() const{
+    return played;
+}
+
+const EditPipeline &ImageCanvas::pipeline() const{
+    return edits;
+}
+
+QSharedPointer<TiledImage> ImageCanvas::source() const{
+    return preview ? QSharedPointer<TiledImage>() : edits.source();
+}
+
+QSize ImageCanvas::imageSize() const{
+    return edits.size();
+}
+
+bool ImageCanvas::hasImage() const{
+    return !preview && !edits.isNull();
+}
+
+double ImageCanvas::scale() const{
+    return zoom;
+}
+
+QSize ImageCanvas::scaledSize() const{
+    return edits.isNull() ? QSize() : zoom * edits.size();
+}
+
+void ImageCanvas::setScale(double scale){
+    setScale(scale, viewport()->rect().center());
+}
+
+void ImageCanvas::setScale(double scale, const QPoint &anchor){
+    QPointF fixed = mapToImage(anchor);
+    zoom = scale;
+    {
+        //the whole viewport is painted again, no point in moving the old pixels
+        QSignalBlocker blockH(horizontalScrollBar());
+        QSignalBlocker blockV(verticalScrollBar());
+        updateScrollBars();
+        horizontalScrollBar()->setValue(qRound(fixed.x() * zoom - anchor.x()));
+        verticalScrollBar()->setValue(qRound(fixed.y() * zoom - anchor.y()));
+    }
+    placeSelection();
+    viewport()->update();
+}
+
+void ImageCanvas::centerOn(const QRectF &imageRect){
+    QPointF center = imageRect.center() * zoom;
+    horizontalScrollBar()->setValue(qRound(center.x() - viewport()->width() / 2.0));
+    verticalScrollBar()->setValue(qRound(center.y() - viewport()->height() / 2.0));
+}
+
+QPoint ImageCanvas::imageOrigin() const{
+    QSize size = scaledSize();
+    QSize area = viewport()->size();
+    return QPoint(size.width() < area.width() ? (area.width() - size.width()) / 2 : -horizontalScrollBar()->value(),
+                  size.height() < area.height() ? (area.height() - size.height()) / 2 : -verticalScrollBar()->value());
+}
+
+QPointF ImageCanvas::mapToImage(const QPoint &point) const{
+    return QPointF(point - imageOrigin()) / zoom;
+}
+
+QPoint ImageCanvas::mapFromImage(const QPointF &point) const{
+    return (point * zoom).toPoint() + imageOrigin();
+}
+
+void ImageCanvas::updateScrollBars(){
+    QSize size = scaledSize();
+    QSize area = viewport()->size();
+    horizontalScrollBar()->setPageStep(area.width());
+    horizontalScrollBar()->setSingleStep(qMax(1, area.width() / 20));
+    horizontalScrollBar()->setRange(0, qMax(0, size.width() - area.width()));
+    verticalScrollBar()->setPageStep(area.height());
+    verticalScrollBar()->setSingleStep(qMax(1, area.height() / 20));
+    verticalScrollBar()->setRange(0, qMax(0, size.height() - area.height()));
+}
+
+void ImageCanvas::resizeEvent(QResizeEvent *e){
+    QAbstractScrollArea::resizeEvent(e);
+    updateScrollBars();
+    placeSelection();
+}
+
+void ImageCanvas::scrollContentsBy(int dx, int dy){
+    //moves what is on screen, only the uncovered strips get a paint event
+    viewport()->scroll(dx, dy);
+    placeSelection();
+}
+
+void ImageCanvas::paintEvent(QPaintEvent *e){
+    TraceSpan span("ImageCanvas::paintEvent", e->rect().size());
+    QPainter painter(viewport());
+    QRect target(imageOrigin(), scaledSize());
+    QRegion background = e->region();
+    if(!edits.isNull())
+        background -= target;
+    for(const QRect &rect : background)
+        painter.fillRect(rect, palette().dark());
+    if(edits.isNull() || edits.size().isEmpty())
+        return;
+    painter.setPen(palette().color(QPalette::Shadow));
+    painter.drawRect(target.adjusted(-1, -1, 0, 0));
+    painter.setClipRegion(e->region().intersected(target));
+
+    //playback draws the frame as it is, there are no edits or levels for it
+    if(!played.isNull()){
+        painter.setRenderHint(QPainter::SmoothPixmapTransform, zoom != 1);
+        painter.drawImage(target, played);
+        emit painted();
+        return;
+    }
+
+    //output of the edits, scaled and scrolled into the viewport
+    QTransform toViewport = edits.transform()
+            * QTransform::fromScale(1.0 * target.width() / edits.size().width(), 1.0 * target.height() / edits.size().height())
+            * QTransform::fromTranslate(target.x(), target.y());
+    renderer->paint(&painter, toViewport, e->rect(), viewport()->size());
+    emit painted();
+}
+
+QPointF ImageCanvas::inscribed(const QPointF &point) const{
+    QSize size = edits.size();
+    return QPointF(qBound(0.0, point.x(), qreal(size.width())), qBound(0.0, point.y(), qreal(size.height())));
+}
+
+QRect ImageCanvas::selection() const{
+    return QRectF(selectionStart, selectionEnd).normalized().toAlignedRect().intersected(QRect(QPoint(), edits.size()));
+}
+
+bool ImageCanvas::hasSelection() const{
+    return rubberBand->isVisible();
+}
+
+void ImageCanvas::showSelection(){
+    placeSelection();
+    rubberBand->show();
+}
+
+void ImageCanvas::hideSelection(){
+    if(!rubberBand->isVisible())
+        return;
+    rubberBand->hide();
+    emit selectionChanged();
+}
+
+void ImageCanvas::placeSelection(){
+    rubberBand->setGeometry(QRect(mapFromImage(selectionStart), mapFromImage(selectionEnd)).normalized());
+}
+
+void ImageCanvas::mousePressEvent(QMouseEvent *e){
+    if(edits.isNull())
+        return;
+    if(e->button() == Qt::RightButton || (e->button() == Qt::LeftButton && (e->modifiers() & Qt::ShiftModifier))){
+        selecting = true;
+        selectionStart = selectionEnd = inscribed(mapToImage(e->localPos().toPoint()));
+        showSelection();
+    }else if(e->button() == Qt::LeftButton){
+        panning = true;
+        panFrom = e->localPos().toPoint();
+        viewport()->setCursor(Qt::ClosedHandCursor);
+    }
+}
+
+void ImageCanvas::mouseMoveEvent(QMouseEvent *e){
+    if(selecting){
+        selectionEnd = inscribed(mapToImage(e->localPos().toPoint()));
+        placeSelection();
+    }else if(panning){
+        QPoint delta = e->localPos().toPoint() - panFrom;
+        panFrom = e->localPos().toPoint();
+        horizontalScrollBar()->setValue(horizontalScrollBar()->value() - delta.x());
+        verticalScrollBar()->setValue(verticalScrollBar()->value() - delta.y());
+    }
+}
+
+void ImageCanvas::mouseReleaseEvent(QMouseEvent *){
+    if(panning)
+        viewport()->unsetCursor();
+    if(selecting)
+        emit selectionChanged();
+    selecting = false;
+    panning = false;
+}
+
+void ImageCanvas::mouseDoubleClickEvent(QMouseEvent *){
+    if(rubberBand->isVisible())
+        hideSelection();
+    else if(hasImage() && !selection().isEmpty()){
+        showSelection();
+        emit selectionChanged();
+    }
+}
+
+void ImageCanvas::wheelEvent(QWheelEvent *e){
+    //a notch of the wheel is one zoom step
+    double steps = e->angleDelta().y() / 120.0;
+    if(steps == 0 || edits.isNull()){
+        QAbstractScrollArea::wheelEvent(e);
+        return;
+    }
+    emit zoomRequested(qPow(1.25, steps), e->position().toPoint());
+    e->accept();
+}
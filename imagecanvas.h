@@ -0,0 +1,93 @@
+#ifndef IMAGECANVAS_H
+#define IMAGECANVAS_H
+
+#include <QAbstractScrollArea>
+#include <QRubberBand>
+#include "renderscheduler.h"
+#include "editpipeline.h"
+
+// scrollable view of the output of an edit pipeline. replaces the scroll
+// area around a widget as large as the zoomed image: the view keeps its own
+// scale and scroll offset, the edits are evaluated while painting at screen
+// resolution, and only the exposed part of the viewport is painted. when
+// panning the pixels already on screen are moved (QWidget::scroll) so only
+// the strip scrolled into view is drawn. while zooming or panning frames
+// are drawn fast and refined once the view is still (RenderScheduler).
+// dragging pans, shift+drag or a right-button drag selects a region.
+class ImageCanvas : public QAbstractScrollArea
+{
+    Q_OBJECT
+
+public:
+    explicit ImageCanvas(QWidget *parent = 0);
+
+    void setImage(const QImage &image);
+    void setPipeline(const EditPipeline &pipeline);
+    void setPreview(const QImage &preview, const QSize &fullSize);
+    //a frame of a playing animation, of the size of the image, drawn in its place
+    //without touching the pipeline. only the changed part is copied into the canvas'
+    //own buffer and repainted. the next pipeline set replaces it
+    void setFrame(const QImage &frame, const QRect &changed);
+    //the frame drawn, null when the pipeline is
+    QImage frame() const;
+    const EditPipeline &pipeline() const;
+    QSharedPointer<TiledImage> source() const;
+    QSize imageSize() const;
+    bool hasImage() const;
+
+    //the image is shown scaled by scale, centered while it is smaller than the viewport
+    double scale() const;
+    QSize scaledSize() const;
+    //keeps the image point under anchor where it is, the center of the viewport by default
+    void setScale(double scale);
+    void setScale(double scale, const QPoint &anchor);
+    void centerOn(const QRectF &imageRect);
+    //between viewport and image coordinates
+    QPointF mapToImage(const QPoint &point) const;
+    QPoint mapFromImage(const QPointF &point) const;
+
+    //the selected region in image coordinates
+    QRect selection() const;
+    bool hasSelection() const;
+    void showSelection();
+    void hideSelection();
+
+signals:
+    //the wheel turned over the view, factor > 1 zooms in
+    void zoomRequested(double factor, const QPoint &anchor);
+    //another image or other edits are shown
+    void pipelineChanged();
+    //a selection was made or hidden
+    void selectionChanged();
+    //the image was drawn
+    void painted();
+
+protected:
+    void paintEvent(QPaintEvent *e);
+    void resizeEvent(QResizeEvent *e);
+    void scrollContentsBy(int dx, int dy);
+    void mousePressEvent(QMouseEvent *e);
+    void mouseMoveEvent(QMouseEvent *e);
+    void mouseReleaseEvent(QMouseEvent *e);
+    void mouseDoubleClickEvent(QMouseEvent *e);
+    void wheelEvent(QWheelEvent *e);
+
+private:
+    QPoint imageOrigin() const;
+    QPointF inscribed(const QPointF &point) const;
+    void updateScrollBars();
+    void placeSelection();
+
+    EditPipeline edits;
+    RenderScheduler *renderer;
+    bool preview = false;
+    QImage played;
+    double zoom = 1;
+    QRubberBand *rubberBand;
+    QPointF selectionStart, selectionEnd;
+    bool selecting = false;
+    bool panning = false;
+    QPoint panFrom;
+};
+
+#endif // IMAGECANVAS_H
@@ -0,0 +1,391 @@
+#include "imagefilter.h"
+#include "resampler.h"
+#include "parallel.h"
+#include "simd.h"
+#include "trace.h"
+
+#include <QRunnable>
+#include <QtMath>
+
+#include <utility>
+
+namespace {
+
+//rows handed to a thread at least
+const int MIN_BAND_ROWS = 32;
+//fraction bits of the sharpening amount
+const int AMOUNT_BITS = 12;
+//luma weights with 7 fraction bits, small enough for 16-bit sums
+const int GRAY_R = 38;
+const int GRAY_G = 75;
+const int GRAY_B = 15;
+
+inline uchar grayOf(int r, int g, int b){
+    return uchar((GRAY_R * r + GRAY_G * g + GRAY_B * b + 64) >> 7);
+}
+
+inline uchar clamp8(int v){
+    return uchar(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+void grayScalar(const uchar *src, uchar *dst, int channels, int from, int width){
+    for(int x = from; x < width; x++){
+        const uchar *p = src + x * channels;
+        //RGB888 is r, g, b in memory, RGB32 is b, g, r, a
+        dst[x] = channels == 3 ? grayOf(p[0], p[1], p[2]) : grayOf(p[2], p[1], p[0]);
+    }
+}
+
+void sharpenScalar(const uchar *src, const uchar *blurred, uchar *dst, int amount, int from, int bytes){
+    for(int i = from; i < bytes; i++){
+        int d = src[i] - blurred[i];
+        dst[i] = clamp8(src[i] + ((d * (1 << (16 - AMOUNT_BITS)) * amount) >> 16));
+    }
+}
+
+#ifdef IV_SSE2
+//16 RGB32 pixels at a time, returns how many were done
+int graySse2(const uchar *src, uchar *dst, int width){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights = _mm_set_epi16(0, GRAY_R, GRAY_G, GRAY_B, 0, GRAY_R, GRAY_G, GRAY_B);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i half = _mm_set1_epi32(64);
+    int x = 0;
+    for(; x + 16 <= width; x += 16){
+        __m128i sums[4];
+        for(int k = 0; k < 4; k++){
+            __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + (x + k * 4) * 4));
+            //b*wb + g*wg and r*wr of every pixel, then the two added up
+            __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(p, zero), weights);
+            __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(p, zero), weights);
+            __m128i s = _mm_madd_epi16(_mm_packs_epi32(lo, hi), ones);
+            sums[k] = _mm_srai_epi32(_mm_add_epi32(s, half), 7);
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(sums[0], sums[1]), _mm_packs_epi32(sums[2], sums[3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), packed);
+    }
+    return x;
+}
+
+//src + (src - blurred) * amount on 16 bytes at a time, channel agnostic. the
+//difference is shifted up so the high half of the product is the result
+int sharpenSse2(const uchar *src, const uchar *blurred, uchar *dst, int amount, int bytes){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i k = _mm_set1_epi16(short(amount));
+    int i = 0;
+    for(; i + 16 <= bytes; i += 16){
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(blurred + i));
+        __m128i slo = _mm_unpacklo_epi8(s, zero);
+        __m128i shi = _mm_unpackhi_epi8(s, zero);
+        __m128i dlo = _mm_slli_epi16(_mm_sub_epi16(slo, _mm_unpacklo_epi8(b, zero)), 16 - AMOUNT_BITS);
+        __m128i dhi = _mm_slli_epi16(_mm_sub_epi16(shi, _mm_unpackhi_epi8(b, zero)), 16 - AMOUNT_BITS);
+        slo = _mm_add_epi16(slo, _mm_mulhi_epi16(dlo, k));
+        shi = _mm_add_epi16(shi, _mm_mulhi_epi16(dhi, k));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(slo, shi));
+    }
+    return i;
+}
+#endif
+
+#ifdef IV_AVX2
+//same as sharpenSse2 with 32 bytes per step, unpack and pack both work per lane
+IV_TARGET_AVX2
+int sharpenAvx2(const uchar *src, const uchar *blurred, uchar *dst, int amount, int bytes){
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i k = _mm256_set1_epi16(short(amount));
+    int i = 0;
+    for(; i + 32 <= bytes; i += 32){
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(blurred + i));
+        __m256i slo = _mm256_unpacklo_epi8(s, zero);
+        __m256i shi = _mm256_unpackhi_epi8(s, zero);
+        __m256i dlo = _mm256_slli_epi16(_mm256_sub_epi16(slo, _mm256_unpacklo_epi8(b, zero)), 16 - AMOUNT_BITS);
+        __m256i dhi = _mm256_slli_epi16(_mm256_sub_epi16(shi, _mm256_unpackhi_epi8(b, zero)), 16 - AMOUNT_BITS);
+        slo = _mm256_add_epi16(slo, _mm256_mulhi_epi16(dlo, k));
+        shi = _mm256_add_epi16(shi, _mm256_mulhi_epi16(dhi, k));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_packus_epi16(slo, shi));
+    }
+    return i;
+}
+#endif
+
+void grayRow(const uchar *src, uchar *dst, int channels, int width){
+    int done = 0;
+#ifdef IV_SSE2
+    if(channels == 4)
+        done = graySse2(src, dst, width);
+#endif
+    grayScalar(src, dst, channels, done, width);
+}
+
+void sharpenRow(const uchar *src, const uchar *blurred, uchar *dst, int amount, int bytes){
+    int done = 0;
+#ifdef IV_AVX2
+    if(cpuHasAvx2())
+        done = sharpenAvx2(src, blurred, dst, amount, bytes);
+#endif
+#ifdef IV_SSE2
+    done += sharpenSse2(src + done, blurred + done, dst + done, amount, bytes - done);
+#endif
+    sharpenScalar(src, blurred, dst, amount, done, bytes);
+}
+
+//a sharpened edge can push a color above its alpha, which premultiplied pixels can't have
+void fixPremultiplied(QRgb *line, int width){
+    for(int x = 0; x < width; x++){
+        QRgb p = line[x];
+        int a = qAlpha(p);
+        if(qRed(p) > a || qGreen(p) > a || qBlue(p) > a)
+            line[x] = qRgba(qMin(qRed(p), a), qMin(qGreen(p), a), qMin(qBlue(p), a), a);
+    }
+}
+
+//8-bit formats the tone curve can be applied to byte by byte, alpha stays straight
+QImage prepare(const QImage &image){
+    switch(image.format()){
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_RGB888:
+    case QImage::Format_Grayscale8:
+        return image;
+    default:
+        return image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    }
+}
+
+QImage gray(const QImage &image){
+    if(image.format() == QImage::Format_Grayscale8)
+        return image;
+    QImage src = image.format() == QImage::Format_RGB888 ? image : image.convertToFormat(QImage::Format_RGB32);
+    QImage out(src.size(), QImage::Format_Grayscale8);
+    if(out.isNull())
+        return QImage();
+
+    //raw pointers, the bands must not detach the images concurrently
+    const uchar *srcBits = src.constBits();
+    const int srcStride = src.bytesPerLine();
+    uchar *outBits = out.bits();
+    const int outStride = out.bytesPerLine();
+    const int channels = src.depth() / 8;
+    parallelFor(src.height(), MIN_BAND_ROWS, [&](int begin, int end){
+        for(int y = begin; y < end; y++)
+            grayRow(srcBits + y * srcStride, outBits + y * outStride, channels, src.width());
+    });
+    return out;
+}
+
+QImage tone(const QImage &image, const ImageFilter::Settings &settings){
+    QVector<uchar> lut = ImageFilter::curve(settings);
+    bool identity = true;
+    for(int i = 0; i < 256; i++)
+        identity = identity && lut.at(i) == i;
+
+    //opaque images become Grayscale8, a quarter of the memory for the passes after
+    QImage out = settings.grayscale && !image.hasAlphaChannel() ? gray(image) : prepare(image);
+    bool grayColors = settings.grayscale && out.format() == QImage::Format_ARGB32;
+    if(out.isNull() || (identity && !grayColors))
+        return out;
+
+    const uchar *table = lut.constData();
+    uchar *bits = out.bits();
+    const int stride = out.bytesPerLine();
+    const int channels = out.depth() / 8;
+    const int width = out.width();
+    parallelFor(out.height(), MIN_BAND_ROWS, [&](int begin, int end){
+        for(int y = begin; y < end; y++){
+            uchar *line = bits + y * stride;
+            if(channels == 4){
+                QRgb *pixels = reinterpret_cast<QRgb *>(line);
+                for(int x = 0; x < width; x++){
+                    QRgb p = pixels[x];
+                    int r = qRed(p), g = qGreen(p), b = qBlue(p);
+                    if(grayColors)
+                        r = g = b = grayOf(r, g, b);
+                    pixels[x] = qRgba(table[r], table[g], table[b], qAlpha(p));
+                }
+            }else{
+                for(int i = 0; i < width * channels; i++)
+                    line[i] = table[line[i]];
+            }
+        }
+    });
+    return out;
+}
+
+QImage sharpened(const QImage &image, double amount, double sigma){
+    //same premultiplied pixels as the blur works on
+    QImage src = image.format() == QImage::Format_ARGB32 ? image.convertToFormat(QImage::Format_ARGB32_Premultiplied) : image;
+    if(sigma < 0.2)
+        return src;
+    QImage out = Resampler::blurred(src, sigma);
+    if(out.isNull())
+        return QImage();
+
+    const uchar *srcBits = src.constBits();
+    const int srcStride = src.bytesPerLine();
+    uchar *outBits = out.bits();
+    const int outStride = out.bytesPerLine();
+    const int bytes = src.width() * src.depth() / 8;
+    const int k = qRound(qMin(amount, 7.9) * (1 << AMOUNT_BITS));
+    const bool premultiplied = out.format() == QImage::Format_ARGB32_Premultiplied;
+    parallelFor(src.height(), MIN_BAND_ROWS, [&](int begin, int end){
+        for(int y = begin; y < end; y++){
+            uchar *line = outBits + y * outStride;
+            sharpenRow(srcBits + y * srcStride, line, line, k, bytes);
+            if(premultiplied)
+                fixPremultiplied(reinterpret_cast<QRgb *>(line), src.width());
+        }
+    });
+    return out;
+}
+
+class FilterJob : public QRunnable
+{
+public:
+    FilterJob(QObject *filter, const EditPipeline &image, const ImageFilter::Settings &settings, int generation,
+              const QSharedPointer<AffineEngine::Progress> &progress) :
+        filter(filter), image(image), settings(settings), generation(generation), progress(progress)
+    {
+    }
+
+    void run(){
+        TraceSpan span("ImageFilter::job", image.size());
+        QImage pixels = image.render(progress.data());
+        if(!pixels.isNull() && !progress->isCanceled())
+            pixels = ImageFilter::apply(pixels, settings, 1, progress.data());
+        bool canceled = progress->isCanceled();
+        //narrowed here, it looks at every pixel
+        QSharedPointer<TiledImage> result;
+        if(!canceled)
+            result = TiledImage::fromImage(std::move(pixels));
+        QMetaObject::invokeMethod(filter, "deliver", Qt::QueuedConnection, Q_ARG(int, generation),
+                                  Q_ARG(QSharedPointer<TiledImage>, result), Q_ARG(bool, canceled));
+    }
+
+private:
+    QObject *filter;
+    EditPipeline image;
+    ImageFilter::Settings settings;
+    int generation;
+    QSharedPointer<AffineEngine::Progress> progress;
+};
+
+}
+
+ImageFilter::ImageFilter(QObject *parent) :
+    QObject(parent)
+{
+    qRegisterMetaType<QSharedPointer<TiledImage> >("QSharedPointer<TiledImage>");
+
+    //one full resolution pass at a time, it runs on all cores anyway
+    pool.setMaxThreadCount(1);
+    ticker.setInterval(100);
+    connect(&ticker, SIGNAL(timeout()), this, SLOT(tick()));
+}
+
+ImageFilter::~ImageFilter()
+{
+    cancel();
+    pool.waitForDone();
+}
+
+void ImageFilter::start(const EditPipeline &image, const Settings &settings){
+    cancel();
+    generation++;
+    running = true;
+    current = QSharedPointer<AffineEngine::Progress>(new AffineEngine::Progress);
+    pool.start(new FilterJob(this, image, settings, generation, current));
+    ticker.start();
+    emit progressChanged(0);
+}
+
+void ImageFilter::cancel(){
+    if(current)
+        current->cancel();
+}
+
+bool ImageFilter::isRunning() const{
+    return running;
+}
+
+int ImageFilter::progress() const{
+    return current ? current->percent() : 0;
+}
+
+void ImageFilter::deliver(int generation, const QSharedPointer<TiledImage> &image, bool canceled){
+    //a job replaced by a newer one reports nothing
+    if(generation != this->generation)
+        return;
+    running = false;
+    ticker.stop();
+    if(canceled){
+        emit canceled();
+    }else{
+        emit progressChanged(100);
+        emit finished(image);
+    }
+}
+
+void ImageFilter::tick(){
+    emit progressChanged(progress());
+}
+
+bool ImageFilter::Settings::isIdentity() const{
+    return brightness == 0 && contrast == 0 && gamma == 1 && black == 0 && white == 255
+            && !grayscale && blur <= 0 && sharpen <= 0;
+}
+
+bool ImageFilter::Settings::operator==(const Settings &other) const{
+    return brightness == other.brightness && contrast == other.contrast && gamma == other.gamma
+            && black == other.black && white == other.white && grayscale == other.grayscale
+            && blur == other.blur && sharpen == other.sharpen && sharpenRadius == other.sharpenRadius;
+}
+
+bool ImageFilter::Settings::operator!=(const Settings &other) const{
+    return !(*this == other);
+}
+
+QImage ImageFilter::apply(const QImage &image, const Settings &settings, double scale, AffineEngine::Progress *progress){
+    if(image.isNull() || settings.isIdentity())
+        return image;
+    TraceSpan span("ImageFilter::apply", image.size());
+    //progress is counted in passes, cancel is checked between them
+    int passes = 1 + (settings.blur > 0) + (settings.sharpen > 0);
+    int done = 0;
+    QImage out = tone(image, settings);
+    if(progress)
+        progress->report(++done, passes);
+    if(!out.isNull() && settings.blur > 0){
+        if(progress && progress->isCanceled())
+            return QImage();
+        out = Resampler::blurred(out, settings.blur * scale);
+        if(progress)
+            progress->report(++done, passes);
+    }
+    if(!out.isNull() && settings.sharpen > 0){
+        if(progress && progress->isCanceled())
+            return QImage();
+        out = sharpened(out, settings.sharpen, settings.sharpenRadius * scale);
+    }
+    return out;
+}
+
+void ImageFilter::luma(const uchar *pixels, int channels, uchar *gray, int width){
+    grayRow(pixels, gray, channels, width);
+}
+
+QVector<uchar> ImageFilter::curve(const Settings &settings){
+    QVector<uchar> table(256);
+    double range = qMax(1, settings.white - settings.black);
+    double gamma = qMax(0.01, settings.gamma);
+    //contrast stretches around middle gray, up to five times
+    double contrast = settings.contrast >= 0 ? 1 + settings.contrast / 25.0 : 1 + settings.contrast / 100.0;
+    for(int v = 0; v < 256; v++){
+        double t = qBound(0.0, (v - settings.black) / range, 1.0);
+        t = qPow(t, 1 / gamma);
+        t = (t - 0.5) * contrast + 0.5 + settings.brightness / 200.0;
+        table[v] = uchar(qBound(0, qRound(t * 255), 255));
+    }
+    return table;
+}
@@ -0,0 +1,83 @@
+#ifndef IMAGEFILTER_H
+#define IMAGEFILTER_H
+
+#include <QObject>
+#include <QImage>
+#include <QVector>
+#include <QThreadPool>
+#include <QTimer>
+#include <QSharedPointer>
+
+#include "editpipeline.h"
+
+// tonal and convolution filters on rendered pixels. levels, gamma, contrast
+// and brightness are folded into one lookup table, then come grayscale, a
+// gaussian blur and an unsharp mask. every pass runs on bands of rows in
+// parallel; the blur uses the vectorized passes of the resampler, the gray
+// conversion and the sharpening blend are vectorized here. radii are in
+// pixels of the full resolution image, a preview computed on a reduced copy
+// passes its scale so it looks like the final result. the full resolution
+// pass of an edit pipeline runs on a background thread and can be canceled.
+class ImageFilter : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Settings{
+        //-100..100
+        int brightness = 0;
+        int contrast = 0;
+        double gamma = 1;
+        //input levels, mapped to 0 and 255
+        int black = 0;
+        int white = 255;
+        bool grayscale = false;
+        //standard deviation of the gaussian
+        double blur = 0;
+        //unsharp mask, 1 adds the detail lost by blurring once more
+        double sharpen = 0;
+        double sharpenRadius = 1;
+
+        bool isIdentity() const;
+        bool operator==(const Settings &other) const;
+        bool operator!=(const Settings &other) const;
+    };
+
+    explicit ImageFilter(QObject *parent = 0);
+    ~ImageFilter();
+
+    //renders the pipeline and filters it in the background, a running job is canceled
+    void start(const EditPipeline &image, const Settings &settings);
+    bool isRunning() const;
+    int progress() const;
+
+    //a null image when canceled
+    static QImage apply(const QImage &image, const Settings &settings, double scale = 1,
+                        AffineEngine::Progress *progress = 0);
+    //the tone curve of the settings, 256 entries
+    static QVector<uchar> curve(const Settings &settings);
+    //luma of a line of RGB32 (4 channels) or RGB888 (3) pixels, vectorized
+    static void luma(const uchar *pixels, int channels, uchar *gray, int width);
+
+public slots:
+    void cancel();
+
+signals:
+    void progressChanged(int percent);
+    //the image is null when there wasn't enough memory for it
+    void finished(const QSharedPointer<TiledImage> &image);
+    void canceled();
+
+private slots:
+    void deliver(int generation, const QSharedPointer<TiledImage> &image, bool canceled);
+    void tick();
+
+private:
+    QThreadPool pool;
+    QTimer ticker;
+    QSharedPointer<AffineEngine::Progress> current;
+    int generation = 0;
+    bool running = false;
+};
+
+#endif // IMAGEFILTER_H
@@ -0,0 +1,253 @@
+#include "imagehash.h"
+#include "resampler.h"
+#include "simd.h"
+#include "trace.h"
+
+#include <QImageReader>
+#include <QHash>
+#include <QtMath>
+
+#include <algorithm>
+
+namespace {
+
+const int DCT_SIZE = 32;
+const int LOW = 8;
+//longest side of the reduced decode, the dct only sees 32x32 pixels
+const int DECODE_SIZE = 128;
+
+//the first LOW rows of the dct-ii matrix, transposed: basis[n][k] for pixel n and frequency k
+struct DctBasis
+{
+    float basis[DCT_SIZE][LOW];
+
+    DctBasis(){
+        for(int n = 0; n < DCT_SIZE; n++){
+            for(int k = 0; k < LOW; k++){
+                double scale = k == 0 ? qSqrt(1.0 / DCT_SIZE) : qSqrt(2.0 / DCT_SIZE);
+                basis[n][k] = float(scale * qCos(M_PI * (2 * n + 1) * k / (2.0 * DCT_SIZE)));
+            }
+        }
+    }
+};
+
+const DctBasis &dctBasis(){
+    static const DctBasis basis;
+    return basis;
+}
+
+//the LOW x LOW lowest frequencies of the 2d dct of a DCT_SIZE x DCT_SIZE block:
+//rows first, then columns, eight frequencies at a time
+void lowDct(const float *pixels, float *out){
+    const DctBasis &d = dctBasis();
+    float rows[DCT_SIZE][LOW];
+#ifdef IV_SSE2
+    for(int r = 0; r < DCT_SIZE; r++){
+        __m128 a0 = _mm_setzero_ps();
+        __m128 a1 = _mm_setzero_ps();
+        for(int c = 0; c < DCT_SIZE; c++){
+            __m128 x = _mm_set1_ps(pixels[r * DCT_SIZE + c]);
+            a0 = _mm_add_ps(a0, _mm_mul_ps(x, _mm_loadu_ps(d.basis[c])));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(x, _mm_loadu_ps(d.basis[c] + 4)));
+        }
+        _mm_storeu_ps(rows[r], a0);
+        _mm_storeu_ps(rows[r] + 4, a1);
+    }
+    for(int j = 0; j < LOW; j++){
+        __m128 a0 = _mm_setzero_ps();
+        __m128 a1 = _mm_setzero_ps();
+        for(int r = 0; r < DCT_SIZE; r++){
+            __m128 b = _mm_set1_ps(d.basis[r][j]);
+            a0 = _mm_add_ps(a0, _mm_mul_ps(b, _mm_loadu_ps(rows[r])));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(b, _mm_loadu_ps(rows[r] + 4)));
+        }
+        _mm_storeu_ps(out + j * LOW, a0);
+        _mm_storeu_ps(out + j * LOW + 4, a1);
+    }
+#else
+    for(int r = 0; r < DCT_SIZE; r++){
+        for(int k = 0; k < LOW; k++){
+            float sum = 0;
+            for(int c = 0; c < DCT_SIZE; c++)
+                sum += pixels[r * DCT_SIZE + c] * d.basis[c][k];
+            rows[r][k] = sum;
+        }
+    }
+    for(int j = 0; j < LOW; j++){
+        for(int k = 0; k < LOW; k++){
+            float sum = 0;
+            for(int r = 0; r < DCT_SIZE; r++)
+                sum += d.basis[r][j] * rows[r][k];
+            out[j * LOW + k] = sum;
+        }
+    }
+#endif
+}
+
+//near matches by a metric: every child is filed under its distance to the parent, so a search
+//within d of a query only descends into children filed between distance - d and distance + d
+class BkTree
+{
+public:
+    void insert(const ImageHash &hash, int value){
+        if(nodes.isEmpty()){
+            nodes.append(Node(hash, value));
+            return;
+        }
+        int at = 0;
+        while(true){
+            int d = ImageHash::distance(hash, nodes.at(at).hash);
+            if(d == 0){
+                nodes[at].values.append(value);
+                return;
+            }
+            int child = nodes.at(at).child(d);
+            if(child < 0){
+                nodes[at].children.append(qMakePair(d, nodes.size()));
+                nodes.append(Node(hash, value));
+                return;
+            }
+            at = child;
+        }
+    }
+
+    QVector<int> find(const ImageHash &hash, int maxDistance) const{
+        QVector<int> found;
+        QVector<int> stack;
+        if(!nodes.isEmpty())
+            stack.append(0);
+        while(!stack.isEmpty()){
+            const Node &node = nodes.at(stack.takeLast());
+            int d = ImageHash::distance(hash, node.hash);
+            if(d <= maxDistance)
+                found += node.values;
+            for(int i = 0; i < node.children.size(); i++){
+                if(qAbs(node.children.at(i).first - d) <= maxDistance)
+                    stack.append(node.children.at(i).second);
+            }
+        }
+        return found;
+    }
+
+private:
+    struct Node
+    {
+        Node() {}
+        Node(const ImageHash &hash, int value) : hash(hash) { values.append(value); }
+
+        int child(int distance) const{
+            for(int i = 0; i < children.size(); i++)
+                if(children.at(i).first == distance)
+                    return children.at(i).second;
+            return -1;
+        }
+
+        ImageHash hash;
+        //hashes at distance 0 share the node
+        QVector<int> values;
+        QVector<QPair<int, int> > children;
+    };
+
+    QVector<Node> nodes;
+};
+
+int root(QVector<int> &parent, int i){
+    while(parent.at(i) != i){
+        parent[i] = parent.at(parent.at(i));
+        i = parent.at(i);
+    }
+    return i;
+}
+
+}
+
+ImageHash ImageHash::compute(const QImage &image){
+    ImageHash hash;
+    if(image.isNull())
+        return hash;
+    //the shape isn't kept, a copy cropped a little or stretched has to hash the same
+    QImage small = Resampler::scaled(image, QSize(DCT_SIZE, DCT_SIZE)).convertToFormat(QImage::Format_Grayscale8);
+    QImage steps = Resampler::scaled(small, QSize(LOW + 1, LOW));
+
+    float pixels[DCT_SIZE * DCT_SIZE];
+    for(int y = 0; y < DCT_SIZE; y++){
+        const uchar *line = small.constScanLine(y);
+        for(int x = 0; x < DCT_SIZE; x++)
+            pixels[y * DCT_SIZE + x] = line[x];
+    }
+    float low[LOW * LOW];
+    lowDct(pixels, low);
+    //the median leaves out the average brightness, it would only shift every coefficient
+    float sorted[LOW * LOW - 1];
+    std::copy(low + 1, low + LOW * LOW, sorted);
+    std::nth_element(sorted, sorted + (LOW * LOW - 1) / 2, sorted + LOW * LOW - 1);
+    float median = sorted[(LOW * LOW - 1) / 2];
+    for(int i = 0; i < LOW * LOW; i++)
+        if(low[i] > median)
+            hash.phash |= quint64(1) << i;
+
+    for(int y = 0; y < LOW; y++){
+        const uchar *line = steps.constScanLine(y);
+        for(int x = 0; x < LOW; x++)
+            if(line[x] < line[x + 1])
+                hash.dhash |= quint64(1) << (y * LOW + x);
+    }
+    return hash;
+}
+
+bool ImageHash::fromFile(const QString &fileName, ImageHash *hash){
+    TraceSpan span("ImageHash::fromFile");
+    QImageReader reader(fileName);
+    //a copy that has the exif rotation applied to its pixels hashes the same
+    reader.setAutoTransform(true);
+    QSize size = reader.size();
+    if(size.isValid() && reader.supportsOption(QImageIOHandler::ScaledSize) && qMax(size.width(), size.height()) > DECODE_SIZE)
+        reader.setScaledSize(size.scaled(DECODE_SIZE, DECODE_SIZE, Qt::KeepAspectRatio).expandedTo(QSize(1, 1)));
+    QImage image = reader.read();
+    span.setSize(image.size());
+    if(image.isNull())
+        return false;
+    *hash = compute(image);
+    return true;
+}
+
+int ImageHash::distance(const ImageHash &a, const ImageHash &b){
+    return qMax(qPopulationCount(a.phash ^ b.phash), qPopulationCount(a.dhash ^ b.dhash));
+}
+
+QVector<QVector<int> > ImageHash::group(const QVector<ImageHash> &hashes, int maxDistance){
+    TraceSpan span("ImageHash::group");
+    BkTree tree;
+    for(int i = 0; i < hashes.size(); i++)
+        tree.insert(hashes.at(i), i);
+
+    //near matches are joined transitively
+    QVector<int> parent(hashes.size());
+    for(int i = 0; i < parent.size(); i++)
+        parent[i] = i;
+    for(int i = 0; i < hashes.size(); i++){
+        foreach(int j, tree.find(hashes.at(i), maxDistance)){
+            int a = root(parent, i);
+            int b = root(parent, j);
+            if(a != b)
+                parent[qMax(a, b)] = qMin(a, b);
+        }
+    }
+
+    QHash<int, int> groupOf;
+    QVector<QVector<int> > groups;
+    for(int i = 0; i < hashes.size(); i++){
+        int r = root(parent, i);
+        if(!groupOf.contains(r)){
+            groupOf.insert(r, groups.size());
+            groups.append(QVector<int>());
+        }
+        groups[groupOf.value(r)].append(i);
+    }
+    groups.erase(std::remove_if(groups.begin(), groups.end(), [](const QVector<int> &g){ return g.size() < 2; }),
+                 groups.end());
+    std::stable_sort(groups.begin(), groups.end(), [](const QVector<int> &a, const QVector<int> &b){
+        return a.size() > b.size();
+    });
+    return groups;
+}
@@ -0,0 +1,30 @@
+#ifndef IMAGEHASH_H
+#define IMAGEHASH_H
+
+#include <QImage>
+#include <QVector>
+
+// perceptual hashes that stay the same for resized, re-encoded and lightly
+// edited copies of a picture. phash keeps which of the lowest frequencies
+// of a 32x32 dct are above their median, dhash which way the brightness
+// steps in a 9x8 copy. both come from a reduced decode (dct scaling for
+// jpeg). the distance of two images is the larger of the two hamming
+// distances, so a near match has to look alike at both scales; it is a
+// metric, which lets the bk-tree that groups the near matches skip most of
+// the comparisons.
+class ImageHash
+{
+public:
+    quint64 phash = 0;
+    quint64 dhash = 0;
+
+    static ImageHash compute(const QImage &image);
+    //false when the file can't be decoded
+    static bool fromFile(const QString &fileName, ImageHash *hash);
+    static int distance(const ImageHash &a, const ImageHash &b);
+    //the indices of the hashes in groups of two or more, a hash joins a group when it
+    //is within maxDistance of any of its members. largest groups first
+    static QVector<QVector<int> > group(const QVector<ImageHash> &hashes, int maxDistance);
+};
+
+#endif // IMAGEHASH_H
@@ -0,0 +1,137 @@
+#include "imageloader.h"
+#include "trace.h"
+
+#include <QImageReader>
+#include <QRunnable>
+
+namespace {
+
+class LoadJob : public QRunnable
+{
+public:
+    LoadJob(ImageLoader *loader, int id, const QString &fileName, const QSize &previewSize) :
+        loader(loader), id(id), fileName(fileName), previewSize(previewSize)
+    {
+    }
+
+    void run(){
+        if(!loader->isCurrent(id))
+            return;
+
+        QSize fullSize;
+        {
+            QImageReader reader(fileName);
+            reader.setAutoTransform(true);
+            fullSize = reader.size();
+
+            //fast preview through the reader's reduced-size decoding (DCT scaling for jpeg)
+            if(fullSize.isValid() && fullSize.width() * qint64(fullSize.height()) > ImageLoader::PREVIEW_MIN_AREA
+                    && reader.supportsOption(QImageIOHandler::ScaledSize)){
+                TraceSpan span("ImageLoader::preview", fullSize.scaled(previewSize, Qt::KeepAspectRatio));
+                reader.setScaledSize(fullSize.scaled(previewSize, Qt::KeepAspectRatio));
+                QImage preview = reader.read();
+                span.addBytes(preview.sizeInBytes());
+                if(!preview.isNull()){
+                    //the reader reports the size before the exif transformation
+                    if(reader.transformation() & QImageIOHandler::TransformationRotate90)
+                        fullSize.transpose();
+                    QMetaObject::invokeMethod(loader, "deliverPreview", Qt::QueuedConnection,
+                                              Q_ARG(int, id), Q_ARG(QString, fileName),
+                                              Q_ARG(QImage, preview), Q_ARG(QSize, fullSize));
+                }
+            }
+        }
+
+        if(!loader->isCurrent(id))
+            return;
+
+        QString error;
+        QSharedPointer<TiledImage> image = ImageLoader::decode(fileName, &error);
+        QMetaObject::invokeMethod(loader, "deliverImage", Qt::QueuedConnection,
+                                  Q_ARG(int, id), Q_ARG(QString, fileName),
+                                  Q_ARG(QSharedPointer<TiledImage>, image), Q_ARG(QString, error));
+    }
+
+private:
+    ImageLoader *loader;
+    int id;
+    QString fileName;
+    QSize previewSize;
+};
+
+}
+
+QSharedPointer<TiledImage> ImageLoader::decode(const QString &fileName, QString *error){
+    QImageReader reader(fileName);
+    reader.setAutoTransform(true);
+    TraceSpan span("ImageLoader::decode", reader.size());
+    //on-disk images keep the orientation of the file, their pipeline turns them upright
+    QSharedPointer<TiledImage> image;
+    if(TiledImage::needsTiling(reader.size())){
+        image = TiledImage::open(fileName, error);
+    }else{
+        image = TiledImage::fromImage(reader.read());
+        if(!image && error)
+            *error = reader.errorString();
+    }
+    //pixels as stored in the file, lossless jpeg edits can start from it
+    if(image && reader.transformation() == QImageIOHandler::TransformationNone)
+        image->setSourceFile(fileName);
+    //build the reduced levels here rather than on the first paint
+    if(image){
+        image->levels();
+        span.addBytes(image->memoryBytes());
+    }
+    return image;
+}
+
+ImageLoader::ImageLoader(QObject *parent) :
+    QObject(parent)
+{
+    qRegisterMetaType<QSharedPointer<TiledImage> >("QSharedPointer<TiledImage>");
+
+    //two threads so a new load never waits behind a decode that is being cancelled
+    pool.setMaxThreadCount(2);
+}
+
+ImageLoader::~ImageLoader()
+{
+    cancel();
+    pool.waitForDone();
+}
+
+void ImageLoader::load(const QString &fileName, const QSize &previewSize){
+    cancel();
+    loading = true;
+    pool.start(new LoadJob(this, generation.loadAcquire(), fileName, previewSize));
+}
+
+void ImageLoader::cancel(){
+    generation.fetchAndAddOrdered(1);
+    pool.clear();
+    loading = false;
+}
+
+bool ImageLoader::isLoading() const{
+    return loading;
+}
+
+bool ImageLoader::isCurrent(int id) const{
+    return generation.loadAcquire() == id;
+}
+
+void ImageLoader::deliverPreview(int id, const QString &fileName, const QImage &preview, const QSize &fullSize){
+    if(!isCurrent(id))
+        return;
+    emit previewReady(fileName, preview, fullSize);
+}
+
+void ImageLoader::deliverImage(int id, const QString &fileName, const QSharedPointer<TiledImage> &image, const QString &error){
+    if(!isCurrent(id))
+        return;
+    loading = false;
+    if(image.isNull())
+        emit failed(fileName, error);
+    else
+        emit loaded(fileName, image);
+}
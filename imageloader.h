@@ -0,0 +1,50 @@
+#ifndef IMAGELOADER_H
+#define IMAGELOADER_H
+
+#include <QObject>
+#include <QImage>
+#include <QThreadPool>
+#include <QAtomicInt>
+
+#include "tiledimage.h"
+
+// decodes images on a background thread. a cheap reduced-size preview is
+// delivered first, then the full resolution image, or a tiled on-disk view of
+// it when it is too large to be held in memory. starting a new load
+// cancels the previous one: its queued work is dropped and its results are
+// never delivered.
+class ImageLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ImageLoader(QObject *parent = 0);
+    ~ImageLoader();
+
+    void load(const QString &fileName, const QSize &previewSize);
+    void cancel();
+    bool isLoading() const;
+    bool isCurrent(int id) const;
+
+    //the full decode of a load, blocking. the reduced levels are built too
+    static QSharedPointer<TiledImage> decode(const QString &fileName, QString *error = 0);
+
+    //images smaller than this are decoded directly, without a preview
+    static const int PREVIEW_MIN_AREA = 4000000;
+
+signals:
+    void previewReady(const QString &fileName, const QImage &preview, const QSize &fullSize);
+    void loaded(const QString &fileName, const QSharedPointer<TiledImage> &image);
+    void failed(const QString &fileName, const QString &error);
+
+private slots:
+    void deliverPreview(int id, const QString &fileName, const QImage &preview, const QSize &fullSize);
+    void deliverImage(int id, const QString &fileName, const QSharedPointer<TiledImage> &image, const QString &error);
+
+private:
+    QThreadPool pool;
+    QAtomicInt generation;
+    bool loading = false;
+};
+
+#endif // IMAGELOADER_H
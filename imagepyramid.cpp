@@ -0,0 +1,301 @@
+#include "imagepyramid.h"
+#include "resampler.h"
+#include "affineengine.h"
+#include "trace.h"
+
+#include <QPainter>
+#include <QCache>
+#include <QMutex>
+#include <QSet>
+#include <QElapsedTimer>
+#include <QtMath>
+
+namespace {
+//resampled tiles kept for repaints, cost is in KB
+const int SCALED_TILES_COST = 64 * 1024;
+//source pixels around a tile so resampled neighbours meet without seams
+const int TILE_MARGIN = 8;
+//beyond this magnification the pixels are just blown up
+const double MAX_RESAMPLE_SCALE = 4.0;
+
+//keyed on the scale rather than the size on screen, which changes by a pixel with the scroll offset
+QString tileKey(int index, int tx, int ty, double sx, double sy){
+    return QString("%1:%2:%3:%4x%5").arg(index).arg(tx).arg(ty).arg(sx, 0, 'g', 12).arg(sy, 0, 'g', 12);
+}
+}
+
+struct ImagePyramid::ScaledTiles
+{
+    ScaledTiles();
+    ~ScaledTiles();
+
+    QMutex mutex;
+    QCache<QString, QImage> tiles;
+
+    //every cache of resampled tiles, for the memory accounting
+    static QSet<ScaledTiles *> all;
+    static QMutex allMutex;
+};
+
+QSet<ImagePyramid::ScaledTiles *> ImagePyramid::ScaledTiles::all;
+QMutex ImagePyramid::ScaledTiles::allMutex;
+
+ImagePyramid::ScaledTiles::ScaledTiles() :
+    tiles(SCALED_TILES_COST)
+{
+    QMutexLocker locker(&allMutex);
+    all.insert(this);
+}
+
+ImagePyramid::ScaledTiles::~ScaledTiles()
+{
+    QMutexLocker locker(&allMutex);
+    all.remove(this);
+}
+
+ImagePyramid::ImagePyramid() :
+    scaledTiles(new ScaledTiles)
+{
+}
+
+void ImagePyramid::setImage(const QImage &image){
+    setSource(TiledImage::fromImage(image));
+}
+
+void ImagePyramid::setSource(const QSharedPointer<TiledImage> &source){
+    //a render still running on a copy keeps the old tiles
+    base = source;
+    scaledTiles.reset(new ScaledTiles);
+}
+
+QSharedPointer<TiledImage> ImagePyramid::source() const{
+    return base;
+}
+
+void ImagePyramid::clear(){
+    base.clear();
+    scaledTiles.reset(new ScaledTiles);
+}
+
+bool ImagePyramid::isNull() const{
+    return base.isNull();
+}
+
+QSize ImagePyramid::size() const{
+    return base ? base->size() : QSize();
+}
+
+int ImagePyramid::levelCount() const{
+    return base ? 1 + base->levels().size() : 0;
+}
+
+double ImagePyramid::levelScale(int index) const{
+    if(index == 0)
+        return 1.0;
+    return 1.0 * base->levels().at(index - 1).width() / base->width();
+}
+
+int ImagePyramid::levelForScale(double scale) const{
+    //smallest level that still has at least as many pixels as the screen needs
+    int index = 0;
+    while(index + 1 < levelCount() && levelScale(index + 1) >= scale)
+        index++;
+    return index;
+}
+
+bool ImagePyramid::paint(QPainter *painter, const QTransform &transform, const QRectF &exposed, int level, int budgetMs) const{
+    bool complete = true;
+    draw(painter, transform, exposed, level, budgetMs, 0, &complete);
+    return complete;
+}
+
+QImage ImagePyramid::render(const QTransform &transform, const QSize &size, AffineEngine::Progress *progress) const{
+    QImage view(size, QImage::Format_ARGB32_Premultiplied);
+    view.fill(Qt::transparent);
+    QPainter painter(&view);
+    bool complete;
+    if(!draw(&painter, transform, QRectF(QPointF(0, 0), size), -1, -1, progress, &complete))
+        return QImage();
+    return view;
+}
+
+bool ImagePyramid::draw(QPainter *painter, const QTransform &transform, const QRectF &exposed, int level, int budgetMs,
+                        AffineEngine::Progress *progress, bool *complete) const{
+    *complete = true;
+    if(!base)
+        return true;
+    bool invertible;
+    QTransform inverse = transform.inverted(&invertible);
+    if(!invertible)
+        return true;
+
+    TraceSpan span("ImagePyramid::paint", exposed.size().toSize());
+
+    //part of the full resolution image that ends up in the exposed area
+    QRectF area = inverse.mapRect(exposed).intersected(QRectF(base->rect()));
+    if(area.isEmpty())
+        return true;
+
+    double scale = qSqrt(qAbs(transform.determinant()));
+    bool rotated = painter->worldTransform().isIdentity() && transform.type() > QTransform::TxScale && transform.type() < QTransform::TxProject;
+    //a rotation drawn in a hurry is rendered at half resolution
+    bool coarse = rotated && budgetMs >= 0;
+    int index = level >= 0 ? qMin(level, levelCount() - 1) : levelForScale(coarse ? scale / 2 : scale);
+    bool plain = painter->worldTransform().isIdentity() && transform.type() <= QTransform::TxScale
+            && transform.m11() > 0 && transform.m22() > 0;
+    //a hurried frame never waits for the decoder. resampled tiles fall back one by one,
+    //other views are drawn from the first reduced level. the refinement decodes in the background
+    bool undecoded = budgetMs >= 0 && index == 0 && levelCount() > 1 && !base->isResident(area.toAlignedRect());
+    if(undecoded && !(plain && scale <= MAX_RESAMPLE_SCALE)){
+        index = 1;
+        *complete = false;
+    }
+    QSize levelSize = index == 0 ? base->size() : base->levels().at(index - 1).size();
+
+    //factor from full resolution pixels to level pixels
+    double fx = 1.0 * levelSize.width() / base->width();
+    double fy = 1.0 * levelSize.height() / base->height();
+
+    int x0 = qMax(0, int(area.left() * fx) / TILE_SIZE);
+    int y0 = qMax(0, int(area.top() * fy) / TILE_SIZE);
+    int x1 = qMin((levelSize.width() - 1) / TILE_SIZE, int(area.right() * fx) / TILE_SIZE);
+    int y1 = qMin((levelSize.height() - 1) / TILE_SIZE, int(area.bottom() * fy) / TILE_SIZE);
+
+    //plain scaling straight to the device: draw tiles resampled by the filter for this zoom direction
+    if(plain && scale / fx <= MAX_RESAMPLE_SCALE){
+        //device pixels per level pixel
+        double sx = transform.m11() / fx;
+        double sy = transform.m22() / fy;
+        QElapsedTimer clock;
+        clock.start();
+        for(int ty = y0; ty <= y1; ty++){
+            for(int tx = x0; tx <= x1; tx++){
+                if(progress && progress->isCanceled())
+                    return false;
+                QRect tile = QRect(tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE).intersected(QRect(QPoint(0, 0), levelSize));
+                QRectF dev = transform.mapRect(QRectF(tile.x() / fx, tile.y() / fy, tile.width() / fx, tile.height() / fy));
+                //rounded edges are shared with the neighbours, no gaps between tiles
+                QRect px(QPoint(qRound(dev.left()), qRound(dev.top())), QPoint(qRound(dev.right()) - 1, qRound(dev.bottom()) - 1));
+                if(px.isEmpty())
+                    continue;
+                //tiles resampled before are always drawn, new ones only while the budget lasts
+                QImage scaled = cachedTile(tileKey(index, tx, ty, sx, sy));
+                if(scaled.isNull() && (budgetMs < 0 || (clock.elapsed() < budgetMs
+                        && (!undecoded || base->isResident(tile.adjusted(-TILE_MARGIN, -TILE_MARGIN, TILE_MARGIN, TILE_MARGIN))))))
+                    scaled = scaledTile(index, tx, ty, tile, sx, sy);
+                if(!scaled.isNull()){
+                    //at least as large as px, whose rounded edges vary by a pixel
+                    painter->drawImage(px.topLeft(), scaled, QRect(QPoint(0, 0), px.size()));
+                }else{
+                    drawFast(painter, index, tx, ty, tile, px);
+                    *complete = false;
+                }
+            }
+        }
+        return true;
+    }
+
+    //rotated: only the exposed part is rendered, tile by tile on the thread pool
+    if(rotated){
+        QRect target = transform.mapRect(QRectF(base->rect())).toAlignedRect().intersected(exposed.toAlignedRect());
+        if(target.isEmpty())
+            return true;
+        QTransform toTarget = QTransform::fromScale(1 / fx, 1 / fy) * transform * QTransform::fromTranslate(-target.x(), -target.y());
+        QSize size = target.size();
+        if(coarse){
+            toTarget *= QTransform::fromScale(0.5, 0.5);
+            size = QSize((size.width() + 1) / 2, (size.height() + 1) / 2);
+            *complete = false;
+        }
+        QImage rendered = index == 0 ? AffineEngine::transformed(base, toTarget, size, progress)
+                                     : AffineEngine::transformed(base->levels().at(index - 1), toTarget, size, progress);
+        if(rendered.isNull())
+            return !(progress && progress->isCanceled());
+        if(coarse)
+            painter->drawImage(target, rendered);
+        else
+            painter->drawImage(target.topLeft(), rendered);
+        return true;
+    }
+
+    painter->save();
+    painter->setWorldTransform(transform, true);
+    if(scale < fx || transform.type() > QTransform::TxScale)
+        painter->setRenderHint(QPainter::SmoothPixmapTransform);
+    for(int ty = y0; ty <= y1; ty++){
+        for(int tx = x0; tx <= x1; tx++){
+            QRect tile = QRect(tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE).intersected(QRect(QPoint(0, 0), levelSize));
+            QRectF dest(tile.x() / fx, tile.y() / fy, tile.width() / fx, tile.height() / fy);
+            if(index == 0)
+                painter->drawImage(dest, base->tile(tx, ty));
+            else
+                painter->drawImage(dest, base->levels().at(index - 1), tile);
+        }
+    }
+    painter->restore();
+    return true;
+}
+
+void ImagePyramid::drawFast(QPainter *painter, int index, int tx, int ty, const QRect &tile, const QRect &target) const{
+    //nearest neighbour from pixels in memory, from the next level when the tile would have to be decoded
+    if(index == 0 && !base->isInMemory() && levelCount() > 1){
+        double f = levelScale(1);
+        painter->drawImage(QRectF(target), base->levels().at(0), QRectF(tile.x() * f, tile.y() * f, tile.width() * f, tile.height() * f));
+    }else if(index == 0){
+        painter->drawImage(target, base->tile(tx, ty));
+    }else{
+        painter->drawImage(target, base->levels().at(index - 1), tile);
+    }
+}
+
+qint64 ImagePyramid::cacheBytes(){
+    QMutexLocker locker(&ScaledTiles::allMutex);
+    qint64 bytes = 0;
+    foreach(ScaledTiles *cache, ScaledTiles::all){
+        QMutexLocker tilesLocker(&cache->mutex);
+        bytes += qint64(cache->tiles.totalCost()) * 1024;
+    }
+    return bytes;
+}
+
+qint64 ImagePyramid::releaseCaches(){
+    QMutexLocker locker(&ScaledTiles::allMutex);
+    qint64 bytes = 0;
+    foreach(ScaledTiles *cache, ScaledTiles::all){
+        QMutexLocker tilesLocker(&cache->mutex);
+        bytes += qint64(cache->tiles.totalCost()) * 1024;
+        cache->tiles.clear();
+    }
+    return bytes;
+}
+
+QImage ImagePyramid::cachedTile(const QString &key) const{
+    QMutexLocker locker(&scaledTiles->mutex);
+    QImage *cached = scaledTiles->tiles.object(key);
+    return cached ? *cached : QImage();
+}
+
+QImage ImagePyramid::scaledTile(int index, int tx, int ty, const QRect &tile, double sx, double sy) const{
+    QString key = tileKey(index, tx, ty, sx, sy);
+    QImage cached = cachedTile(key);
+    if(!cached.isNull())
+        return cached;
+    QSize size(qCeil(tile.width() * sx), qCeil(tile.height() * sy));
+    TraceSpan span("ImagePyramid::scaledTile", size);
+
+    QSize levelSize = index == 0 ? base->size() : base->levels().at(index - 1).size();
+    QRect area = tile.adjusted(-TILE_MARGIN, -TILE_MARGIN, TILE_MARGIN, TILE_MARGIN).intersected(QRect(QPoint(0, 0), levelSize));
+    QImage pixels = index == 0 ? base->region(area) : base->levels().at(index - 1).copy(area);
+
+    //the tile is cut out of the resampled area, which has to reach its rounded up edges
+    int left = qRound((tile.x() - area.x()) * sx);
+    int top = qRound((tile.y() - area.y()) * sy);
+    QSize scaledSize(qMax(qRound(area.width() * sx), left + size.width()), qMax(qRound(area.height() * sy), top + size.height()));
+    QImage scaled = Resampler::scaled(pixels, scaledSize);
+    QImage result = scaled.copy(left, top, size.width(), size.height());
+    //kept in the format the screen takes without another conversion
+    result = result.convertToFormat(result.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+    QMutexLocker locker(&scaledTiles->mutex);
+    scaledTiles->tiles.insert(key, new QImage(result), qMax(1, int(result.sizeInBytes() / 1024)));
+    return result;
+}
@@ -0,0 +1,65 @@
+#ifndef IMAGEPYRAMID_H
+#define IMAGEPYRAMID_H
+
+#include <QImage>
+#include <QRectF>
+#include <QSharedPointer>
+#include <QTransform>
+
+#include "tiledimage.h"
+#include "affineengine.h"
+
+class QPainter;
+
+// mipmap pyramid of an image. level 0 is the tiled full resolution image,
+// every next level is half the size of the previous one. painting only
+// touches the tiles of the closest level that end up in the exposed area,
+// under any affine transform. when the image is only scaled the tiles are
+// resampled with the high quality kernels and kept for the next repaints,
+// rotated views are rendered by the affine engine. copies share the source
+// and the resampled tiles, so a copy can render on another thread.
+class ImagePyramid
+{
+public:
+    static const int TILE_SIZE = TiledImage::TILE_SIZE;
+
+    ImagePyramid();
+
+    void setImage(const QImage &image);
+    void setSource(const QSharedPointer<TiledImage> &source);
+    QSharedPointer<TiledImage> source() const;
+    void clear();
+    bool isNull() const;
+    QSize size() const;
+
+    int levelCount() const;
+    double levelScale(int index) const;
+    int levelForScale(double scale) const;
+
+    //transform maps full resolution pixels to the painter, exposed is in device coordinates.
+    //once budgetMs of resampling is spent the remaining tiles are drawn with a cheap
+    //filter from a level in memory, and rotations are rendered at half resolution.
+    //with a budget nothing is decoded, on-disk pixels that aren't cached are drawn from
+    //the first reduced level; false when anything was drawn that way. a negative budget is unlimited
+    bool paint(QPainter *painter, const QTransform &transform, const QRectF &exposed, int level = -1, int budgetMs = -1) const;
+    //the view of size pixels at full quality, null when canceled
+    QImage render(const QTransform &transform, const QSize &size, AffineEngine::Progress *progress = 0) const;
+
+    //resampled tiles kept by all pyramids, they are redrawn when dropped
+    static qint64 cacheBytes();
+    static qint64 releaseCaches();
+
+private:
+    struct ScaledTiles;
+
+    bool draw(QPainter *painter, const QTransform &transform, const QRectF &exposed, int level, int budgetMs,
+              AffineEngine::Progress *progress, bool *complete) const;
+    QImage cachedTile(const QString &key) const;
+    QImage scaledTile(int index, int tx, int ty, const QRect &tile, double sx, double sy) const;
+    void drawFast(QPainter *painter, int index, int tx, int ty, const QRect &tile, const QRect &target) const;
+
+    QSharedPointer<TiledImage> base;
+    QSharedPointer<ScaledTiles> scaledTiles;
+};
+
+#endif // IMAGEPYRAMID_H
@@ -0,0 +1,217 @@
+#include "imagesaver.h"
+#include "losslessjpeg.h"
+#include "trace.h"
+
+#include <QRunnable>
+#include <QSaveFile>
+#include <QImageWriter>
+#include <QFileInfo>
+#include <QDataStream>
+
+namespace {
+
+//24-bit top-down bmp, every band is rendered and written before the next one
+ImageSaver::Result writeBands(QIODevice *device, const EditPipeline &image, AffineEngine::Progress *progress, QString *error){
+    int w = image.size().width(), h = image.size().height();
+    qint64 rowBytes = (qint64(w) * 3 + 3) & ~qint64(3);
+    qint64 fileSize = 54 + rowBytes * h;
+    if(fileSize > 0xffffffffLL){
+        *error = QObject::tr("The image is too large for a BMP file.");
+        return ImageSaver::Failed;
+    }
+
+    QDataStream out(device);
+    out.setByteOrder(QDataStream::LittleEndian);
+    out.writeRawData("BM", 2);
+    out << quint32(fileSize) << quint32(0) << quint32(54);
+    out << quint32(40) << qint32(w) << qint32(-h) << quint16(1) << quint16(24) << quint32(0)
+        << quint32(rowBytes * h) << qint32(2835) << qint32(2835) << quint32(0) << quint32(0);
+
+    QByteArray padding(int(rowBytes - qint64(w) * 3), 0);
+    int bands = (h + ImageSaver::BAND_ROWS - 1) / ImageSaver::BAND_ROWS;
+    for(int b = 0; b < bands; b++){
+        if(progress->isCanceled())
+            return ImageSaver::Canceled;
+        EditPipeline band = image;
+        band.crop(QRect(0, b * ImageSaver::BAND_ROWS, w, ImageSaver::BAND_ROWS));
+        //bmp stores blue, green, red
+        QImage pixels = band.render().convertToFormat(QImage::Format_RGB888).rgbSwapped();
+        if(pixels.isNull()){
+            *error = QObject::tr("Not enough memory to render the image.");
+            return ImageSaver::Failed;
+        }
+        for(int y = 0; y < pixels.height(); y++){
+            out.writeRawData(reinterpret_cast<const char *>(pixels.constScanLine(y)), w * 3);
+            out.writeRawData(padding.constData(), padding.size());
+        }
+        progress->report(b + 1, bands);
+    }
+    if(out.status() != QDataStream::Ok){
+        *error = device->errorString();
+        return ImageSaver::Failed;
+    }
+    return ImageSaver::Saved;
+}
+
+ImageSaver::Result writeFrame(QIODevice *device, const QByteArray &format, const EditPipeline &image,
+                              const ImageSaver::Options &options, AffineEngine::Progress *progress, QString *error){
+    //the only full copy of the frame, the encoder converts it row by row
+    QImage pixels = image.render(progress);
+    if(progress->isCanceled())
+        return ImageSaver::Canceled;
+    if(pixels.isNull()){
+        *error = QObject::tr("Not enough memory to render the image.");
+        return ImageSaver::Failed;
+    }
+
+    QImageWriter writer(device, format);
+    if(options.quality >= 0)
+        writer.setQuality(options.quality);
+    if(options.compression >= 0){
+        //qt's png writer takes the level through the quality option
+        if(writer.supportsOption(QImageIOHandler::CompressionRatio))
+            writer.setCompression(options.compression);
+        else
+            writer.setQuality(100 - options.compression * 11);
+    }
+    writer.setProgressiveScanWrite(options.progressive);
+    if(!writer.write(pixels)){
+        *error = writer.errorString();
+        return ImageSaver::Failed;
+    }
+    return ImageSaver::Saved;
+}
+
+class SaveJob : public QRunnable
+{
+public:
+    SaveJob(ImageSaver *saver, const EditPipeline &image, const QString &fileName, const ImageSaver::Options &options,
+            const QSharedPointer<AffineEngine::Progress> &progress) :
+        saver(saver), image(image), fileName(fileName), options(options), progress(progress)
+    {
+    }
+
+    void run(){
+        QString error;
+        ImageSaver::Result result = ImageSaver::write(image, fileName, options, progress.data(), &error);
+        QMetaObject::invokeMethod(saver, "deliver", Qt::QueuedConnection,
+                                  Q_ARG(int, result), Q_ARG(QString, fileName), Q_ARG(QString, error));
+    }
+
+private:
+    ImageSaver *saver;
+    EditPipeline image;
+    QString fileName;
+    ImageSaver::Options options;
+    QSharedPointer<AffineEngine::Progress> progress;
+};
+
+}
+
+ImageSaver::ImageSaver(QObject *parent) :
+    QObject(parent)
+{
+    //one save at a time
+    pool.setMaxThreadCount(1);
+    ticker.setInterval(100);
+    connect(&ticker, SIGNAL(timeout()), this, SLOT(tick()));
+}
+
+ImageSaver::~ImageSaver()
+{
+    cancel();
+    pool.waitForDone();
+}
+
+void ImageSaver::save(const EditPipeline &image, const QString &fileName, const Options &options){
+    current = QSharedPointer<AffineEngine::Progress>(new AffineEngine::Progress);
+    saving = true;
+    pool.start(new SaveJob(this, image, fileName, options, current));
+    ticker.start();
+    emit progressChanged(0);
+}
+
+void ImageSaver::cancel(){
+    if(current)
+        current->cancel();
+}
+
+bool ImageSaver::isSaving() const{
+    return saving;
+}
+
+int ImageSaver::progress() const{
+    return current ? current->percent() : 0;
+}
+
+ImageSaver::Result ImageSaver::write(const EditPipeline &image, const QString &fileName, const Options &options,
+                                     AffineEngine::Progress *progress, QString *error){
+    TraceSpan span("ImageSaver::write", image.size());
+    QByteArray format = QFileInfo(fileName).suffix().toLower().toLatin1();
+    if(format == "jpg")
+        format = "jpeg";
+    if(!QImageWriter::supportedImageFormats().contains(format)){
+        *error = tr("Unknown image format \"%1\".").arg(QString(format));
+        return Failed;
+    }
+
+    //written next to the target and renamed over it on commit
+    QSaveFile file(fileName);
+    if(!file.open(QIODevice::WriteOnly)){
+        *error = file.errorString();
+        return Failed;
+    }
+
+    AffineEngine::Progress own;
+    if(!progress)
+        progress = &own;
+    Result result;
+    QString jpegFile, jpegError;
+    LosslessJpeg::Operation operation;
+    if(format == "jpeg" && LosslessJpeg::plan(image, &jpegFile, &operation)
+            && LosslessJpeg::write(jpegFile, operation, options.progressive, &file, &jpegError)){
+        //crops and quarter turns of a jpeg keep its coefficients, nothing is encoded again
+        result = Saved;
+    }else if(!jpegError.isEmpty()){
+        *error = jpegError;
+        result = Failed;
+    }else if(qint64(image.size().width()) * image.size().height() * 4 > TiledImage::MATERIALIZE_LIMIT){
+        if(format != "bmp"){
+            *error = tr("The image is too large to be encoded in memory, save it as BMP.");
+            result = Failed;
+        }else{
+            result = writeBands(&file, image, progress, error);
+        }
+    }else{
+        result = writeFrame(&file, format, image, options, progress, error);
+    }
+
+    if(result == Saved && progress->isCanceled())
+        result = Canceled;
+    if(result != Saved){
+        file.cancelWriting();
+        return result;
+    }
+    if(!file.commit()){
+        *error = file.errorString();
+        return Failed;
+    }
+    return Saved;
+}
+
+void ImageSaver::deliver(int result, const QString &fileName, const QString &error){
+    saving = false;
+    ticker.stop();
+    if(result == Saved){
+        emit progressChanged(100);
+        emit saved(fileName);
+    }else if(result == Canceled){
+        emit canceled(fileName);
+    }else{
+        emit failed(fileName, error);
+    }
+}
+
+void ImageSaver::tick(){
+    emit progressChanged(progress());
+}
@@ -0,0 +1,64 @@
+#ifndef IMAGESAVER_H
+#define IMAGESAVER_H
+
+#include <QObject>
+#include <QThreadPool>
+#include <QTimer>
+#include <QSharedPointer>
+
+#include "editpipeline.h"
+
+// renders and writes an edit pipeline on a background thread. the pipeline
+// is a snapshot, edits made while saving don't reach the file. the data is
+// written to a temporary file that only replaces the target once it is
+// complete, a failed or canceled save leaves the old file untouched. outputs
+// too large for memory are rendered and written in bands (bmp only).
+class ImageSaver : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Options
+    {
+        int quality = -1;       //jpeg quality 0-100, -1 for the default
+        int compression = -1;   //png compression level 0-9, -1 for the default
+        bool progressive = false;
+    };
+
+    enum Result { Saved, Failed, Canceled };
+
+    explicit ImageSaver(QObject *parent = 0);
+    ~ImageSaver();
+
+    void save(const EditPipeline &image, const QString &fileName, const Options &options);
+    bool isSaving() const;
+    int progress() const;
+
+    //the blocking save the background one runs, usable from any thread
+    static Result write(const EditPipeline &image, const QString &fileName, const Options &options,
+                        AffineEngine::Progress *progress, QString *error);
+
+    //rows rendered at once when writing in bands
+    static const int BAND_ROWS = 256;
+
+public slots:
+    void cancel();
+
+signals:
+    void progressChanged(int percent);
+    void saved(const QString &fileName);
+    void failed(const QString &fileName, const QString &error);
+    void canceled(const QString &fileName);
+
+private slots:
+    void deliver(int result, const QString &fileName, const QString &error);
+    void tick();
+
+private:
+    QThreadPool pool;
+    QTimer ticker;
+    QSharedPointer<AffineEngine::Progress> current;
+    bool saving = false;
+};
+
+#endif // IMAGESAVER_H
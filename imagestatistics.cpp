@@ -0,0 +1,251 @@
+#include "imagestatistics.h"
+#include "imagepyramid.h"
+#include "imagefilter.h"
+#include "parallel.h"
+#include "trace.h"
+
+#include <QRunnable>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QtMath>
+
+#include <cstring>
+
+namespace {
+
+//pixels of the approximate render at most
+const int APPROXIMATE_PIXELS = 512 * 512;
+//rows of the output rendered at a time for the exact counts
+const int BAND_ROWS = 256;
+//rows handed to a thread at least
+const int MIN_BAND_ROWS = 32;
+
+//counts of the rows one thread went through. even and odd pixels go to
+//separate tables, so increments of the same bin don't wait on each other
+struct Partial{
+    quint32 bins[2][ImageStatistics::CHANNELS][256];
+};
+
+//b, g, r, a in memory, fully transparent pixels aren't part of the image
+void countRgb(const uchar *line, const uchar *gray, int width, bool alpha, Partial *p){
+    int x = 0;
+    if(!alpha){
+        for(; x + 1 < width; x += 2){
+            const uchar *a = line + x * 4;
+            const uchar *b = a + 4;
+            p->bins[0][ImageStatistics::Red][a[2]]++;
+            p->bins[0][ImageStatistics::Green][a[1]]++;
+            p->bins[0][ImageStatistics::Blue][a[0]]++;
+            p->bins[0][ImageStatistics::Luma][gray[x]]++;
+            p->bins[1][ImageStatistics::Red][b[2]]++;
+            p->bins[1][ImageStatistics::Green][b[1]]++;
+            p->bins[1][ImageStatistics::Blue][b[0]]++;
+            p->bins[1][ImageStatistics::Luma][gray[x + 1]]++;
+        }
+    }
+    for(; x < width; x++){
+        const uchar *a = line + x * 4;
+        if(alpha && a[3] == 0)
+            continue;
+        p->bins[0][ImageStatistics::Red][a[2]]++;
+        p->bins[0][ImageStatistics::Green][a[1]]++;
+        p->bins[0][ImageStatistics::Blue][a[0]]++;
+        p->bins[0][ImageStatistics::Luma][gray[x]]++;
+    }
+}
+
+void countGray(const uchar *line, int width, Partial *p){
+    int x = 0;
+    for(; x + 1 < width; x += 2){
+        p->bins[0][ImageStatistics::Luma][line[x]]++;
+        p->bins[1][ImageStatistics::Luma][line[x + 1]]++;
+    }
+    if(x < width)
+        p->bins[0][ImageStatistics::Luma][line[x]]++;
+}
+
+class StatisticsJob : public QRunnable
+{
+public:
+    StatisticsJob(QObject *owner, const EditPipeline &pipeline, int generation,
+                  const QSharedPointer<AffineEngine::Progress> &progress) :
+        owner(owner), pipeline(pipeline), generation(generation), progress(progress)
+    {
+    }
+
+    void run(){
+        TraceSpan span("ImageStatistics::exact", pipeline.size());
+        ImageStatistics::Result result;
+        //a band of rows at a time, the whole output may not fit in memory
+        for(int y = 0; y < pipeline.size().height(); y += BAND_ROWS){
+            EditPipeline band = pipeline;
+            band.crop(QRect(0, y, pipeline.size().width(), BAND_ROWS));
+            QImage pixels = band.render(progress.data());
+            if(pixels.isNull() || progress->isCanceled())
+                return;
+            result.add(ImageStatistics::compute(pixels));
+        }
+        result.exact = true;
+        QMetaObject::invokeMethod(owner, "done", Qt::QueuedConnection,
+                                  Q_ARG(int, generation), Q_ARG(ImageStatistics::Result, result));
+    }
+
+private:
+    QObject *owner;
+    EditPipeline pipeline;
+    int generation;
+    QSharedPointer<AffineEngine::Progress> progress;
+};
+
+}
+
+ImageStatistics::Result::Result()
+{
+    memset(bins, 0, sizeof(bins));
+}
+
+void ImageStatistics::Result::add(const Result &other){
+    for(int c = 0; c < CHANNELS; c++){
+        for(int v = 0; v < 256; v++)
+            bins[c][v] += other.bins[c][v];
+    }
+    pixels += other.pixels;
+}
+
+int ImageStatistics::Result::minimum(int channel) const{
+    for(int v = 0; v < 256; v++){
+        if(bins[channel][v])
+            return v;
+    }
+    return 0;
+}
+
+int ImageStatistics::Result::maximum(int channel) const{
+    for(int v = 255; v >= 0; v--){
+        if(bins[channel][v])
+            return v;
+    }
+    return 0;
+}
+
+double ImageStatistics::Result::mean(int channel) const{
+    if(pixels == 0)
+        return 0;
+    double sum = 0;
+    for(int v = 0; v < 256; v++)
+        sum += double(v) * bins[channel][v];
+    return sum / pixels;
+}
+
+qint64 ImageStatistics::Result::clippedLow(int channel) const{
+    return bins[channel][0];
+}
+
+qint64 ImageStatistics::Result::clippedHigh(int channel) const{
+    return bins[channel][255];
+}
+
+ImageStatistics::ImageStatistics(QObject *parent) :
+    QObject(parent)
+{
+    qRegisterMetaType<ImageStatistics::Result>("ImageStatistics::Result");
+
+    //one exact pass at a time, rendering and counting are spread over the global pool
+    pool.setMaxThreadCount(1);
+}
+
+ImageStatistics::~ImageStatistics()
+{
+    cancel();
+    pool.waitForDone();
+}
+
+ImageStatistics::Result ImageStatistics::request(const EditPipeline &pipeline, const QRect &region){
+    cancel();
+    generation++;
+    if(pipeline.isNull())
+        return Result();
+    QRect area = region.isEmpty() ? pipeline.rect() : region.intersected(pipeline.rect());
+    if(area.isEmpty())
+        return Result();
+    TraceSpan span("ImageStatistics::request", area.size());
+
+    //from the closest reduced level, enough for the shape of the histograms
+    double scale = qMin(1.0, qSqrt(1.0 * APPROXIMATE_PIXELS / (1.0 * area.width() * area.height())));
+    QSize size = (QSizeF(area.size()) * scale).toSize().expandedTo(QSize(1, 1));
+    QTransform transform = pipeline.transform() * QTransform::fromTranslate(-area.x(), -area.y())
+            * QTransform::fromScale(1.0 * size.width() / area.width(), 1.0 * size.height() / area.height());
+    ImagePyramid pyramid;
+    pyramid.setSource(pipeline.source());
+    Result result = compute(pyramid.render(transform, size));
+    if(size == area.size()){
+        //small enough to be counted at full resolution already
+        result.exact = true;
+        return result;
+    }
+
+    EditPipeline cropped = pipeline;
+    cropped.crop(area);
+    progress = QSharedPointer<AffineEngine::Progress>(new AffineEngine::Progress);
+    pool.start(new StatisticsJob(this, cropped, generation, progress));
+    return result;
+}
+
+void ImageStatistics::cancel(){
+    if(progress)
+        progress->cancel();
+    progress.clear();
+}
+
+ImageStatistics::Result ImageStatistics::compute(const QImage &image){
+    Result result;
+    if(image.isNull())
+        return result;
+    TraceSpan span("ImageStatistics::compute", image.size());
+    QImage src = image;
+    if(src.format() != QImage::Format_RGB32 && src.format() != QImage::Format_ARGB32 && src.format() != QImage::Format_Grayscale8)
+        src = src.convertToFormat(src.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    const bool gray = src.format() == QImage::Format_Grayscale8;
+    const bool alpha = src.format() == QImage::Format_ARGB32;
+
+    //raw pointers, the bands must not detach the image concurrently
+    const uchar *bits = src.constBits();
+    const int stride = src.bytesPerLine();
+    const int width = src.width();
+    QMutex mutex;
+    parallelFor(src.height(), MIN_BAND_ROWS, [&](int begin, int end){
+        //a partial histogram per thread, merged once its rows are counted
+        QScopedPointer<Partial> partial(new Partial());
+        QVector<uchar> luma(width);
+        for(int y = begin; y < end; y++){
+            const uchar *line = bits + y * stride;
+            if(gray){
+                countGray(line, width, partial.data());
+            }else{
+                ImageFilter::luma(line, 4, luma.data(), width);
+                countRgb(line, luma.constData(), width, alpha, partial.data());
+            }
+        }
+        QMutexLocker locker(&mutex);
+        for(int c = 0; c < CHANNELS; c++){
+            for(int v = 0; v < 256; v++)
+                result.bins[c][v] += partial->bins[0][c][v] + partial->bins[1][c][v];
+        }
+    });
+
+    if(gray){
+        for(int c = Red; c <= Blue; c++)
+            memcpy(result.bins[c], result.bins[Luma], sizeof(result.bins[Luma]));
+    }
+    for(int v = 0; v < 256; v++)
+        result.pixels += result.bins[Luma][v];
+    return result;
+}
+
+void ImageStatistics::done(int generation, const ImageStatistics::Result &result){
+    //a newer request has taken over
+    if(generation != this->generation)
+        return;
+    progress.clear();
+    emit ready(result);
+}
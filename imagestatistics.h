@@ -0,0 +1,64 @@
+#ifndef IMAGESTATISTICS_H
+#define IMAGESTATISTICS_H
+
+#include <QObject>
+#include <QRect>
+#include <QThreadPool>
+#include <QSharedPointer>
+#include <QMetaType>
+
+#include "editpipeline.h"
+
+// per channel histograms of the output of an edit pipeline, or of a region
+// of it. a request is answered right away from a reduced render of the
+// reduced levels, the exact counts follow from a background job that
+// renders the region in bands of rows at full resolution, so memory stays
+// bounded. a newer request cancels the job of the previous one.
+class ImageStatistics : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Channel { Red, Green, Blue, Luma, CHANNELS };
+
+    struct Result{
+        qint64 bins[CHANNELS][256];
+        qint64 pixels = 0;
+        bool exact = false;
+
+        Result();
+        void add(const Result &other);
+        int minimum(int channel) const;
+        int maximum(int channel) const;
+        double mean(int channel) const;
+        //pixels at 0 and at 255
+        qint64 clippedLow(int channel) const;
+        qint64 clippedHigh(int channel) const;
+    };
+
+    explicit ImageStatistics(QObject *parent = 0);
+    ~ImageStatistics();
+
+    //the approximate result, the exact one is delivered by ready() unless it is the same.
+    //an empty region is the whole image
+    Result request(const EditPipeline &pipeline, const QRect &region = QRect());
+    void cancel();
+
+    //histograms of all pixels, fully transparent ones aren't counted
+    static Result compute(const QImage &image);
+
+signals:
+    void ready(const ImageStatistics::Result &result);
+
+private slots:
+    void done(int generation, const ImageStatistics::Result &result);
+
+private:
+    int generation = 0;
+    QSharedPointer<AffineEngine::Progress> progress;
+    QThreadPool pool;
+};
+
+Q_DECLARE_METATYPE(ImageStatistics::Result)
+
+#endif // IMAGESTATISTICS_H
@@ -0,0 +1,295 @@
+#include "losslessjpeg.h"
+#include "trace.h"
+
+#include <QFile>
+#include <QIODevice>
+#include <QtMath>
+
+#ifdef HAVE_LIBJPEG
+#include <cstdio>
+#include <csetjmp>
+#include <cstdlib>
+#include <cstring>
+extern "C" {
+#include <jpeglib.h>
+}
+#endif
+
+namespace {
+
+bool isUnit(qreal v, qreal *sign){
+    if(qAbs(v) < 1e-9){
+        *sign = 0;
+        return true;
+    }
+    if(qAbs(qAbs(v) - 1) < 1e-9){
+        *sign = v > 0 ? 1 : -1;
+        return true;
+    }
+    return false;
+}
+
+#ifdef HAVE_LIBJPEG
+
+//libjpeg reports errors by calling exit(), jump back out instead
+struct ErrorManager
+{
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+void errorExit(j_common_ptr cinfo){
+    ErrorManager *err = reinterpret_cast<ErrorManager *>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, err->message);
+    longjmp(err->jump, 1);
+}
+
+//blocks a component needs for pixels, padded to whole MCUs
+int blockCount(long pixels, int samp, int maxSamp){
+    long blocks = (pixels * samp + maxSamp * DCTSIZE - 1) / (maxSamp * DCTSIZE);
+    return int((blocks + samp - 1) / samp * samp);
+}
+
+//the coefficients of one block after the operation, u is the horizontal frequency
+void transformBlock(const JCOEF *in, JCOEF *out, const LosslessJpeg::Operation &op){
+    for(int v = 0; v < DCTSIZE; v++){
+        for(int u = 0; u < DCTSIZE; u++){
+            int ou = op.transpose ? v : u;
+            int ov = op.transpose ? u : v;
+            //mirroring a cosine basis negates the odd frequencies
+            bool negate = ((op.flipX ? ou : 0) + (op.flipY ? ov : 0)) & 1;
+            JCOEF c = in[v * DCTSIZE + u];
+            out[ov * DCTSIZE + ou] = negate ? JCOEF(-c) : c;
+        }
+    }
+}
+
+struct Writer
+{
+    jpeg_decompress_struct src;
+    jpeg_compress_struct dst;
+    ErrorManager srcError;
+    ErrorManager dstError;
+    unsigned char *buffer = 0;
+    unsigned long bufferSize = 0;
+    bool srcCreated = false;
+    bool dstCreated = false;
+
+    ~Writer(){
+        if(dstCreated)
+            jpeg_destroy_compress(&dst);
+        if(srcCreated)
+            jpeg_destroy_decompress(&src);
+        free(buffer);
+    }
+};
+
+bool transform(Writer &w, const QByteArray &data, const LosslessJpeg::Operation &op, bool progressive, QString *error){
+    jpeg_decompress_struct &src = w.src;
+    jpeg_compress_struct &dst = w.dst;
+
+    src.err = jpeg_std_error(&w.srcError.pub);
+    w.srcError.pub.error_exit = errorExit;
+    dst.err = jpeg_std_error(&w.dstError.pub);
+    w.dstError.pub.error_exit = errorExit;
+    if(setjmp(w.srcError.jump)){
+        *error = QString::fromLatin1(w.srcError.message);
+        return false;
+    }
+    if(setjmp(w.dstError.jump)){
+        *error = QString::fromLatin1(w.dstError.message);
+        return false;
+    }
+    jpeg_create_decompress(&src);
+    w.srcCreated = true;
+    jpeg_create_compress(&dst);
+    w.dstCreated = true;
+
+    jpeg_mem_src(&src, reinterpret_cast<unsigned char *>(const_cast<char *>(data.constData())), data.size());
+    //comments and application markers (exif, icc) go along
+    jpeg_save_markers(&src, JPEG_COM, 0xffff);
+    for(int m = 0; m < 16; m++)
+        jpeg_save_markers(&src, JPEG_APP0 + m, 0xffff);
+    jpeg_read_header(&src, TRUE);
+
+    //the full image after transposing and mirroring, in pixels and in MCUs
+    int maxH = src.max_h_samp_factor;
+    int maxV = src.max_v_samp_factor;
+    int mcuW = (op.transpose ? maxV : maxH) * DCTSIZE;
+    int mcuH = (op.transpose ? maxH : maxV) * DCTSIZE;
+    int fullW = op.transpose ? src.image_height : src.image_width;
+    int fullH = op.transpose ? src.image_width : src.image_height;
+    QRect crop = op.crop.isNull() ? QRect(0, 0, fullW, fullH) : op.crop;
+    //a mirrored partial MCU would bring its padding into the picture
+    if((op.flipX && fullW % mcuW) || (op.flipY && fullH % mcuH)
+            || crop.x() % mcuW || crop.y() % mcuH || !QRect(0, 0, fullW, fullH).contains(crop)){
+        error->clear();
+        return false;
+    }
+
+    //the output blocks, requested before the source is read in
+    jvirt_barray_ptr outArrays[MAX_COMPONENTS];
+    for(int ci = 0; ci < src.num_components; ci++){
+        jpeg_component_info *comp = src.comp_info + ci;
+        int h = op.transpose ? comp->v_samp_factor : comp->h_samp_factor;
+        int v = op.transpose ? comp->h_samp_factor : comp->v_samp_factor;
+        int mh = op.transpose ? maxV : maxH;
+        int mv = op.transpose ? maxH : maxV;
+        JDIMENSION wb = blockCount(crop.width(), h, mh);
+        JDIMENSION hb = blockCount(crop.height(), v, mv);
+        outArrays[ci] = (*src.mem->request_virt_barray)(reinterpret_cast<j_common_ptr>(&src), JPOOL_IMAGE, TRUE, wb, hb, hb);
+    }
+    jvirt_barray_ptr *inArrays = jpeg_read_coefficients(&src);
+
+    for(int ci = 0; ci < src.num_components; ci++){
+        jpeg_component_info *comp = src.comp_info + ci;
+        int h = op.transpose ? comp->v_samp_factor : comp->h_samp_factor;
+        int v = op.transpose ? comp->h_samp_factor : comp->v_samp_factor;
+        int mh = op.transpose ? maxV : maxH;
+        int mv = op.transpose ? maxH : maxV;
+        //block grid of this component in the transposed image
+        int fullWB = op.transpose ? comp->height_in_blocks : comp->width_in_blocks;
+        int fullHB = op.transpose ? comp->width_in_blocks : comp->height_in_blocks;
+        int cropXB = crop.x() / (mh * DCTSIZE) * h;
+        int cropYB = crop.y() / (mv * DCTSIZE) * v;
+        int outWB = blockCount(crop.width(), h, mh);
+        int outHB = blockCount(crop.height(), v, mv);
+
+        JBLOCKARRAY out = (*src.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&src), outArrays[ci], 0, outHB, TRUE);
+        for(JDIMENSION sy = 0; sy < comp->height_in_blocks; sy++){
+            JBLOCKARRAY row = (*src.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&src), inArrays[ci], sy, 1, FALSE);
+            for(JDIMENSION sx = 0; sx < comp->width_in_blocks; sx++){
+                int tx = op.transpose ? int(sy) : int(sx);
+                int ty = op.transpose ? int(sx) : int(sy);
+                if(op.flipX)
+                    tx = fullWB - 1 - tx;
+                if(op.flipY)
+                    ty = fullHB - 1 - ty;
+                tx -= cropXB;
+                ty -= cropYB;
+                if(tx < 0 || ty < 0 || tx >= outWB || ty >= outHB)
+                    continue;
+                transformBlock(row[0][sx], out[ty][tx], op);
+            }
+        }
+    }
+
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.image_width = crop.width();
+    dst.image_height = crop.height();
+    if(op.transpose){
+        //sampling factors and quantization tables turn with the blocks
+        for(int ci = 0; ci < dst.num_components; ci++)
+            qSwap(dst.comp_info[ci].h_samp_factor, dst.comp_info[ci].v_samp_factor);
+        for(int q = 0; q < NUM_QUANT_TBLS; q++){
+            JQUANT_TBL *table = dst.quant_tbl_ptrs[q];
+            if(!table)
+                continue;
+            for(int i = 0; i < DCTSIZE; i++)
+                for(int j = i + 1; j < DCTSIZE; j++)
+                    qSwap(table->quantval[i * DCTSIZE + j], table->quantval[j * DCTSIZE + i]);
+        }
+    }
+    if(progressive)
+        jpeg_simple_progression(&dst);
+    dst.optimize_coding = TRUE;
+
+    jpeg_mem_dest(&dst, &w.buffer, &w.bufferSize);
+    jpeg_write_coefficients(&dst, outArrays);
+    for(jpeg_saved_marker_ptr m = src.marker_list; m; m = m->next){
+        //the library writes its own JFIF and Adobe markers
+        if(dst.write_JFIF_header && m->marker == JPEG_APP0 && m->data_length >= 5
+                && !memcmp(m->data, "JFIF", 5))
+            continue;
+        if(dst.write_Adobe_marker && m->marker == JPEG_APP0 + 14 && m->data_length >= 5
+                && !memcmp(m->data, "Adobe", 5))
+            continue;
+        jpeg_write_marker(&dst, m->marker, m->data, m->data_length);
+    }
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+    return true;
+}
+
+#endif
+
+}
+
+bool LosslessJpeg::isAvailable(){
+#ifdef HAVE_LIBJPEG
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool LosslessJpeg::plan(const EditPipeline &pipeline, QString *fileName, Operation *operation){
+    if(!isAvailable() || pipeline.isNull())
+        return false;
+    QString file = pipeline.source()->sourceFile();
+    QString suffix = file.section('.', -1).toLower();
+    if(file.isEmpty() || (suffix != "jpg" && suffix != "jpeg"))
+        return false;
+
+    //only whole pixels moved around: multiples of 90 degrees and mirrors, no scaling
+    QTransform m = pipeline.transform();
+    if(m.type() == QTransform::TxProject)
+        return false;
+    qreal m11, m12, m21, m22;
+    if(!isUnit(m.m11(), &m11) || !isUnit(m.m12(), &m12) || !isUnit(m.m21(), &m21) || !isUnit(m.m22(), &m22))
+        return false;
+    Operation op;
+    op.transpose = m11 == 0;
+    op.flipX = (op.transpose ? m21 : m11) < 0;
+    op.flipY = (op.transpose ? m12 : m22) < 0;
+
+    //the output is a window on the transposed and mirrored image
+    QTransform linear(m.m11(), m.m12(), m.m21(), m.m22(), 0, 0);
+    QRectF box = linear.mapRect(QRectF(pipeline.source()->rect()));
+    qreal x = -(box.x() + m.dx());
+    qreal y = -(box.y() + m.dy());
+    if(qAbs(x - qRound(x)) > 1e-6 || qAbs(y - qRound(y)) > 1e-6)
+        return false;
+    op.crop = QRect(qRound(x), qRound(y), pipeline.size().width(), pipeline.size().height());
+    if(!QRect(QPoint(0, 0), box.size().toSize()).contains(op.crop))
+        return false;
+
+    *fileName = file;
+    *operation = op;
+    return true;
+}
+
+bool LosslessJpeg::write(const QString &fileName, const Operation &operation, bool progressive,
+                         QIODevice *device, QString *error){
+    error->clear();
+#ifdef HAVE_LIBJPEG
+    TraceSpan span("LosslessJpeg::write", operation.crop.size());
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly))
+        return false;
+    QByteArray data = file.readAll();
+
+    //libjpeg refusing a file qt decoded anyway (truncated, odd markers) only means it
+    //can't be done losslessly, the caller encodes the pixels. nothing was written yet,
+    //the reason is logged so a lossy save can be told apart
+    Writer w;
+    QString refused;
+    if(!transform(w, data, operation, progressive, &refused)){
+        qInfo("%s: not saved losslessly, %s", qPrintable(fileName), qPrintable(refused));
+        return false;
+    }
+    span.addBytes(w.bufferSize);
+    if(device->write(reinterpret_cast<const char *>(w.buffer), w.bufferSize) != qint64(w.bufferSize)){
+        *error = device->errorString();
+        return false;
+    }
+    return true;
+#else
+    Q_UNUSED(fileName);
+    Q_UNUSED(operation);
+    Q_UNUSED(progressive);
+    Q_UNUSED(device);
+    return false;
+#endif
+}
@@ -0,0 +1,39 @@
+#ifndef LOSSLESSJPEG_H
+#define LOSSLESSJPEG_H
+
+#include <QRect>
+#include <QString>
+
+#include "editpipeline.h"
+
+class QIODevice;
+
+// crop, 90 degree rotations and flips of a jpeg done on its dct
+// coefficients, like jpegtran: nothing is decoded or encoded again, so
+// there is no generation loss and a large photo is written in the time it
+// takes to shuffle the blocks. only edit chains that map whole blocks onto
+// whole blocks qualify: the crop has to start on an MCU boundary and
+// flipped edges have to be whole MCUs. needs libjpeg (HAVE_LIBJPEG).
+class LosslessJpeg
+{
+public:
+    struct Operation
+    {
+        //applied in this order: transpose, mirror left-right, mirror top-bottom, crop
+        bool transpose = false;
+        bool flipX = false;
+        bool flipY = false;
+        QRect crop;
+    };
+
+    static bool isAvailable();
+
+    //the pipeline as a lossless operation on the jpeg its source was read from
+    static bool plan(const EditPipeline &pipeline, QString *fileName, Operation *operation);
+    //false with error empty when the file doesn't allow it after all, libjpeg errors included.
+    //error is only set when writing to device failed
+    static bool write(const QString &fileName, const Operation &operation, bool progressive,
+                      QIODevice *device, QString *error);
+};
+
+#endif // LOSSLESSJPEG_H
@@ -1,11 +1,77 @@
 #include "mainwindow.h"
+#include "batchprocessor.h"
+#include "singleinstance.h"
+#include "trace.h"
 #include <QApplication>
+#include <QSettings>
+#include <QFileInfo>
+#include <QElapsedTimer>
+
+//"--trace <file>" records the operations and writes them there as a chrome trace on exit
+static QString traceFile(const QStringList &arguments){
+    int i = arguments.indexOf("--trace");
+    return i > 0 && i + 1 < arguments.size() ? arguments.at(i + 1) : QString();
+}
+
+//the files to open, options and their values left out
+static QStringList fileArguments(const QStringList &arguments){
+    QStringList files;
+    for(int i = 1; i < arguments.size(); i++){
+        if(arguments.at(i) == "--trace")
+            i++;
+        else if(!arguments.at(i).startsWith("--"))
+            files << QFileInfo(arguments.at(i)).absoluteFilePath();
+    }
+    return files;
+}
 
 int main(int argc, char *argv[])
 {
+    QElapsedTimer launch;
+    launch.start();
+    //trace times start at the launch, the first pixel span covers it
+    Trace::setEpoch(launch);
+
+    //headless batch processing, no display needed
+    for(int i = 1; i < argc; i++){
+        if(QString(argv[i]) == "--batch"){
+            QCoreApplication a(argc, argv);
+            QString trace = traceFile(a.arguments());
+            Trace::setEnabled(!trace.isEmpty());
+            int result = BatchProcessor::run(a.arguments());
+            if(!trace.isEmpty())
+                Trace::writeJson(trace);
+            return result;
+        }
+    }
+
+    //a running viewer opens the files, this launch ends before the gui is loaded.
+    //"--new-instance" or the singleInstance setting opens a window of its own
+    QStringList arguments;
+    for(int i = 0; i < argc; i++)
+        arguments << QString::fromLocal8Bit(argv[i]);
+    QStringList files = fileArguments(arguments);
+    bool single = !arguments.contains("--new-instance")
+            && QSettings("ImageViewer", "ImageViewer").value("singleInstance", true).toBool();
+    if(single && SingleInstance::forward(files))
+        return 0;
+
     QApplication a(argc, argv);
+    QString trace = traceFile(a.arguments());
+    Trace::setEnabled(!trace.isEmpty());
     MainWindow w;
+    SingleInstance instance;
+    if(single && instance.listen())
+        QObject::connect(&instance, SIGNAL(filesReceived(QStringList)), &w, SLOT(openFiles(QStringList)));
     w.show();
+    //the decode starts before the event loop, while the window is first painted
+    if(!files.isEmpty()){
+        w.measureFirstPixel(launch);
+        w.openFiles(files);
+    }
 
-    return a.exec();
+    int result = a.exec();
+    if(!trace.isEmpty())
+        Trace::writeJson(trace);
+    return result;
 }
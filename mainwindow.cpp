@@ -16,8 +16,18 @@
 #include <QDebug>
 #include <QPainter>
 #include <QtMath>
+#include <QSettings>
+#include <QEventLoop>
+#include <QSpinBox>
+#include <QStatusBar>
+#include <QFileInfo>
+#include <QDir>
+#include <QDockWidget>
+#include <QActionGroup>
+
+#include "trace.h"
+#include "imagepyramid.h"
 
-#include <iostream>
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow)
@@ -26,19 +36,135 @@ MainWindow::MainWindow(QWidget *parent) :
     ui->setupUi(this);
     connectActions();
 
-    //activate scrolls
-    scrollArea = new QScrollArea();
-    scrollArea->setBackgroundRole(QPalette::Dark);
-    scrollArea->setWidget(ui->imageArea);
-    scrollArea->setAlignment(Qt::AlignCenter);
-    setCentralWidget(scrollArea);
+    //tiles of large on-disk images are cached up to this budget
+    QSettings settings("ImageViewer", "ImageViewer");
+    TiledImage::setMemoryBudget(settings.value("tileCacheMB", 512).toLongLong() * 1024 * 1024);
+    history.setMemoryLimit(settings.value("undoMemoryMB", 512).toLongLong() * 1024 * 1024);
+
+    //background decoding
+    loader = new ImageLoader(this);
+    connect(loader, SIGNAL(previewReady(QString,QImage,QSize)), this, SLOT(showPreview(QString,QImage,QSize)));
+    connect(loader, SIGNAL(loaded(QString,QSharedPointer<TiledImage>)), this, SLOT(imageLoaded(QString,QSharedPointer<TiledImage>)));
+    connect(loader, SIGNAL(failed(QString,QString)), this, SLOT(loadFailed(QString,QString)));
+
+    //neighbours in the folder are decoded ahead of time
+    decodeCache = new DecodeCache(this);
+    decodeCache->setMemoryBudget(settings.value("prefetchCacheMB", 512).toLongLong() * 1024 * 1024);
+    prefetchCount = settings.value("prefetchCount", 3).toInt();
+    connect(decodeCache, SIGNAL(ready(QString,QSharedPointer<TiledImage>)), this, SLOT(prefetched(QString,QSharedPointer<TiledImage>)));
+
+    //thumbnails of the folder, docked under the image
+    thumbnailStrip = new ThumbnailStrip();
+    QDockWidget *thumbnailDock = new QDockWidget(tr("thumbnails"), this);
+    thumbnailDock->setObjectName("thumbnailDock");
+    thumbnailDock->setWidget(thumbnailStrip);
+    thumbnailDock->setAllowedAreas(Qt::TopDockWidgetArea | Qt::BottomDockWidgetArea);
+    addDockWidget(Qt::BottomDockWidgetArea, thumbnailDock);
+    ui->menuView->addSeparator();
+    ui->menuView->addAction(thumbnailDock->toggleViewAction());
+    connect(thumbnailStrip, SIGNAL(fileActivated(QString)), this, SLOT(openThumbnail(QString)));
+
+    //headers of the folder are indexed in the background, for sorting by date or resolution
+    metadata = new MetadataIndex(QString(), this);
+    metadata->setThreadCount(settings.value("indexThreads", 0).toInt());
+    folderSort = MetadataIndex::SortKey(settings.value("folderSort", int(MetadataIndex::ByName)).toInt());
+    connect(metadata, SIGNAL(finished()), this, SLOT(folderIndexed()));
+    connect(metadata, SIGNAL(progress(int,int)), this, SLOT(indexProgress(int,int)));
+    QMenu *sortMenu = ui->menuView->addMenu(tr("sort folder by"));
+    QActionGroup *sortGroup = new QActionGroup(this);
+    const char *sortNames[] = {"name", "date taken", "resolution"};
+    for(int key = MetadataIndex::ByName; key <= MetadataIndex::ByResolution; key++){
+        QAction *action = sortMenu->addAction(tr(sortNames[key]));
+        action->setCheckable(true);
+        action->setChecked(key == folderSort);
+        action->setData(key);
+        sortGroup->addAction(action);
+    }
+    connect(sortGroup, SIGNAL(triggered(QAction*)), this, SLOT(setFolderSort(QAction*)));
+
+    //frames of animations and pages of multi-page files, position in the status bar
+    player = new FramePlayer(this);
+    player->setCacheBudget(settings.value("frameCacheMB", 64).toLongLong() * 1024 * 1024);
+    frameLabel = new QLabel();
+    frameSlider = new QSlider(Qt::Horizontal);
+    frameSlider->setMaximumWidth(200);
+    statusBar()->addPermanentWidget(frameLabel);
+    statusBar()->addPermanentWidget(frameSlider);
+    frameLabel->hide();
+    frameSlider->hide();
+    connect(player, SIGNAL(frameChanged(int,QImage,QRect)), this, SLOT(showFrame(int,QImage,QRect)));
+    connect(player, SIGNAL(playingChanged(bool)), ui->actionPlay, SLOT(setChecked(bool)));
+    connect(player, SIGNAL(playingChanged(bool)), this, SLOT(playbackChanged(bool)));
+    connect(frameSlider, SIGNAL(sliderMoved(int)), player, SLOT(seek(int)));
+
+    //background saving, progress and cancel live in the status bar
+    saver = new ImageSaver(this);
+    saveProgress = new QProgressBar();
+    saveProgress->setRange(0, 100);
+    saveProgress->setMaximumWidth(150);
+    cancelSave = new QPushButton(tr("Cancel"));
+    statusBar()->addPermanentWidget(saveProgress);
+    statusBar()->addPermanentWidget(cancelSave);
+    saveProgress->hide();
+    cancelSave->hide();
+    connect(saver, SIGNAL(progressChanged(int)), saveProgress, SLOT(setValue(int)));
+    connect(cancelSave, SIGNAL(clicked()), saver, SLOT(cancel()));
+    connect(saver, SIGNAL(saved(QString)), this, SLOT(saveFinished(QString)));
+    connect(saver, SIGNAL(failed(QString,QString)), this, SLOT(saveFailed(QString,QString)));
+    connect(saver, SIGNAL(canceled(QString)), this, SLOT(saveCanceled(QString)));
+
+    //the full resolution filter pass runs the same way
+    imageFilter = new ImageFilter(this);
+    filterProgress = new QProgressBar();
+    filterProgress->setRange(0, 100);
+    filterProgress->setMaximumWidth(150);
+    cancelFilter = new QPushButton(tr("Cancel"));
+    statusBar()->addPermanentWidget(filterProgress);
+    statusBar()->addPermanentWidget(cancelFilter);
+    filterProgress->hide();
+    cancelFilter->hide();
+    connect(imageFilter, SIGNAL(progressChanged(int)), filterProgress, SLOT(setValue(int)));
+    connect(cancelFilter, SIGNAL(clicked()), imageFilter, SLOT(cancel()));
+    connect(imageFilter, SIGNAL(finished(QSharedPointer<TiledImage>)), this, SLOT(filterFinished(QSharedPointer<TiledImage>)));
+    connect(imageFilter, SIGNAL(canceled()), this, SLOT(filterCanceled()));
+
+    //one budget for all the pixels held, caches give memory back first, then the undo history
+    governor = new MemoryGovernor(this);
+    memoryGauge = new QProgressBar();
+    memoryGauge->setMaximumWidth(150);
+    memoryGauge->setToolTip(tr("Memory held by images, caches and undo"));
+    statusBar()->addPermanentWidget(memoryGauge);
+    connect(governor, SIGNAL(usageChanged(qint64,qint64)), this, SLOT(showMemory(qint64,qint64)));
+    governor->addRelease(MemoryGovernor::Caches, [this](qint64 bytes, qint64 *){ return decodeCache->release(bytes); });
+    governor->addRelease(MemoryGovernor::Caches, [](qint64 bytes, qint64 *){ return TiledImage::trimCache(bytes); });
+    governor->addRelease(MemoryGovernor::Undo, [this](qint64 bytes, qint64 *pending){ return history.release(bytes, pending); });
+    governor->addRelease(MemoryGovernor::Pyramids, [](qint64, qint64 *){ return ImagePyramid::releaseCaches(); });
+    governor->setBudget(settings.value("memoryBudgetMB", 2048).toLongLong() * 1024 * 1024);
+
+    //histograms of the image or the selection, docked at the side
+    statisticsPanel = new StatisticsPanel();
+    statisticsDock = new QDockWidget(tr("statistics"), this);
+    statisticsDock->setObjectName("statisticsDock");
+    statisticsDock->setWidget(statisticsPanel);
+    statisticsDock->setAllowedAreas(Qt::LeftDockWidgetArea | Qt::RightDockWidgetArea);
+    addDockWidget(Qt::RightDockWidgetArea, statisticsDock);
+    statisticsDock->hide();
+    ui->menuView->addAction(statisticsDock->toggleViewAction());
+    connect(statisticsDock, SIGNAL(visibilityChanged(bool)), this, SLOT(updateStatistics()));
+    connect(ui->imageArea, SIGNAL(pipelineChanged()), this, SLOT(updateStatistics()));
+    connect(ui->imageArea, SIGNAL(selectionChanged()), this, SLOT(updateStatistics()));
+
+    //tone and convolution filters, previewed on a reduced copy while the sliders move.
+    //the dialog is built when it's first needed, not at startup
+    filterDialog = 0;
+
+    //the wheel zooms around the cursor
+    connect(ui->imageArea, SIGNAL(zoomRequested(double,QPoint)), this, SLOT(zoomAt(double,QPoint)));
 
     //resize window to proper size
     resize(QGuiApplication::primaryScreen()->availableSize() * 3 / 5);
 
-    //
-    ui->toolBar->setMovable(false);     //to avoid out of sync. rubberband
-    rubberBand = new QRubberBand(QRubberBand::Rectangle, this);
+    ui->toolBar->setMovable(false);
 
     this->setWindowTitle(tr("Image Viewer"));
 
@@ -51,13 +177,12 @@ MainWindow::~MainWindow()
 }
 void MainWindow::open(void){
     //check if we need to save this file first.
-    rubberBand->hide();
+    ui->imageArea->hideSelection();
     if(isImageLoaded())
         if(isNeedSave())
             if(!checkSave())
                 return;
-    rotation = 0;
-    QString imagePath = QFileDialog::getOpenFileName(this,tr("Open File"),"",tr("all(*.jpg *.jpeg *.png *bmp);;JPEG (*.jpg *.jpeg);;PNG (*.png);;BMP (*.bmp)" ));
+    QString imagePath = QFileDialog::getOpenFileName(this,tr("Open File"),"",tr("all(*.jpg *.jpeg *.png *bmp *.gif *.webp *.tif *.tiff);;JPEG (*.jpg *.jpeg);;PNG (*.png);;BMP (*.bmp);;GIF (*.gif);;WebP (*.webp);;TIFF (*.tif *.tiff)" ));
     if(imagePath.isEmpty()){
         return;
     }else if (!loadFile(imagePath)){
@@ -66,89 +191,438 @@ void MainWindow::open(void){
         msg.exec();
         return;
     }
-    ui->imageArea->resize(ui->imageArea->pixmap()->size());
-    ui->imageArea->setFrameStyle(QFrame::Box);
+}
 
-    orgImage = new QPixmap(*ui->imageArea->pixmap());
-    stack1.clear();
-    stack2.clear();
-    snapshot();
+void MainWindow::showPreview(const QString &, const QImage &preview, const QSize &fullSize){
+    scaleFactor = 1;
+    previewShown = true;
+    ui->imageArea->setPreview(preview, fullSize);
+    ui->imageArea->setScale(scaleFactor);
+}
+
+void MainWindow::imageLoaded(const QString &fileName, const QSharedPointer<TiledImage> &image){
+    //kept for paging back to it
+    decodeCache->insert(fileName, image);
+
+    //the view may already show the preview, keep its geometry
+    EditPipeline edits(image);
+    if(!previewShown || ui->imageArea->imageSize() != edits.size())
+        scaleFactor = 1;
+    previewShown = false;
+    ui->imageArea->setPipeline(edits);
+    ui->imageArea->setScale(scaleFactor);
+
+    history.clear();
+    UndoHistory::Entry shot;
+    shot.kind = UndoHistory::Load;
+    shot.checkpoint = edits;
+    snapshot(shot);
+
+    //animations play right away, pages of a document are stepped through
+    if(player->open(fileName) && player->isAnimation())
+        player->play();
+    updateFrameControls();
+}
+
+void MainWindow::prefetched(const QString &fileName, const QSharedPointer<TiledImage> &image){
+    if(fileName != awaitedFile)
+        return;
+    awaitedFile.clear();
+    if(image)
+        imageLoaded(fileName, image);
+    else
+        loader->load(fileName, ui->imageArea->viewport()->size());    //reports the failure
+}
+
+void MainWindow::loadFailed(const QString &, const QString &error){
+    startupDone();
+    framePending = false;
+    player->close();
+    updateFrameControls();
+    setWindowFilePath(QString());
+    ui->imageArea->setImage(QImage());
+    QMessageBox msg;
+    msg.setText("failed to decode the image!");
+    msg.setInformativeText(error);
+    msg.exec();
 }
 
 void MainWindow::save(void){
-    if(ui->imageArea->pixmap() == NULL){
+    if(!isImageLoaded()){
         QMessageBox msg;
         msg.setText("no image to be saved");
         msg.exec();
         return;
     }
-    enterFunction();
-    rubberBand->hide();
-    QString imagePath = QFileDialog::getSaveFileName(this,tr("Save File"),"",tr("JPEG (*.jpg *.jpeg);;PNG (*.png);;BMP (*.bmp)"));
-
-    QImage imageObject = ui->imageArea->pixmap()->toImage();
-    if(!imageObject.save(imagePath)){
+    settleFrame();
+    if(saver->isSaving()){
         QMessageBox msg;
-        msg.setText("Failed to save ");
+        msg.setText("the image is still being saved");
         msg.exec();
-    }else{
-        isSaved = true;
+        return;
     }
-    exitFunction();
+    ui->imageArea->hideSelection();
+    QString imagePath = QFileDialog::getSaveFileName(this,tr("Save File"),"",tr("JPEG (*.jpg *.jpeg);;PNG (*.png);;BMP (*.bmp)"));
+    if(imagePath.isEmpty())
+        return;
+    ImageSaver::Options options;
+    if(!readSaveOptions(QFileInfo(imagePath).suffix().toLower(), &options))
+        return;
+
+    TraceSpan span("MainWindow::save", ui->imageArea->imageSize());
+    //the edits are resampled once, at full resolution, while the ui keeps running.
+    //the pipeline is a snapshot, editing can go on meanwhile
+    savingChange = changeCount;
+    saveProgress->setValue(0);
+    saveProgress->show();
+    cancelSave->show();
+    statusBar()->showMessage(tr("Saving %1").arg(QFileInfo(imagePath).fileName()));
+    saver->save(ui->imageArea->pipeline(), imagePath, options);
+}
+
+void MainWindow::saveFinished(const QString &fileName){
+    saveProgress->hide();
+    cancelSave->hide();
+    //edits made while it was written still need saving
+    if(changeCount == savingChange)
+        isSaved = true;
+    statusBar()->showMessage(tr("Saved %1").arg(QFileInfo(fileName).fileName()), 3000);
+}
+
+void MainWindow::saveFailed(const QString &, const QString &error){
+    saveProgress->hide();
+    cancelSave->hide();
+    statusBar()->clearMessage();
+    QMessageBox msg;
+    msg.setText("Failed to save " + error);
+    msg.exec();
+}
+
+void MainWindow::saveCanceled(const QString &){
+    saveProgress->hide();
+    cancelSave->hide();
+    statusBar()->showMessage(tr("Save canceled"), 3000);
+}
+
+void MainWindow::waitForSave(){
+    //closing has to wait until the file is complete
+    QEventLoop loop;
+    connect(saver, SIGNAL(saved(QString)), &loop, SLOT(quit()));
+    connect(saver, SIGNAL(failed(QString,QString)), &loop, SLOT(quit()));
+    connect(saver, SIGNAL(canceled(QString)), &loop, SLOT(quit()));
+    while(saver->isSaving())
+        loop.exec();
 }
 
 bool MainWindow::loadFile(const QString &fileName){
-    enterFunction();
-    QImageReader reader(fileName);
-    reader.setAutoTransform(true);
-    const QImage image = reader.read();
-    if (image.isNull()) {
+    TraceSpan span("MainWindow::loadFile");
+    //only the header is checked here, decoding happens in the background
+    if(!QImageReader(fileName).canRead()){
+        loader->cancel();
         setWindowFilePath(QString());
-        ui->imageArea->setPixmap(QPixmap());
-        ui->imageArea->adjustSize();
-        exitFunction();
+        ui->imageArea->setImage(QImage());
         return false;
     }
-    scaleFactor = 1;
-    ui->imageArea->setPixmap(QPixmap::fromImage(image));
-    ui->imageArea->adjustSize();
+    //frames of the previous file must not replace the new one
+    framePending = false;
+    player->close();
+    updateFrameControls();
+    previewShown = false;
     setWindowFilePath(fileName);
-    exitFunction();
+    QString path = QFileInfo(fileName).absoluteFilePath();
+
+    //decoded ahead of time: shown right away, or as soon as its decode is done
+    awaitedFile.clear();
+    QSharedPointer<TiledImage> cached = decodeCache->image(path);
+    if(cached){
+        loader->cancel();
+        imageLoaded(path, cached);
+    }else if(decodeCache->isPending(path)){
+        loader->cancel();
+        awaitedFile = path;
+    }else{
+        loader->load(path, ui->imageArea->viewport()->size());
+    }
+
+    //listing the folder loads every image plugin and thumbnails compete with the decode,
+    //at startup both wait until the image is on screen
+    if(launched.isValid())
+        deferredFolder = path;
+    else
+        showFolder(path);
     return true;
 }
 
+void MainWindow::showFolder(const QString &path){
+    if(QFileInfo(path).absolutePath() != folderPath){
+        listFolder(path);
+        //files indexed before are in order right away, the others once the scan is done
+        metadata->scan(folderFiles);
+        folderFiles = metadata->sorted(folderFiles, folderSort);
+        thumbnailStrip->setFiles(folderFiles);
+    }
+    folderIndex = folderFiles.indexOf(path);
+    thumbnailStrip->setCurrentFile(path);
+    prefetchNeighbours(path);
+}
+
+void MainWindow::findDuplicates(void){
+    //left open next to the viewer, the files it lists open there
+    if(!duplicatesDialog){
+        duplicatesDialog = new DuplicatesDialog(this);
+        duplicatesDialog->setFolder(folderPath.isEmpty() ? QDir::homePath() : folderPath);
+        connect(duplicatesDialog, SIGNAL(fileActivated(QString)), this, SLOT(openDuplicate(QString)));
+    }
+    duplicatesDialog->show();
+    duplicatesDialog->raise();
+    duplicatesDialog->activateWindow();
+}
+
+void MainWindow::openDuplicate(const QString &fileName){
+    openFiles(QStringList() << fileName);
+}
+
+void MainWindow::sortFolder(){
+    QString current = folderIndex >= 0 ? folderFiles.at(folderIndex) : QString();
+    //the listing is by name, other orders start from it so ties stay in name order
+    folderFiles.sort(Qt::CaseInsensitive);
+    folderFiles = metadata->sorted(folderFiles, folderSort);
+    folderIndex = folderFiles.indexOf(current);
+    thumbnailStrip->setFiles(folderFiles);
+    if(!current.isEmpty())
+        thumbnailStrip->setCurrentFile(current);
+}
+
+void MainWindow::setFolderSort(QAction *action){
+    folderSort = MetadataIndex::SortKey(action->data().toInt());
+    QSettings("ImageViewer", "ImageViewer").setValue("folderSort", int(folderSort));
+    sortFolder();
+}
+
+void MainWindow::folderIndexed(){
+    statusBar()->clearMessage();
+    if(folderSort != MetadataIndex::ByName)
+        sortFolder();
+}
+
+void MainWindow::indexProgress(int done, int total){
+    //only worth mentioning for folders that take a while
+    if(total > 1000)
+        statusBar()->showMessage(tr("Indexing %1 of %2").arg(done).arg(total));
+}
+
+void MainWindow::openFiles(const QStringList &files){
+    //files from the command line or from a later launch, the window comes to the front
+    if(isMinimized())
+        showNormal();
+    raise();
+    activateWindow();
+    //the others are a page away in the folder
+    if(files.isEmpty())
+        return;
+    if(isImageLoaded() && isNeedSave() && !checkSave())
+        return;
+    if(!loadFile(files.first())){
+        startupDone();
+        QMessageBox msg;
+        msg.setText("file not found!");
+        msg.exec();
+    }
+}
+
+void MainWindow::measureFirstPixel(const QElapsedTimer &launch){
+    launched = launch;
+    connect(ui->imageArea, SIGNAL(painted()), this, SLOT(firstPixel()));
+}
+
+void MainWindow::firstPixel(){
+    //the preview or the image, the canvas doesn't announce empty paints.
+    //the span covers the time from the launch, it shows with --trace
+    qint64 elapsed = launched.elapsed();
+    qInfo("first pixel after %lld ms", elapsed);
+    TraceSpan span("MainWindow::firstPixel", ui->imageArea->imageSize());
+    span.backdate(elapsed);
+    startupDone();
+}
+
+void MainWindow::startupDone(){
+    if(!launched.isValid())
+        return;
+    disconnect(ui->imageArea, SIGNAL(painted()), this, SLOT(firstPixel()));
+    launched.invalidate();
+    if(!deferredFolder.isEmpty())
+        showFolder(deferredFolder);
+    deferredFolder.clear();
+}
+
+void MainWindow::listFolder(const QString &fileName){
+    QStringList filters;
+    foreach(const QByteArray &format, QImageReader::supportedImageFormats())
+        filters << "*." + QString(format);
+    QDir dir = QFileInfo(fileName).absoluteDir();
+    folderPath = dir.absolutePath();
+    folderFiles.clear();
+    foreach(const QString &name, dir.entryList(filters, QDir::Files, QDir::Name | QDir::IgnoreCase))
+        folderFiles.append(dir.absoluteFilePath(name));
+}
+
+void MainWindow::prefetchNeighbours(const QString &fileName){
+    //the next ones in the paging direction and the one just left behind
+    QStringList wanted;
+    if(decodeCache->isPending(fileName))
+        wanted << fileName;
+    for(int i = 1; i <= prefetchCount; i++){
+        int index = folderIndex + i * direction;
+        if(folderIndex >= 0 && index >= 0 && index < folderFiles.size())
+            wanted << folderFiles.at(index);
+    }
+    int behind = folderIndex - direction;
+    if(folderIndex >= 0 && behind >= 0 && behind < folderFiles.size())
+        wanted << folderFiles.at(behind);
+    decodeCache->prefetch(wanted);
+}
+
+void MainWindow::nextImage(void){
+    if(folderIndex >= 0)
+        openFolderFile(folderIndex + 1);
+}
+
+void MainWindow::previousImage(void){
+    if(folderIndex >= 0)
+        openFolderFile(folderIndex - 1);
+}
+
+void MainWindow::showMemory(qint64 used, qint64 budget){
+    const qint64 MB = 1024 * 1024;
+    memoryGauge->setRange(0, int(budget / MB));
+    memoryGauge->setValue(int(qMin(used, budget) / MB));
+    memoryGauge->setFormat(tr("%1 of %2 MB").arg(used / MB).arg(budget / MB));
+}
+
+void MainWindow::playbackChanged(bool playing){
+    //the canvas holds its own copy of the frame, the player's buffer stays unshared
+    QImage frame = ui->imageArea->frame();
+    if(!playing && framePending && !frame.isNull())
+        showFrame(player->currentFrame(), frame, frame.rect());
+}
+
+void MainWindow::settleFrame(){
+    //edits apply to the frame shown, pausing makes it the image
+    player->pause();
+}
+
+void MainWindow::togglePlayback(void){
+    //playing replaces the frame shown, and its edits with it
+    if(!player->isOpen() || (!player->isPlaying() && isNeedSave() && !checkSave())){
+        ui->actionPlay->setChecked(player->isPlaying());
+        return;
+    }
+    player->togglePlaying();
+}
+
+void MainWindow::nextFrame(void){
+    if(player->isOpen() && (!isNeedSave() || checkSave()))
+        player->nextFrame();
+}
+
+void MainWindow::previousFrame(void){
+    if(player->isOpen() && (!isNeedSave() || checkSave()))
+        player->previousFrame();
+}
+
+void MainWindow::showFrame(int, const QImage &frame, const QRect &changed){
+    TraceSpan span("MainWindow::showFrame", frame.size());
+    //while playing the frame is only drawn, it becomes the image once playback stops.
+    //the image shown unedited has the geometry of the frames
+    const EditPipeline &shown = ui->imageArea->pipeline();
+    if(player->isPlaying() && !shown.isNull() && shown.size() == frame.size() && shown.transform().isIdentity()){
+        framePending = true;
+        ui->imageArea->setFrame(frame, changed);
+        updateFrameControls();
+        return;
+    }
+    framePending = false;
+    //the frame stands in for the decoded image, as if it had been opened. it isn't narrowed,
+    //that would look at every pixel on this thread for every step
+    QSharedPointer<TiledImage> image = TiledImage::fromImage(frame, false);
+    ui->imageArea->setPipeline(EditPipeline(image));
+    history.clear();
+    UndoHistory::Entry shot;
+    shot.kind = UndoHistory::Load;
+    shot.checkpoint = EditPipeline(image);
+    snapshot(shot);
+    updateFrameControls();
+}
+
+void MainWindow::updateFrameControls(){
+    bool frames = player->isOpen();
+    frameLabel->setVisible(frames);
+    frameSlider->setVisible(frames && player->frameCount() > 0);
+    ui->actionPlay->setEnabled(frames && player->isAnimation());
+    ui->actionPlay->setChecked(player->isPlaying());
+    ui->actionNext_frame->setEnabled(frames);
+    ui->actionPrevious_frame->setEnabled(frames);
+    if(!frames)
+        return;
+    int current = qMax(0, player->currentFrame());
+    QString name = player->isAnimation() ? tr("frame") : tr("page");
+    if(player->frameCount() > 0)
+        frameLabel->setText(tr("%1 %2/%3").arg(name).arg(current + 1).arg(player->frameCount()));
+    else
+        frameLabel->setText(tr("%1 %2").arg(name).arg(current + 1));
+    frameSlider->setRange(0, qMax(0, player->frameCount() - 1));
+    if(!frameSlider->isSliderDown())
+        frameSlider->setValue(current);
+}
+
+void MainWindow::openThumbnail(const QString &fileName){
+    openFolderFile(folderFiles.indexOf(fileName));
+}
+
+void MainWindow::openFolderFile(int index){
+    if(index < 0 || index >= folderFiles.size() || index == folderIndex)
+        return;
+    if(isNeedSave() && !checkSave()){
+        thumbnailStrip->setCurrentFile(folderFiles.value(folderIndex));
+        return;
+    }
+    ui->imageArea->hideSelection();
+    direction = index < folderIndex ? -1 : 1;
+    if(!loadFile(folderFiles.at(index))){
+        QMessageBox msg;
+        msg.setText("file not found!");
+        msg.exec();
+    }
+}
+
 void MainWindow::fitToWindow(void){
-    enterFunction();
+    TraceSpan span("MainWindow::fitToWindow", ui->imageArea->imageSize());
     if(!isImageLoaded())
         return;
-    double sx = 1.0*ui->imageArea->height()/(this->height()-44), sy = 1.0*ui->imageArea->width()/this->width();
-    sx = (sx > sy? sx: sy);
-    scaleImage(1.0/sx);
+    QSize area = ui->imageArea->viewport()->size();
+    QSize size = ui->imageArea->imageSize();
+    double s = std::min(1.0*area.width()/size.width(), 1.0*area.height()/size.height());
+    scaleImage(s/scaleFactor);
     snapshot();
-    exitFunction();
 }
 
 void MainWindow::normalSize(void){
     if(!isImageLoaded())
         return;
-    enterFunction();
+    TraceSpan span("MainWindow::normalSize", ui->imageArea->imageSize());
     scaleImage(1/scaleFactor);
     snapshot();
-    exitFunction();
 }
 
 void MainWindow::zoomIn(void){
     if(!isImageLoaded())
         return;
-    int width = ui->imageArea->width();
-    int height = ui->imageArea->height();
-
-
-    if(rubberBand->isVisible()){ // zoom to specified region
-        zoomToRegion(getSelectedRegOnImg(),false);
+    if(ui->imageArea->hasSelection()){ // zoom to specified region
+        zoomToRegion(ui->imageArea->selection(),false);
+        ui->imageArea->hideSelection();
 
     }
-    else if(width*height*ZOOM_FACTOR*ZOOM_FACTOR < MAX_IMG_AREA){ // normal zoomIn
+    else if(canScale(ZOOM_FACTOR)){ // normal zoomIn
         //check if the picture is zoomed enough.
         scaleImage(ZOOM_FACTOR);
         snapshot();
@@ -159,8 +633,8 @@ void MainWindow::zoomIn(void){
 void MainWindow::zoomOut(void){
     if(!isImageLoaded())
         return;
-    int width = ui->imageArea->width();
-    int height = ui->imageArea->height();
+    int width = ui->imageArea->scaledSize().width();
+    int height = ui->imageArea->scaledSize().height();
 
     if(width*height > MIN_IMG_AREA){
         //check if the picture is zoomed enough.
@@ -170,34 +644,47 @@ void MainWindow::zoomOut(void){
 }
 void MainWindow::scaleImage(double scale)
 {
-    enterFunction();
+    TraceSpan span("MainWindow::scaleImage", ui->imageArea->imageSize());
 
     scaleFactor *= scale;
-    ui->imageArea->resize(scaleFactor*ui->imageArea->pixmap()->size());
-    adjustScrollBar(scrollArea->horizontalScrollBar(), scale);
-    adjustScrollBar(scrollArea->verticalScrollBar(), scale);
-    rubberBand->hide();
+    ui->imageArea->setScale(scaleFactor);
+}
 
-    exitFunction();
+void MainWindow::zoomAt(double factor, const QPoint &anchor){
+    //like scrolling, wheel zoom isn't recorded for undo
+    if(!isImageLoaded())
+        return;
+    QSize size = ui->imageArea->scaledSize();
+    if(factor > 1 ? !canScale(factor) : size.width()*size.height()*factor*factor <= MIN_IMG_AREA)
+        return;
+    scaleFactor *= factor;
+    ui->imageArea->setScale(scaleFactor, anchor);
 }
 
-void MainWindow::snapshot(){ //collect a snapshot of current picture for later undo/redo
-    stack2.clear();
-    screenshot shot;
-    shot.pix = *ui->imageArea->pixmap();
+void MainWindow::snapshot(){ //record a view change for later undo/redo
+    snapshot(UndoHistory::Entry());
+}
+
+void MainWindow::snapshot(UndoHistory::Entry shot){ //record an operation for later undo/redo
+    //edits apply to the frame shown, playing on would replace it
+    if(shot.kind != UndoHistory::View && shot.kind != UndoHistory::Load)
+        player->pause();
     shot.scale=scaleFactor;
-    shot.need_rectangle=false;
-    stack1.push(shot);
+    history.push(shot);
 
     //new things has been done to image, it needs to be saved
     isSaved = false;
+    changeCount++;
+    governor->check();
+}
 
-    if(stack1.size()>20){
-        while(stack1.size()>2)
-            stack2.push(stack1.pop());
-        stack1.pop();
-        while(!stack2.isEmpty())
-            stack1.push(stack2.pop());
+void MainWindow::restoreState(){ //show the image and view of the current history entry
+    UndoHistory::Entry &shot = history.current();
+    ui->imageArea->setPipeline(history.image());
+    scaleFactor=shot.scale;
+    ui->imageArea->setScale(scaleFactor);
+    if(shot.need_rectangle){
+        zoomToRegion(shot.rectangle,true);
     }
 }
 
@@ -236,6 +723,10 @@ void MainWindow::connectActions(void){
     action = ui->actionRotate;
     connect(action,SIGNAL(triggered()), this,SLOT(rotate()));
 
+    //filters
+    action = ui->actionFilter;
+    connect(action,SIGNAL(triggered()), this,SLOT(filter()));
+
     //close file
     action = ui->actionClose_file;
     connect(action,SIGNAL(triggered()), this,SLOT(closeFile()));
@@ -252,43 +743,49 @@ void MainWindow::connectActions(void){
     action = ui->actionRedo;
     connect(action,SIGNAL(triggered()), this,SLOT(redo()));
 
+    //copies of the same picture in a folder
+    action = ui->actionFind_duplicates;
+    connect(action,SIGNAL(triggered()), this,SLOT(findDuplicates()));
+
+    //frames of animations and pages
+    action = ui->actionPlay;
+    connect(action,SIGNAL(triggered()), this,SLOT(togglePlayback()));
+    action = ui->actionNext_frame;
+    connect(action,SIGNAL(triggered()), this,SLOT(nextFrame()));
+    action = ui->actionPrevious_frame;
+    connect(action,SIGNAL(triggered()), this,SLOT(previousFrame()));
+
+    //paging through the folder
+    action = ui->actionNext_image;
+    connect(action,SIGNAL(triggered()), this,SLOT(nextImage()));
+    action = ui->actionPrevious_image;
+    connect(action,SIGNAL(triggered()), this,SLOT(previousImage()));
+
+    //tracing of the operations
+    action = ui->actionRecord_trace;
+    action->setChecked(Trace::isEnabled());
+    connect(action,SIGNAL(toggled(bool)), this,SLOT(recordTrace(bool)));
+    action = ui->actionSave_trace;
+    connect(action,SIGNAL(triggered()), this,SLOT(saveTrace()));
+
     //exit
     action = ui->actionExit;
     connect(action,SIGNAL(triggered()), this,SLOT(exit()));
 }
-void MainWindow::adjustScrollBar(QScrollBar *scrollBar, double factor){
-    scrollBar->setValue(int(factor * scrollBar->value()
-                            + ((factor - 1) * scrollBar->pageStep()/2)));
-}
-
 
 void MainWindow::undo(void){
-    enterFunction();
-    if(stack1.size()>1){
-        stack2.push(stack1.pop());
-        ui->imageArea->setPixmap(stack1.top().pix);
-        scaleFactor=stack1.top().scale;
-        ui->imageArea->resize(scaleFactor*ui->imageArea->pixmap()->size());
-        if(stack1.top().need_rectangle){
-            zoomToRegion(stack1.top().rectangle,true);
-        }
+    TraceSpan span("MainWindow::undo", ui->imageArea->imageSize());
+    if(history.undo()){
+        restoreState();
     }
-    rubberBand->hide();
-    exitFunction();
+    ui->imageArea->hideSelection();
 }
 void MainWindow::redo(void){
-    enterFunction();
-    if(stack2.size()>0){
-        stack1.push(stack2.pop());
-        ui->imageArea->setPixmap(stack1.top().pix);
-        scaleFactor=stack1.top().scale;
-        ui->imageArea->resize(scaleFactor*ui->imageArea->pixmap()->size());
-        if(stack1.top().need_rectangle){
-            zoomToRegion(stack1.top().rectangle,true);
-        }
+    TraceSpan span("MainWindow::redo", ui->imageArea->imageSize());
+    if(history.redo()){
+        restoreState();
     }
-    rubberBand->hide();
-    exitFunction();
+    ui->imageArea->hideSelection();
 }
 
 void MainWindow::closeFile(void){
@@ -297,29 +794,26 @@ void MainWindow::closeFile(void){
         if(!checkSave())
             return;
     }
-    enterFunction();
-    ui->imageArea->setPixmap(QPixmap());
-    ui->imageArea->setFrameStyle(QFrame::NoFrame); //remove frame
+    TraceSpan span("MainWindow::closeFile", ui->imageArea->imageSize());
+    loader->cancel();
+    framePending = false;
+    player->close();
+    updateFrameControls();
+    ui->imageArea->setImage(QImage());
     scaleImage(1/scaleFactor);
-    rubberBand->hide();
-    snapshot();
-    exitFunction();
+    ui->imageArea->hideSelection();
+    UndoHistory::Entry shot;
+    shot.kind = UndoHistory::Close;
+    snapshot(shot);
 }
 
 void MainWindow::reset(void){
-    enterFunction();
-    stack2.clear();
-    while(stack1.size()>1){
-       stack1.pop();
+    TraceSpan span("MainWindow::reset", ui->imageArea->imageSize());
+    if(!history.isEmpty()){
+        history.reset();
+        restoreState();
     }
-    ui->imageArea->setPixmap(stack1.top().pix);
-    scaleFactor=stack1.top().scale;
-    ui->imageArea->resize(scaleFactor*ui->imageArea->pixmap()->size());
-    if(stack1.top().need_rectangle){
-        zoomToRegion(stack1.top().rectangle,true);
-    }
-    rubberBand->hide();
-    exitFunction();
+    ui->imageArea->hideSelection();
 }
 
 bool valid_input(QString s){
@@ -334,23 +828,20 @@ void MainWindow::rotate(void){
         msg.exec();
         return;
     }
-    enterFunction();
-    rubberBand->hide();
+    settleFrame();
+    ui->imageArea->hideSelection();
     bool ok;
     double text = QInputDialog::getDouble(this, tr("Angle"), tr("Angle in degree"),30,-360,360,2, &ok);
     if (ok ){
+        TraceSpan span("MainWindow::rotate", ui->imageArea->imageSize());
         try{
-            double angle = text;
-            rotation += angle;
-//            rotation =rotation - 360/(int)rotation * (int) rotation; //mod like op
-            rotation = rotation - (int)rotation/360 * 360; //mod like op
-            QPixmap pixmap(*orgImage);
-            QMatrix rm;
-            rm.rotate(rotation);
-            pixmap = pixmap.transformed(rm);
-            ui->imageArea->setPixmap(pixmap);
-            ui->imageArea->resize(scaleFactor*ui->imageArea->pixmap()->size());
-            snapshot();
+            //rotates the current result, earlier crops are kept
+            UndoHistory::Entry shot;
+            shot.kind = UndoHistory::Rotate;
+            shot.rotation = text;
+            snapshot(shot);
+            ui->imageArea->setPipeline(history.image());
+            ui->imageArea->setScale(scaleFactor);
         }catch(std::exception &e){
             QMessageBox msgBox;
             msgBox.setText("Please Enter a Valid Angle.");
@@ -359,7 +850,6 @@ void MainWindow::rotate(void){
     }else if (!ok){
         //do nothing
     }
-    exitFunction();
 }
 
 void MainWindow::crop(void){
@@ -369,15 +859,116 @@ void MainWindow::crop(void){
         msg.exec();
         return;
     }
-    if(rubberBand->isVisible()){
-        enterFunction();
-        rubberBand->hide();
-        QPixmap pix = ui->imageArea->pixmap()->copy(getSelectedRegOnImg());
-        ui->imageArea->setPixmap(pix);
-        ui->imageArea->resize(scaleFactor*ui->imageArea->pixmap()->size());
-        snapshot();
-        exitFunction();
+    settleFrame();
+    if(ui->imageArea->hasSelection()){
+        TraceSpan span("MainWindow::crop", ui->imageArea->imageSize());
+        ui->imageArea->hideSelection();
+        //only recorded in the edit pipeline, no pixels are copied
+        UndoHistory::Entry shot;
+        shot.kind = UndoHistory::Crop;
+        shot.crop = ui->imageArea->selection();
+        snapshot(shot);
+        ui->imageArea->setPipeline(history.image());
+        ui->imageArea->setScale(scaleFactor);
+    }
+}
+
+void MainWindow::filter(void){
+    if(!isImageLoaded()){
+        QMessageBox msg;
+        msg.setText("no image to be filtered");
+        msg.exec();
+        return;
     }
+    settleFrame();
+    ui->imageArea->hideSelection();
+    EditPipeline edits = ui->imageArea->pipeline();
+
+    //the proxy has about the resolution on screen, a few viewports at most
+    QSize area = ui->imageArea->viewport()->size();
+    QSize size = edits.size();
+    double fit = qSqrt(4.0 * area.width() * area.height() / (1.0 * size.width() * size.height()));
+    filterScale = std::min(std::min(1.0, scaleFactor), fit);
+    QSize proxySize = (QSizeF(size) * filterScale).toSize().expandedTo(QSize(1, 1));
+    filterScale = 1.0 * proxySize.width() / size.width();
+    ImagePyramid pyramid;
+    pyramid.setSource(edits.source());
+    filterProxy = pyramid.render(edits.transform() * QTransform::fromScale(filterScale, filterScale), proxySize);
+
+    if(!filterDialog){
+        filterDialog = new FilterDialog(this);
+        connect(filterDialog, SIGNAL(settingsChanged()), this, SLOT(previewFilter()));
+    }
+    filterDialog->resetSettings();
+    bool accepted = filterDialog->exec() == QDialog::Accepted;
+    ImageFilter::Settings settings = filterDialog->settings();
+    filterProxy = QImage();
+    if(!accepted || settings.isIdentity()){
+        ui->imageArea->setPipeline(edits);
+        return;
+    }
+
+    //the full resolution pass only runs now, in the background. its result is a
+    //checkpoint of the history, the image stays as it was until then
+    TraceSpan span("MainWindow::filter", size);
+    ui->imageArea->setPipeline(edits);
+    filtering = edits;
+    filterProgress->setValue(0);
+    filterProgress->show();
+    cancelFilter->show();
+    statusBar()->showMessage(tr("Filtering"));
+    imageFilter->start(edits, settings);
+}
+
+void MainWindow::filterFinished(const QSharedPointer<TiledImage> &image){
+    filterProgress->hide();
+    cancelFilter->hide();
+    statusBar()->clearMessage();
+    EditPipeline edits = ui->imageArea->pipeline();
+    EditPipeline filtered = filtering;
+    filtering = EditPipeline();
+    //an image edited, undone or replaced meanwhile keeps its pixels
+    if(edits.source() != filtered.source() || edits.transform() != filtered.transform()
+            || edits.size() != filtered.size()){
+        statusBar()->showMessage(tr("Filter discarded, the image changed"), 3000);
+        return;
+    }
+    if(!image){
+        tooLarge();
+        return;
+    }
+    TraceSpan span("MainWindow::filterFinished", image->size());
+    UndoHistory::Entry shot;
+    shot.kind = UndoHistory::Filter;
+    shot.checkpoint = EditPipeline(image);
+    snapshot(shot);
+    ui->imageArea->setPipeline(history.image());
+    ui->imageArea->setScale(scaleFactor);
+}
+
+void MainWindow::filterCanceled(){
+    filterProgress->hide();
+    cancelFilter->hide();
+    filtering = EditPipeline();
+    statusBar()->showMessage(tr("Filter canceled"), 3000);
+}
+
+void MainWindow::previewFilter(){
+    if(filterProxy.isNull())
+        return;
+    TraceSpan span("MainWindow::previewFilter", filterProxy.size());
+    QSize size = ui->imageArea->imageSize();
+    ui->imageArea->setPreview(ImageFilter::apply(filterProxy, filterDialog->settings(), filterScale), size);
+}
+
+void MainWindow::updateStatistics(){
+    //nothing is computed while the panel can't be seen
+    if(!statisticsDock->isVisible() || ui->imageArea->pipeline().isNull()){
+        statisticsPanel->clear();
+        return;
+    }
+    statisticsPanel->showStatistics(ui->imageArea->pipeline(),
+                                    ui->imageArea->hasSelection() ? ui->imageArea->selection() : QRect());
 }
 
 void MainWindow::exit(void){
@@ -389,7 +980,7 @@ void MainWindow::exit(void){
 }
 
 bool MainWindow::isNeedSave(void){
-    return stack1.size()>1 && isImageLoaded() && !isSaved;
+    return history.canUndo() && isImageLoaded() && !isSaved;
 }
 
 bool MainWindow::checkSave(void){
@@ -400,7 +991,8 @@ bool MainWindow::checkSave(void){
                  QMessageBox::Save | QMessageBox::Discard | QMessageBox::Cancel);
     if (ret == QMessageBox::Save){
         save();
-        return true;
+        waitForSave();
+        return isSaved;
     }
     else if (ret == QMessageBox::Cancel)
         return false;
@@ -419,129 +1011,39 @@ void MainWindow::closeEvent(QCloseEvent *event){
 }
 
 bool MainWindow::isImageLoaded(void){
-    return (ui->imageArea->pixmap() != NULL && !ui->imageArea->pixmap()->isNull());
+    return ui->imageArea->hasImage() && !loader->isLoading() && awaitedFile.isEmpty();
 }
 
-QRect MainWindow::getSelectedRegOnImg()
-{
-    QPoint toolBarPoint(0, 44);
-    //do mapping of points
-    QPoint a = (origin - ui->imageArea->pos()-toolBarPoint)/scaleFactor;
-    QPoint b = (end - ui->imageArea->pos()-toolBarPoint)/scaleFactor;
-
-    QPoint topLeft(std::min(a.x(), b.x()) , std::min(a.y(), b.y()));
-    QPoint bottomRight(std::max(a.x(), b.x()) , std::max(a.y(), b.y()));
-
-    QRect rect(topLeft, bottomRight);
-    return rect;
+bool MainWindow::canScale(double factor){
+    //the scroll bar ranges are ints
+    QSize size = ui->imageArea->scaledSize();
+    return std::max(size.width(), size.height()) * factor < MAX_VIEW_EXTENT;
 }
 
 void MainWindow::zoomToRegion(QRect rec,bool undoing)
 {
-    enterFunction();
-    //scale to required region
-    double s;
-    if(rec.width() > rec.height()){
-        s = 1.0*ui->imageArea->width()/this->width();           // scale first the QLabel:imageArea to fit the window
-        s*= 1.0*rec.width()/ui->imageArea->pixmap()->width();   //then scale the specified region
-    }else {
-        s = 1.0*ui->imageArea->height()/(this->height()-10);
-        s*= 1.0*rec.height()/ui->imageArea->pixmap()->height();
-    }
+    TraceSpan span("MainWindow::zoomToRegion", ui->imageArea->imageSize());
+    if(rec.isEmpty())
+        return;
     if(!undoing){   //if doing the actual zooming , not undo/redo
-        //check scale boundriesint width = ui->imageArea->width();
-        int width = ui->imageArea->width();
-        int height = ui->imageArea->height();
-
-        if(width*height/(s*s) < MAX_IMG_AREA)     // can zoom to selected region
-                scaleImage(1/s);
+        //scale so the region fills the view
+        QSize area = ui->imageArea->viewport()->size();
+        double s = std::min(1.0*area.width()/rec.width(), 1.0*area.height()/rec.height()) / scaleFactor;
+        QSize size = ui->imageArea->scaledSize();
+        if(canScale(s))     // can zoom to selected region
+                scaleImage(s);
         else                      // can't, so zoom as much as you can
-            scaleImage(sqrt(MAX_IMG_AREA/(width*height)));
+            scaleImage(1.0*MAX_VIEW_EXTENT/std::max(size.width(), size.height()));
 
         //take a shot for undo/redo with true value as we need the rubberband rectangle
-        snapshot();
         //setting the rectangle of the snapshot to be the current selected rectangle
-        stack1.top().rectangle=rec;
-        stack1.top().need_rectangle=true;
+        UndoHistory::Entry shot;
+        shot.rectangle=rec;
+        shot.need_rectangle=true;
+        snapshot(shot);
     }
     //scroll to required region
-    centeredRect(&rec);
-         // scroll to topleft point of QLabel:imageArea
-    scrollArea->horizontalScrollBar()->setValue(scrollArea->horizontalScrollBar()->minimum());
-    scrollArea->verticalScrollBar()->setValue(scrollArea->verticalScrollBar()->minimum());
-        // scroll to make required place centred on small dimension
-    scrollArea->horizontalScrollBar()->setValue(rec.x()*scaleFactor);
-    scrollArea->verticalScrollBar()->setValue(rec.y()*scaleFactor);
-    exitFunction();
-}
-
-void MainWindow::centeredRect(QRect *rec)
-{
-    if(rec->width() < rec->height()){
-        double a = 1.0*(this->width()-rec->width()*scaleFactor)/2.0;
-        rec->setX(rec->x()-a/scaleFactor);
-        rec->setX(rec->x()>0?rec->x():0);      // to be non-negative
-    }else{
-        double a = 1.0*(this->height()-rec->height()*scaleFactor)/2.0;
-        rec->setY(rec->y()-a/scaleFactor);
-        rec->setY(rec->y()>0?rec->y():0);      // to be non-negative
-    }
-}
-
-void MainWindow::mousePressEvent(QMouseEvent *e)
-{
-    if(ui->imageArea->underMouse()){
-        origin = e->pos();
-        rubberBand->setGeometry(QRect(origin, QSize()));
-    }
-}
-
-
-QPoint MainWindow::getInscribedPoint(QPoint current_point){
-    int x1 = ui->imageArea->pos().x();
-    int y1 = ui->imageArea->pos().y()+44;
-
-    int x2 = x1 + ui->imageArea->width();
-    int y2 = y1 + ui->imageArea->height();
-
-    int x,y;
-
-    if(current_point.x() < x1)
-        x = x1;
-    else if (current_point.x() > x2)
-        x = x2;
-    else
-        x = current_point.x();
-
-    if(current_point.y() < y1)
-        y = y1;
-    else if (current_point.y() > y2)
-        y = y2;
-    else
-        y = current_point.y();
-
-    return QPoint(x, y);
-}
-
-void MainWindow::mouseMoveEvent(QMouseEvent *e)
-{
-    QPoint point = getInscribedPoint(e->pos());
-
-    rubberBand->setGeometry(QRect(origin, point).normalized());
-    end = point;
-}
-
-void MainWindow::mouseDoubleClickEvent(QMouseEvent *)
-{
-    if(rubberBand->isVisible())
-        rubberBand->hide();
-    else if(isImageLoaded())
-        rubberBand->show();
-}
-
-void MainWindow::wheelEvent(QWheelEvent *)
-{
-    rubberBand->hide();
+    ui->imageArea->centerOn(rec);
 }
 
 bool MainWindow::readDimentions(int *width, int *height, int *unit_type, bool *isProp)
@@ -553,10 +1055,10 @@ bool MainWindow::readDimentions(int *width, int *height, int *unit_type, bool *i
     comboBox->addItems(QStringList() << "pixels" << "percentage");
 
     QLabel *label_width = new QLabel("Width: ");
-    QLineEdit *edit_width = new QLineEdit(QString::number(ui->imageArea->pixmap()->width()));
+    QLineEdit *edit_width = new QLineEdit(QString::number(ui->imageArea->imageSize().width()));
 
     QLabel *label_height = new QLabel("Height: ");
-    QLineEdit *edit_height = new QLineEdit(QString::number(ui->imageArea->pixmap()->height()));
+    QLineEdit *edit_height = new QLineEdit(QString::number(ui->imageArea->imageSize().height()));
 
 
     QCheckBox *check_box = new QCheckBox("Scale proportionally");
@@ -599,6 +1101,58 @@ bool MainWindow::readDimentions(int *width, int *height, int *unit_type, bool *i
     return false;
 }
 
+bool MainWindow::readSaveOptions(const QString &format, ImageSaver::Options *options)
+{
+    QSettings settings("ImageViewer", "ImageViewer");
+    bool jpeg = format == "jpg" || format == "jpeg";
+    if(!jpeg && format != "png")
+        return true;
+
+    QDialog *d = new QDialog();
+    QVBoxLayout *vbox = new QVBoxLayout();
+
+    QLabel *label_level = new QLabel(jpeg ? "Quality (0-100): " : "Compression level (0-9): ");
+    QSpinBox *spin_level = new QSpinBox();
+    if(jpeg){
+        spin_level->setRange(0, 100);
+        spin_level->setValue(settings.value("jpegQuality", 90).toInt());
+    }else{
+        spin_level->setRange(0, 9);
+        spin_level->setValue(settings.value("pngCompression", 6).toInt());
+    }
+
+    QCheckBox *check_box = new QCheckBox("Progressive");
+    check_box->setChecked(settings.value("progressiveJpeg", false).toBool());
+    check_box->setVisible(jpeg);
+
+    QDialogButtonBox *buttonBox = new QDialogButtonBox(QDialogButtonBox::Ok
+                                                        | QDialogButtonBox::Cancel);
+    vbox->addWidget(label_level);
+    vbox->addWidget(spin_level);
+    vbox->addWidget(check_box);
+    vbox->addWidget(buttonBox);
+
+    d->setLayout(vbox);
+
+    connect(buttonBox, SIGNAL(accepted()), d, SLOT(accept()));
+    connect(buttonBox, SIGNAL(rejected()), d, SLOT(reject()));
+
+    bool accepted = d->exec() == QDialog::Accepted;
+    if(accepted){
+        if(jpeg){
+            options->quality = spin_level->value();
+            options->progressive = check_box->isChecked();
+            settings.setValue("jpegQuality", options->quality);
+            settings.setValue("progressiveJpeg", options->progressive);
+        }else{
+            options->compression = spin_level->value();
+            settings.setValue("pngCompression", options->compression);
+        }
+    }
+    delete d;
+    return accepted;
+}
+
 void MainWindow::on_actionAdjust_size_triggered()
 {
     if(!isImageLoaded()){
@@ -607,7 +1161,8 @@ void MainWindow::on_actionAdjust_size_triggered()
         msg.exec();
         return;
     }
-    rubberBand->hide();
+    settleFrame();
+    ui->imageArea->hideSelection();
 
     int width, height, unit_type;
     bool isProp;
@@ -624,26 +1179,38 @@ void MainWindow::on_actionAdjust_size_triggered()
     }
 
     if(unit_type == 1){     //percentage
-        width = ui->imageArea->pixmap()->width() * width / 100;
-        height = ui->imageArea->pixmap()->height() * height / 100;
+        width = ui->imageArea->imageSize().width() * width / 100;
+        height = ui->imageArea->imageSize().height() * height / 100;
     }
 
-    QPixmap pix = ui->imageArea->pixmap()->scaled(width, height, isProp? Qt::KeepAspectRatio : Qt::IgnoreAspectRatio);
-    ui->imageArea->setPixmap(pix);
+    TraceSpan span("MainWindow::adjustSize", ui->imageArea->imageSize());
+    UndoHistory::Entry shot;
+    shot.kind = UndoHistory::Resize;
+    shot.size = ui->imageArea->imageSize().scaled(width, height, isProp? Qt::KeepAspectRatio : Qt::IgnoreAspectRatio);
+    snapshot(shot);
+    ui->imageArea->setPipeline(history.image());
     scaleImage(1);
 }
 
-void MainWindow::enterFunction(){
-//    this->setWindowTitle(tr("loading"));
-    QApplication::processEvents();
-    QApplication::setOverrideCursor(Qt::WaitCursor);
-    QApplication::processEvents();
-//    this->setCursor(Qt::BusyCursor);
+void MainWindow::recordTrace(bool on){
+    if(on)
+        Trace::clear();
+    Trace::setEnabled(on);
+}
+
+void MainWindow::saveTrace(){
+    QString path = QFileDialog::getSaveFileName(this,tr("Save Trace"),"trace.json",tr("Chrome trace (*.json)"));
+    if(path.isEmpty())
+        return;
+    if(!Trace::writeJson(path)){
+        QMessageBox msg;
+        msg.setText("Failed to save the trace");
+        msg.exec();
+    }
 }
 
-void MainWindow::exitFunction(){
-//    this->setWindowTitle(tr("Image Viewer"));
-    QApplication::setOverrideCursor(Qt::ArrowCursor);
-    QApplication::processEvents();
-//    this->setCursor(Qt::ArrowCursor);
+void MainWindow::tooLarge(){
+    QMessageBox msg;
+    msg.setText("The image is too large to be processed in memory!");
+    msg.exec();
 }
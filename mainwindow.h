@@ -2,12 +2,28 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
-#include <QScrollArea>
 #include <QLabel>
 #include <QCloseEvent>
-#include <QRubberBand>
 #include <QLineEdit>
 #include <QStack>
+#include <QImage>
+#include <QProgressBar>
+#include <QPushButton>
+#include <QDockWidget>
+#include <QSlider>
+#include <QElapsedTimer>
+
+#include "imageloader.h"
+#include "undohistory.h"
+#include "imagesaver.h"
+#include "decodecache.h"
+#include "thumbnailstrip.h"
+#include "filterdialog.h"
+#include "statisticspanel.h"
+#include "frameplayer.h"
+#include "memorygovernor.h"
+#include "metadataindex.h"
+#include "duplicatesdialog.h"
 
 namespace Ui {
 class MainWindow;
@@ -21,66 +37,127 @@ public:
     explicit MainWindow(QWidget *parent = 0);
     ~MainWindow();
 
+    //traces the time from the launch to the first paint of an image
+    void measureFirstPixel(const QElapsedTimer &launch);
+
 protected:
     void closeEvent(QCloseEvent *);
 private:
-    QPixmap * orgImage;
     Ui::MainWindow *ui;
-    QLabel * imageArea;
-    QScrollArea * scrollArea;
+    ImageLoader * loader;
+    ImageSaver * saver;
+    DecodeCache * decodeCache;
+    ThumbnailStrip * thumbnailStrip;
+    QProgressBar * saveProgress;
+    MemoryGovernor * governor;
+    QProgressBar * memoryGauge;
+    QPushButton * cancelSave;
+    FilterDialog * filterDialog;
+    ImageFilter * imageFilter;
+    QProgressBar * filterProgress;
+    QPushButton * cancelFilter;
+    EditPipeline filtering;
+    StatisticsPanel * statisticsPanel;
+    QDockWidget * statisticsDock;
+    FramePlayer * player;
+    QLabel * frameLabel;
+    QSlider * frameSlider;
+    void updateFrameControls();
+    //the canvas draws a played frame that isn't the image of the history yet
+    bool framePending = false;
+    void settleFrame();
+    QImage filterProxy;
+    double filterScale = 1;
     bool loadFile(const QString &);
+    void listFolder(const QString &fileName);
+    void showFolder(const QString &fileName);
+    QElapsedTimer launched;
+    QString deferredFolder;
+    MetadataIndex * metadata;
+    DuplicatesDialog * duplicatesDialog = 0;
+    MetadataIndex::SortKey folderSort = MetadataIndex::ByName;
+    void sortFolder();
+    void startupDone();
+    void prefetchNeighbours(const QString &fileName);
+    void openFolderFile(int index);
+    QString folderPath;
+    QStringList folderFiles;
+    int folderIndex = -1;
+    int direction = 1;
+    int prefetchCount = 3;
+    QString awaitedFile;
     double scaleFactor;
-    double rotation = 0.0;
-    void adjustScrollBar(QScrollBar *scrollBar, double factor);
     void initArea(void);
     bool isNeedSave(void);
     bool isImageLoaded(void);
-    QPoint origin, end;
-    QRubberBand *rubberBand;
-    QRect getSelectedRegOnImg();
+    bool canScale(double factor);
     void zoomToRegion(QRect rec,bool undoing);
-    void centeredRect(QRect *rec);
     void snapshot();
+    void snapshot(UndoHistory::Entry shot);
+    void restoreState();
     bool readDimentions(int *, int *, int *, bool *);
-    struct screenshot{
-        QPixmap pix;
-        QRect rectangle;
-        bool need_rectangle;
-        double scale;
-    };
-    QStack<screenshot> stack1,stack2;
+    bool readSaveOptions(const QString &format, ImageSaver::Options *options);
+    void waitForSave();
+    UndoHistory history;
     const int MAX_IMG_AREA = 100000000;
+    const int MAX_VIEW_EXTENT = QWIDGETSIZE_MAX;
     const int MIN_IMG_AREA = 10;
     const double ZOOM_FACTOR = 1.25;
     bool isSaved = false;
-    QPoint getInscribedPoint(QPoint );
-
-    void enterFunction();
-    void exitFunction();
+    int changeCount = 0;
+    int savingChange = -1;
+    bool previewShown = false;
+    void tooLarge();
 public slots:
     void open(void);
+    void openFiles(const QStringList &files);
+    void findDuplicates(void);
+    void openDuplicate(const QString &fileName);
     void save(void);
     void zoomIn(void);
     void zoomOut(void);
     void scaleImage(double scale);
+    void zoomAt(double factor, const QPoint &anchor);
     void fitToWindow(void);
     void normalSize(void);
     void connectActions(void);
     void crop(void);
     void rotate(void);
+    void filter(void);
     void closeFile(void);
     void reset(void);
     void undo(void);
     void redo(void);
+    void nextImage(void);
+    void previousImage(void);
+    void togglePlayback(void);
+    void nextFrame(void);
+    void previousFrame(void);
     void exit(void);
     bool checkSave(void);
-protected:
-    void mousePressEvent(QMouseEvent *e);
-    void mouseMoveEvent(QMouseEvent *e);
-    void mouseDoubleClickEvent(QMouseEvent *);
-    void wheelEvent(QWheelEvent *);
+    void recordTrace(bool on);
+    void saveTrace(void);
 private slots:
     void on_actionAdjust_size_triggered();
+    void showPreview(const QString &, const QImage &, const QSize &);
+    void imageLoaded(const QString &, const QSharedPointer<TiledImage> &);
+    void loadFailed(const QString &, const QString &error);
+    void prefetched(const QString &, const QSharedPointer<TiledImage> &);
+    void openThumbnail(const QString &);
+    void previewFilter();
+    void playbackChanged(bool playing);
+    void filterFinished(const QSharedPointer<TiledImage> &image);
+    void filterCanceled();
+    void updateStatistics();
+    void showFrame(int, const QImage &, const QRect &changed);
+    void firstPixel();
+    void setFolderSort(QAction *action);
+    void folderIndexed();
+    void indexProgress(int done, int total);
+    void saveFinished(const QString &);
+    void saveFailed(const QString &, const QString &);
+    void saveCanceled(const QString &);
+    void showMemory(qint64 used, qint64 budget);
 };
 
 #endif // MAINWINDOW_H
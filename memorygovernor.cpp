@@ -0,0 +1,69 @@
+#include "memorygovernor.h"
+#include "tiledimage.h"
+#include "imagepyramid.h"
+#include "trace.h"
+
+#include <algorithm>
+
+namespace {
+//eviction starts above the high mark and goes down to the low one, so it doesn't run on every allocation
+const double HIGH_WATER = 0.9;
+const double LOW_WATER = 0.75;
+//how often usage is looked at, allocations happen on many threads
+const int CHECK_INTERVAL_MS = 500;
+}
+
+MemoryGovernor::MemoryGovernor(QObject *parent) :
+    QObject(parent)
+{
+    connect(&timer, SIGNAL(timeout()), this, SLOT(check()));
+    timer.start(CHECK_INTERVAL_MS);
+}
+
+void MemoryGovernor::setBudget(qint64 bytes){
+    limit = qMax<qint64>(1, bytes);
+    reported = -1;
+    check();
+}
+
+qint64 MemoryGovernor::budget() const{
+    return limit;
+}
+
+qint64 MemoryGovernor::used() const{
+    return TiledImage::pixelBytes() + TiledImage::cacheBytes() + ImagePyramid::cacheBytes();
+}
+
+void MemoryGovernor::addRelease(Priority priority, const Release &release){
+    Holder holder;
+    holder.priority = priority;
+    holder.release = release;
+    holders.append(holder);
+    std::stable_sort(holders.begin(), holders.end(), [](const Holder &a, const Holder &b){
+        return a.priority < b.priority;
+    });
+}
+
+void MemoryGovernor::check(){
+    qint64 bytes = used();
+    if(bytes > limit * HIGH_WATER){
+        TraceSpan span("MemoryGovernor::evict");
+        qint64 target = qint64(limit * LOW_WATER);
+        qint64 released = 0;
+        for(int i = 0; i < holders.size() && bytes > target; i++){
+            qint64 pending = 0;
+            released += holders.at(i).release(bytes - target, &pending);
+            //what a holder lets go of may still be shared elsewhere, the counters tell what was freed
+            bytes = used();
+            //the next check sees what the holder freed meanwhile before asking the ones after it
+            if(pending > 0)
+                break;
+        }
+        span.addBytes(released);
+    }
+    //the indicator only moves by whole megabytes
+    if(bytes / (1024 * 1024) != reported / (1024 * 1024)){
+        reported = bytes;
+        emit usageChanged(bytes, limit);
+    }
+}
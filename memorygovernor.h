@@ -0,0 +1,54 @@
+#ifndef MEMORYGOVERNOR_H
+#define MEMORYGOVERNOR_H
+
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+
+#include <functional>
+
+// one budget for all the pixels the viewer holds: decoded images and their
+// reduced levels, the tile cache of on-disk images and the resampled tiles
+// of the pyramids. the buffers are counted where they are allocated, the
+// governor only adds them up. close to the budget it asks the registered
+// holders to give memory back, the cheapest to rebuild first, until usage
+// is well below the budget again.
+class MemoryGovernor : public QObject
+{
+    Q_OBJECT
+
+public:
+    //in eviction order
+    enum Priority { Caches, Undo, Pyramids };
+    //frees about the given number of bytes, returns how many it freed. bytes still being
+    //freed in the background go to pending, lower priorities wait for them
+    typedef std::function<qint64(qint64 bytes, qint64 *pending)> Release;
+
+    explicit MemoryGovernor(QObject *parent = 0);
+
+    void setBudget(qint64 bytes);
+    qint64 budget() const;
+    qint64 used() const;
+
+    void addRelease(Priority priority, const Release &release);
+
+public slots:
+    void check();
+
+signals:
+    void usageChanged(qint64 used, qint64 budget);
+
+private:
+    struct Holder
+    {
+        Priority priority;
+        Release release;
+    };
+
+    QVector<Holder> holders;
+    qint64 limit = 2048LL * 1024 * 1024;
+    qint64 reported = -1;
+    QTimer timer;
+};
+
+#endif // MEMORYGOVERNOR_H
@@ -0,0 +1,382 @@
+#include "metadataindex.h"
+#include "trace.h"
+
+#include <QRunnable>
+#include <QThread>
+#include <QFileInfo>
+#include <QDir>
+#include <QDataStream>
+#include <QImageReader>
+#include <QStandardPaths>
+#include <QStorageInfo>
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+const quint32 MAGIC = 0x4d657432;    //"Met2"
+//files a reader job takes at once, results are delivered per job
+const int CHUNK = 64;
+//a jpeg's exif segment is at most 64 KB and comes right after the start of the file
+const int EXIF_READ = 66 * 1024;
+
+//tags of the first image file directory of tiff, which exif is
+class Tiff
+{
+public:
+    Tiff(const uchar *p, qint64 n) : p(p), n(n), little(n >= 2 && p[0] == 'I' && p[1] == 'I') {}
+
+    qint64 u16(qint64 o) const{
+        if(o < 0 || o + 2 > n)
+            return -1;
+        return little ? p[o] | p[o + 1] << 8 : p[o] << 8 | p[o + 1];
+    }
+
+    qint64 u32(qint64 o) const{
+        if(o < 0 || o + 4 > n)
+            return -1;
+        return little ? quint32(p[o] | p[o + 1] << 8 | p[o + 2] << 16) | quint32(p[o + 3]) << 24
+                      : quint32(p[o + 1] << 16 | p[o + 2] << 8 | p[o + 3]) | quint32(p[o]) << 24;
+    }
+
+    //offset of the directory entry with the tag, -1 when there is none
+    qint64 find(qint64 ifd, int tag) const{
+        qint64 count = u16(ifd);
+        for(qint64 i = 0; i < count; i++){
+            qint64 e = ifd + 2 + 12 * i;
+            if(e + 12 > n)
+                break;
+            if(u16(e) == tag)
+                return e;
+        }
+        return -1;
+    }
+
+    QByteArray ascii(qint64 e) const{
+        qint64 count = u32(e + 4);
+        //values of up to four bytes are stored in the entry itself
+        qint64 o = count <= 4 ? e + 8 : u32(e + 8);
+        if(count < 0 || o < 0 || o + count > n)
+            return QByteArray();
+        const char *s = reinterpret_cast<const char *>(p + o);
+        return QByteArray(s, int(qstrnlen(s, uint(count))));
+    }
+
+private:
+    const uchar *p;
+    qint64 n;
+    bool little;
+};
+
+//DateTimeOriginal of the exif segment of a jpeg, or DateTime when it has none
+QDateTime exifDate(const QByteArray &jpeg){
+    const uchar *p = reinterpret_cast<const uchar *>(jpeg.constData());
+    int n = jpeg.size();
+    if(n < 4 || p[0] != 0xFF || p[1] != 0xD8)
+        return QDateTime();
+    int pos = 2;
+    while(pos + 4 <= n && p[pos] == 0xFF){
+        int marker = p[pos + 1];
+        int length = p[pos + 2] << 8 | p[pos + 3];
+        //the compressed data starts, the metadata comes before it
+        if(marker == 0xDA)
+            break;
+        if(marker == 0xE1 && length >= 16 && pos + 2 + length <= n && memcmp(p + pos + 4, "Exif\0\0", 6) == 0){
+            Tiff tiff(p + pos + 10, length - 8);
+            qint64 ifd0 = tiff.u32(4);
+            QByteArray text;
+            qint64 exif = tiff.find(ifd0, 0x8769);
+            if(exif >= 0){
+                qint64 original = tiff.find(tiff.u32(exif + 8), 0x9003);
+                if(original >= 0)
+                    text = tiff.ascii(original);
+            }
+            if(text.isEmpty()){
+                qint64 changed = tiff.find(ifd0, 0x0132);
+                if(changed >= 0)
+                    text = tiff.ascii(changed);
+            }
+            return QDateTime::fromString(QString::fromLatin1(text), "yyyy:MM:dd HH:mm:ss");
+        }
+        pos += 2 + length;
+    }
+    return QDateTime();
+}
+
+void writeRecord(QDataStream &stream, const QString &fileName, const MetadataIndex::Record &record){
+    stream << MAGIC << fileName << record.modified << record.fileSize << record.size << record.format
+           << qint32(record.transformation) << record.captured << record.hashed << record.hash.phash << record.hash.dhash;
+}
+
+//reads the header of every file, results go back to the index in one piece
+class ReadJob : public QRunnable
+{
+public:
+    ReadJob(MetadataIndex *index, int scan, const QStringList &fileNames, bool hashes) :
+        index(index), scan(scan), fileNames(fileNames), hashes(hashes)
+    {
+    }
+
+    void run(){
+        MetadataIndex::Records found;
+        foreach(const QString &fileName, fileNames){
+            if(!index->isCurrent(scan))
+                return;
+            //unreadable files are kept too, they aren't tried again until they change
+            found.insert(fileName, MetadataIndex::read(fileName, hashes));
+        }
+        QMetaObject::invokeMethod(index, "store", Qt::QueuedConnection,
+                                  Q_ARG(int, scan), Q_ARG(MetadataIndex::Records, found));
+    }
+
+private:
+    MetadataIndex *index;
+    int scan;
+    QStringList fileNames;
+    bool hashes;
+};
+
+//finds the files that changed since they were indexed and hands them to the readers
+class PlanJob : public QRunnable
+{
+public:
+    PlanJob(MetadataIndex *index, int scan, const QStringList &fileNames, const MetadataIndex::Records &known,
+            bool hashes, QThreadPool *readers) :
+        index(index), scan(scan), fileNames(fileNames), known(known), hashes(hashes), readers(readers)
+    {
+    }
+
+    void run(){
+        TraceSpan span("MetadataIndex::plan");
+        QStringList changed;
+        foreach(const QString &fileName, fileNames){
+            if(!index->isCurrent(scan))
+                return;
+            QFileInfo info(fileName);
+            MetadataIndex::Records::const_iterator it = known.constFind(fileName);
+            if(it == known.constEnd() || it.value().modified != info.lastModified().toMSecsSinceEpoch()
+                    || it.value().fileSize != info.size() || (hashes && !it.value().hashed))
+                changed << fileName;
+        }
+        //announced before any result, they are queued after it
+        QMetaObject::invokeMethod(index, "planned", Qt::QueuedConnection, Q_ARG(int, scan), Q_ARG(int, changed.size()));
+        for(int i = 0; i < changed.size(); i += CHUNK)
+            readers->start(new ReadJob(index, scan, changed.mid(i, CHUNK), hashes));
+    }
+
+private:
+    MetadataIndex *index;
+    int scan;
+    QStringList fileNames;
+    MetadataIndex::Records known;
+    bool hashes;
+    QThreadPool *readers;
+};
+
+}
+
+bool MetadataIndex::Record::isValid() const{
+    return size.isValid();
+}
+
+QSize MetadataIndex::Record::orientedSize() const{
+    return transformation & QImageIOHandler::TransformationRotate90 ? size.transposed() : size;
+}
+
+MetadataIndex::MetadataIndex(const QString &directory, QObject *parent) :
+    QObject(parent)
+{
+    qRegisterMetaType<MetadataIndex::Records>("MetadataIndex::Records");
+
+    QString dir = directory;
+    if(dir.isEmpty())
+        dir = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/ImageViewer";
+    QDir().mkpath(dir);
+    file.setFileName(dir + "/metadata.index");
+    if(file.open(QIODevice::ReadWrite))
+        readRecords();
+
+    //the file system is stat'ed by one thread, the readers are sized per scan
+    planner.setMaxThreadCount(1);
+}
+
+MetadataIndex::~MetadataIndex()
+{
+    cancel();
+    planner.waitForDone();
+    readers.waitForDone();
+}
+
+void MetadataIndex::readRecords(){
+    TraceSpan span("MetadataIndex::readRecords");
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    int read = 0;
+    qint64 end = 0;
+    while(!stream.atEnd()){
+        quint32 magic;
+        QString fileName;
+        Record record;
+        qint32 transformation;
+        stream >> magic >> fileName >> record.modified >> record.fileSize >> record.size >> record.format
+               >> transformation >> record.captured >> record.hashed >> record.hash.phash >> record.hash.dhash;
+        if(magic != MAGIC || stream.status() != QDataStream::Ok)
+            break;
+        record.transformation = transformation;
+        records.insert(fileName, record);
+        read++;
+        end = file.pos();
+    }
+    span.addBytes(end);
+    //newer versions of a file are appended, the file is rewritten once most records are stale.
+    //a record cut short by a crash is dropped
+    if(read - records.size() > qMax(1000, records.size())){
+        file.resize(0);
+        append(records);
+    }else if(end < file.size()){
+        file.resize(end);
+    }
+}
+
+void MetadataIndex::append(const Records &found){
+    file.seek(file.size());
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    for(Records::const_iterator it = found.constBegin(); it != found.constEnd(); ++it)
+        writeRecord(stream, it.key(), it.value());
+    file.flush();
+}
+
+void MetadataIndex::scan(const QStringList &fileNames, bool hashes){
+    cancel();
+    scanning = true;
+    total = -1;
+    stored = 0;
+    if(fileNames.isEmpty()){
+        done();
+        return;
+    }
+    readers.setMaxThreadCount(threads > 0 ? threads : ioThreads(QFileInfo(fileNames.first()).absolutePath()));
+    planner.start(new PlanJob(this, generation.loadAcquire(), fileNames, records, hashes, &readers));
+}
+
+void MetadataIndex::cancel(){
+    generation.fetchAndAddOrdered(1);
+    planner.clear();
+    readers.clear();
+    scanning = false;
+}
+
+bool MetadataIndex::isScanning() const{
+    return scanning;
+}
+
+bool MetadataIndex::isCurrent(int scan) const{
+    return scan == generation.loadAcquire();
+}
+
+MetadataIndex::Record MetadataIndex::record(const QString &fileName) const{
+    return records.value(fileName);
+}
+
+int MetadataIndex::count() const{
+    return records.size();
+}
+
+void MetadataIndex::setThreadCount(int threads){
+    this->threads = threads;
+}
+
+QStringList MetadataIndex::sorted(const QStringList &fileNames, SortKey key) const{
+    if(key == ByName)
+        return fileNames;
+    //the values are looked up once, not on every comparison
+    QVector<QPair<qint64, int> > order;
+    QStringList unknown;
+    for(int i = 0; i < fileNames.size(); i++){
+        Record r = records.value(fileNames.at(i));
+        if(!r.isValid()){
+            unknown << fileNames.at(i);
+        }else if(key == ByDate){
+            //files without a capture date go by when they were last written
+            order.append(qMakePair(r.captured.isValid() ? r.captured.toMSecsSinceEpoch() : r.modified, i));
+        }else{
+            order.append(qMakePair(qint64(r.size.width()) * r.size.height(), i));
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [](const QPair<qint64, int> &a, const QPair<qint64, int> &b){
+        return a.first < b.first;
+    });
+    QStringList result;
+    for(int i = 0; i < order.size(); i++)
+        result << fileNames.at(order.at(i).second);
+    return result + unknown;
+}
+
+MetadataIndex::Record MetadataIndex::read(const QString &fileName, bool hashes){
+    Record record;
+    QFileInfo info(fileName);
+    record.modified = info.lastModified().toMSecsSinceEpoch();
+    record.fileSize = info.size();
+    QFile image(fileName);
+    if(!image.open(QIODevice::ReadOnly))
+        return record;
+    //headers only, nothing is decoded
+    QImageReader reader(&image);
+    record.format = reader.format();
+    record.size = reader.size();
+    record.transformation = int(reader.transformation());
+    //qt reads the exif orientation but doesn't hand out the capture date
+    if(record.format == "jpeg" || record.format == "jpg"){
+        image.seek(0);
+        record.captured = exifDate(image.read(EXIF_READ));
+    }
+    if(hashes && record.isValid())
+        record.hashed = ImageHash::fromFile(fileName, &record.hash);
+    return record;
+}
+
+int MetadataIndex::ioThreads(const QString &path){
+    bool rotational = false;
+#ifdef Q_OS_LINUX
+    //sysfs tells whether the disk spins, a partition has the flag of the disk it is on
+    QString device = QFileInfo(QString::fromLocal8Bit(QStorageInfo(path).device())).canonicalFilePath();
+    QString block = "/sys/class/block/" + QFileInfo(device).fileName();
+    QFile flag(block + "/queue/rotational");
+    if(!flag.exists())
+        flag.setFileName(block + "/../queue/rotational");
+    if(flag.open(QIODevice::ReadOnly))
+        rotational = flag.readAll().trimmed() == "1";
+#endif
+    //a spinning disk seeks between files, two requests in flight let it order them;
+    //flash serves many at once and the headers are small
+    return rotational ? 2 : qBound(4, 2 * QThread::idealThreadCount(), 16);
+}
+
+void MetadataIndex::planned(int scan, int total){
+    if(!isCurrent(scan))
+        return;
+    this->total = total;
+    emit progress(stored, total);
+    if(stored >= total)
+        done();
+}
+
+void MetadataIndex::store(int scan, const MetadataIndex::Records &found){
+    if(!isCurrent(scan))
+        return;
+    TraceSpan span("MetadataIndex::store");
+    for(Records::const_iterator it = found.constBegin(); it != found.constEnd(); ++it)
+        records.insert(it.key(), it.value());
+    append(found);
+    stored += found.size();
+    emit progress(stored, total);
+    if(total >= 0 && stored >= total)
+        done();
+}
+
+void MetadataIndex::done(){
+    scanning = false;
+    emit finished();
+}
@@ -0,0 +1,99 @@
+#ifndef METADATAINDEX_H
+#define METADATAINDEX_H
+
+#include <QObject>
+#include <QHash>
+#include <QFile>
+#include <QSize>
+#include <QDateTime>
+#include <QStringList>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QMetaType>
+
+#include "imagehash.h"
+
+// dimensions, format, exif orientation and capture date of the images of
+// a folder, read from the file headers only, and on request perceptual
+// hashes from a reduced decode. a scan stats the files on a
+// background thread and hands those that are new or changed since the last
+// scan (path, mtime and size) to a pool of header readers sized for the
+// disk they are on. results are appended to an index file kept across
+// runs, so a folder seen before costs one stat per file.
+class MetadataIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Record
+    {
+        //as stored, before the exif orientation is applied
+        QSize size;
+        QByteArray format;
+        int transformation = 0;
+        //invalid when the file doesn't say
+        QDateTime captured;
+        qint64 modified = 0;
+        qint64 fileSize = -1;
+        //only when asked for, false also when the file couldn't be decoded
+        bool hashed = false;
+        ImageHash hash;
+
+        bool isValid() const;
+        //size as shown, after the exif orientation
+        QSize orientedSize() const;
+    };
+    typedef QHash<QString, Record> Records;
+
+    enum SortKey { ByName, ByDate, ByResolution };
+
+    //the index file lives in directory, the user cache location when empty
+    explicit MetadataIndex(const QString &directory = QString(), QObject *parent = 0);
+    ~MetadataIndex();
+
+    //replaces the previous scan; progress and finished follow
+    void scan(const QStringList &fileNames, bool hashes = false);
+    void cancel();
+    bool isScanning() const;
+    //what was indexed for the file, possibly an older version until the scan is done
+    Record record(const QString &fileName) const;
+    int count() const;
+    //files without the value go last, in the order given
+    QStringList sorted(const QStringList &fileNames, SortKey key) const;
+    //header readers, 0 picks them for the disk
+    void setThreadCount(int threads);
+
+    static Record read(const QString &fileName, bool hashes = false);
+    //header readers worth running at once on the disk holding the path
+    static int ioThreads(const QString &path);
+    //the scan in progress, for the jobs
+    bool isCurrent(int scan) const;
+
+signals:
+    void progress(int done, int total);
+    void finished();
+
+private slots:
+    void planned(int scan, int total);
+    void store(int scan, const MetadataIndex::Records &found);
+
+private:
+    void readRecords();
+    void append(const Records &found);
+    void done();
+
+    QFile file;
+    Records records;
+    QThreadPool planner;
+    QThreadPool readers;
+    QAtomicInt generation;
+    int threads = 0;
+    bool scanning = false;
+    //files to read, -1 until the changed ones are known
+    int total = -1;
+    int stored = 0;
+};
+
+Q_DECLARE_METATYPE(MetadataIndex::Records)
+
+#endif // METADATAINDEX_H
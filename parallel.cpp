@@ -0,0 +1,27 @@
+#include "parallel.h"
+
+#include <QThread>
+#include <QVector>
+#include <QFuture>
+#include <QtConcurrent/QtConcurrentRun>
+
+void parallelFor(int count, int minChunk, const std::function<void(int, int)> &work){
+    if(count <= 0)
+        return;
+    int bands = qMin(QThread::idealThreadCount(), count / qMax(1, minChunk));
+    if(bands <= 1){
+        work(0, count);
+        return;
+    }
+
+    QVector<QFuture<void> > futures;
+    for(int i = 1; i < bands; i++){
+        int begin = int(qint64(count) * i / bands);
+        int end = int(qint64(count) * (i + 1) / bands);
+        futures.append(QtConcurrent::run([work, begin, end](){ work(begin, end); }));
+    }
+    work(0, int(qint64(count) / bands));
+    //waiting runs the bands the pool hasn't started yet on this thread
+    for(int i = 0; i < futures.size(); i++)
+        futures[i].waitForFinished();
+}
@@ -0,0 +1,12 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <functional>
+
+// splits [0, count) into contiguous bands and runs work(begin, end) for each
+// of them on the global thread pool, the calling thread takes the first
+// band. bands are never smaller than minChunk, so small jobs stay on the
+// calling thread.
+void parallelFor(int count, int minChunk, const std::function<void(int, int)> &work);
+
+#endif // PARALLEL_H
@@ -0,0 +1,121 @@
+#include "renderscheduler.h"
+#include "trace.h"
+
+#include <QPainter>
+#include <QRunnable>
+
+namespace {
+
+class RefineJob : public QRunnable
+{
+public:
+    RefineJob(QObject *scheduler, const ImagePyramid &pyramid, const QTransform &transform, const QSize &size,
+              int generation, const QSharedPointer<AffineEngine::Progress> &progress) :
+        scheduler(scheduler), pyramid(pyramid), transform(transform), size(size), generation(generation), progress(progress)
+    {
+    }
+
+    void run(){
+        TraceSpan span("RenderScheduler::refine", size);
+        QImage view = pyramid.render(transform, size, progress.data());
+        QMetaObject::invokeMethod(scheduler, "refineDone", Qt::QueuedConnection,
+                                  Q_ARG(int, generation), Q_ARG(QImage, view));
+    }
+
+private:
+    QObject *scheduler;
+    ImagePyramid pyramid;
+    QTransform transform;
+    QSize size;
+    int generation;
+    QSharedPointer<AffineEngine::Progress> progress;
+};
+
+}
+
+RenderScheduler::RenderScheduler(QObject *parent) :
+    QObject(parent)
+{
+    idle.setSingleShot(true);
+    idle.setInterval(150);
+    connect(&idle, SIGNAL(timeout()), this, SLOT(refine()));
+
+    //one refinement at a time, the render itself is spread over the global pool
+    pool.setMaxThreadCount(1);
+}
+
+RenderScheduler::~RenderScheduler()
+{
+    cancel();
+    pool.waitForDone();
+}
+
+void RenderScheduler::setSource(const QSharedPointer<TiledImage> &source){
+    cancel();
+    pyramid.setSource(source);
+    generation++;
+    hasView = false;
+    pending = false;
+    refinedView = QImage();
+}
+
+void RenderScheduler::setFrameBudget(int ms){
+    frameBudget = ms;
+}
+
+void RenderScheduler::setIdleDelay(int ms){
+    idle.setInterval(ms);
+}
+
+void RenderScheduler::cancel(){
+    if(progress)
+        progress->cancel();
+    progress.clear();
+}
+
+void RenderScheduler::paint(QPainter *painter, const QTransform &transform, const QRect &exposed, const QSize &size){
+    if(!hasView || transform != this->transform || size != this->size){
+        //a new view: whatever is being refined is of no use any more
+        cancel();
+        hasView = true;
+        this->transform = transform;
+        this->size = size;
+        generation++;
+        refinedView = QImage();
+        idle.start();
+    }
+
+    if(refinedGeneration == generation && !refinedView.isNull()){
+        painter->drawImage(exposed.topLeft(), refinedView, exposed);
+        return;
+    }
+    //full quality only once the view has settled and its tiles are likely cached
+    bool settled = !idle.isActive() && !refining && !pending;
+    if(!pyramid.paint(painter, transform, exposed, -1, settled ? -1 : frameBudget)){
+        pending = true;
+        if(!idle.isActive() && !refining)
+            idle.start();
+    }
+}
+
+void RenderScheduler::refine(){
+    if(!pending || pyramid.isNull() || !hasView)
+        return;
+    pending = false;
+    refining = true;
+    progress = QSharedPointer<AffineEngine::Progress>(new AffineEngine::Progress);
+    pool.start(new RefineJob(this, pyramid, transform, size, generation, progress));
+}
+
+void RenderScheduler::refineDone(int generation, const QImage &view){
+    refining = false;
+    if(generation != this->generation || view.isNull()){
+        //obsolete, the newer view gets its own turn once it settles
+        if(pending && !idle.isActive())
+            idle.start();
+        return;
+    }
+    refinedView = view;
+    refinedGeneration = generation;
+    emit refined();
+}
@@ -0,0 +1,62 @@
+#ifndef RENDERSCHEDULER_H
+#define RENDERSCHEDULER_H
+
+#include <QObject>
+#include <QTimer>
+#include <QThreadPool>
+#include <QSharedPointer>
+
+#include "imagepyramid.h"
+
+// decides how well a view is drawn. while the view keeps changing (zoom
+// steps, wheel, panning) a frame gets a fixed time budget of resampling
+// and the rest is drawn cheaply from a level already in memory. once the
+// view has been still for a moment it is rendered at full quality on a
+// background thread and shown when done; a render that a newer view has
+// made obsolete is canceled.
+class RenderScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit RenderScheduler(QObject *parent = 0);
+    ~RenderScheduler();
+
+    void setSource(const QSharedPointer<TiledImage> &source);
+    //ms of resampling a frame may spend while the view is changing
+    void setFrameBudget(int ms);
+    //how long the view has to stay still before it is refined
+    void setIdleDelay(int ms);
+
+    //transform maps full resolution pixels to the viewport, a view of size pixels
+    void paint(QPainter *painter, const QTransform &transform, const QRect &exposed, const QSize &size);
+
+signals:
+    //the view is rendered at full quality, time to repaint it
+    void refined();
+
+private slots:
+    void refine();
+    void refineDone(int generation, const QImage &view);
+
+private:
+    void cancel();
+
+    ImagePyramid pyramid;
+    QTimer idle;
+    int frameBudget = 8;
+    //bumped on every change of the view
+    int generation = 0;
+    bool hasView = false;
+    QTransform transform;
+    QSize size;
+    //something was drawn cheaply since the last refinement
+    bool pending = false;
+    bool refining = false;
+    QSharedPointer<AffineEngine::Progress> progress;
+    QImage refinedView;
+    int refinedGeneration = -1;
+    QThreadPool pool;
+};
+
+#endif // RENDERSCHEDULER_H
@@ -0,0 +1,442 @@
+#include "resampler.h"
+#include "parallel.h"
+#include "simd.h"
+#include "trace.h"
+
+#include <QVector>
+#include <QtMath>
+
+#include <cstring>
+
+namespace {
+
+//weights are fixed point with this many fraction bits
+const int PRECISION = 14;
+//rows handed to a thread at least
+const int MIN_BAND_ROWS = 32;
+
+double filterSupport(Resampler::Filter filter){
+    switch(filter){
+    case Resampler::Bilinear: return 1.0;
+    case Resampler::Bicubic: return 2.0;
+    default: return 3.0;
+    }
+}
+
+double sinc(double x){
+    if(x == 0.0)
+        return 1.0;
+    x *= M_PI;
+    return qSin(x) / x;
+}
+
+double filterValue(Resampler::Filter filter, double x){
+    x = qAbs(x);
+    switch(filter){
+    case Resampler::Bilinear:
+        return x < 1.0 ? 1.0 - x : 0.0;
+    case Resampler::Bicubic:{
+        //keys cubic with a = -0.5
+        const double a = -0.5;
+        if(x < 1.0)
+            return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+        if(x < 2.0)
+            return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+        return 0.0;
+    }
+    default:
+        return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+    }
+}
+
+//for every output pixel the first input pixel and the weights of the next 'taps' ones
+struct Coefficients{
+    int taps;
+    QVector<int> start;
+    QVector<int> count;
+    QVector<qint16> weights;
+};
+
+Coefficients coefficients(int in, int out, Resampler::Filter filter){
+    Coefficients c;
+    double scale = 1.0 * in / out;
+    double filterScale = qMax(scale, 1.0);
+    double support = filterSupport(filter) * filterScale;
+    c.taps = int(qCeil(support)) * 2 + 1;
+    c.start.resize(out);
+    c.count.resize(out);
+    c.weights.fill(0, out * c.taps);
+
+    QVector<double> w(c.taps);
+    for(int x = 0; x < out; x++){
+        double center = (x + 0.5) * scale;
+        int xmin = qMax(0, int(center - support + 0.5));
+        int xmax = qMin(in, int(center + support + 0.5));
+        int n = qMin(xmax - xmin, c.taps);
+        double total = 0;
+        for(int i = 0; i < n; i++){
+            w[i] = filterValue(filter, (i + xmin - center + 0.5) / filterScale);
+            total += w[i];
+        }
+        c.start[x] = xmin;
+        c.count[x] = n;
+        for(int i = 0; i < n; i++)
+            c.weights[x * c.taps + i] = qint16(qRound(w[i] / total * (1 << PRECISION)));
+    }
+    return c;
+}
+
+//a gaussian around every pixel, cut off at three sigma and normalized again where the image ends
+Coefficients gaussian(int length, double sigma){
+    Coefficients c;
+    int radius = qMax(1, int(qCeil(sigma * 3)));
+    c.taps = radius * 2 + 1;
+    c.start.resize(length);
+    c.count.resize(length);
+    c.weights.fill(0, length * c.taps);
+
+    QVector<double> kernel(c.taps);
+    for(int i = 0; i < c.taps; i++)
+        kernel[i] = qExp(-(i - radius) * (i - radius) / (2 * sigma * sigma));
+    for(int x = 0; x < length; x++){
+        int xmin = qMax(0, x - radius);
+        int xmax = qMin(length, x + radius + 1);
+        double total = 0;
+        for(int i = xmin; i < xmax; i++)
+            total += kernel[i - x + radius];
+        c.start[x] = xmin;
+        c.count[x] = xmax - xmin;
+        //the rounding error goes to the center, wide kernels would darken otherwise
+        qint16 *w = c.weights.data() + x * c.taps;
+        int sum = 0;
+        for(int i = xmin; i < xmax; i++){
+            w[i - xmin] = qint16(qRound(kernel[i - x + radius] / total * (1 << PRECISION)));
+            sum += w[i - xmin];
+        }
+        w[x - xmin] += (1 << PRECISION) - sum;
+    }
+    return c;
+}
+
+inline uchar clamp8(int v){
+    return uchar(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+void horizontalScalar(const uchar *src, uchar *dst, int channels, const Coefficients &c, int width){
+    for(int x = 0; x < width; x++){
+        const qint16 *w = c.weights.constData() + x * c.taps;
+        const uchar *s = src + c.start[x] * channels;
+        for(int ch = 0; ch < channels; ch++){
+            int sum = 1 << (PRECISION - 1);
+            for(int i = 0; i < c.count[x]; i++)
+                sum += s[i * channels + ch] * w[i];
+            dst[x * channels + ch] = clamp8(sum >> PRECISION);
+        }
+    }
+}
+
+void verticalScalar(const uchar *const *rows, const qint16 *w, int n, uchar *dst, int from, int bytes){
+    for(int i = from; i < bytes; i++){
+        int sum = 1 << (PRECISION - 1);
+        for(int k = 0; k < n; k++)
+            sum += rows[k][i] * w[k];
+        dst[i] = clamp8(sum >> PRECISION);
+    }
+}
+
+#ifdef IV_SSE2
+//pixel i of the n ones an output pixel reads, 3 or 4 channels in the low bytes. the
+//fourth byte of an rgb pixel belongs to the next one and ends up in a lane that
+//isn't stored. the last rgb pixel is read byte by byte, it may end the row
+template<int CH>
+inline int loadPixel(const uchar *s, int i, int n){
+    const uchar *p = s + i * CH;
+    if(CH == 4 || i + 1 < n){
+        int v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+template<int CH>
+inline void storePixel(uchar *p, __m128i sum){
+    sum = _mm_srai_epi32(sum, PRECISION);
+    sum = _mm_packs_epi32(sum, sum);
+    sum = _mm_packus_epi16(sum, sum);
+    int v = _mm_cvtsi128_si32(sum);
+    if(CH == 4){
+        *reinterpret_cast<int *>(p) = v;
+    }else{
+        p[0] = uchar(v);
+        p[1] = uchar(v >> 8);
+        p[2] = uchar(v >> 16);
+    }
+}
+
+//the weights of taps i and i + 1 in every 32-bit lane
+inline int weightPair(const qint16 *w, int i){
+    return int((w[i] & 0xffff) | (quint32(w[i + 1]) << 16));
+}
+
+//taps from i on, two per multiply-add, added to the 32-bit channel sums
+template<int CH>
+inline __m128i addTaps(__m128i sum, const uchar *s, const qint16 *w, int i, int n){
+    const __m128i zero = _mm_setzero_si128();
+    for(; i + 1 < n; i += 2){
+        __m128i p0 = _mm_cvtsi32_si128(loadPixel<CH>(s, i, n));
+        __m128i p1 = _mm_cvtsi32_si128(loadPixel<CH>(s, i + 1, n));
+        //p0c0 p1c0 p0c1 p1c1 ... as 16-bit
+        __m128i pix = _mm_unpacklo_epi8(_mm_unpacklo_epi8(p0, p1), zero);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(pix, _mm_set1_epi32(weightPair(w, i))));
+    }
+    if(i < n){
+        __m128i p0 = _mm_cvtsi32_si128(loadPixel<CH>(s, i, n));
+        __m128i pix = _mm_unpacklo_epi16(_mm_unpacklo_epi8(p0, zero), zero);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(pix, _mm_set1_epi32(w[i] & 0xffff)));
+    }
+    return sum;
+}
+
+//rgb and rgba pixels, the channels of a pixel are summed side by side
+template<int CH>
+void horizontalRgbSse2(const uchar *src, uchar *dst, const Coefficients &c, int width){
+    for(int x = 0; x < width; x++){
+        const qint16 *w = c.weights.constData() + x * c.taps;
+        __m128i sum = addTaps<CH>(_mm_set1_epi32(1 << (PRECISION - 1)), src + c.start[x] * CH, w, 0, c.count[x]);
+        storePixel<CH>(dst + x * CH, sum);
+    }
+}
+
+inline int sumLanes(__m128i sum){
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+
+//gray pixels, eight taps of one output pixel per multiply-add
+void horizontalGraySse2(const uchar *src, uchar *dst, const Coefficients &c, int width){
+    const __m128i zero = _mm_setzero_si128();
+    for(int x = 0; x < width; x++){
+        const qint16 *w = c.weights.constData() + x * c.taps;
+        const uchar *s = src + c.start[x];
+        int n = c.count[x];
+        __m128i sum = _mm_setzero_si128();
+        int i = 0;
+        for(; i + 8 <= n; i += 8){
+            __m128i pix = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(s + i)), zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(pix, _mm_loadu_si128(reinterpret_cast<const __m128i *>(w + i))));
+        }
+        int total = (1 << (PRECISION - 1)) + sumLanes(sum);
+        for(; i < n; i++)
+            total += s[i] * w[i];
+        dst[x] = clamp8(total >> PRECISION);
+    }
+}
+
+//16 bytes of a row at a time, two input rows per multiply-add. channel agnostic
+int verticalSse2(const uchar *const *rows, const qint16 *w, int n, uchar *dst, int from, int bytes){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(1 << (PRECISION - 1));
+    int i = from;
+    for(; i + 16 <= bytes; i += 16){
+        __m128i s0 = half, s1 = half, s2 = half, s3 = half;
+        int k = 0;
+        for(; k + 1 < n; k += 2){
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k] + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k + 1] + i));
+            __m128i mmk = _mm_set1_epi32((w[k] & 0xffff) | (int(w[k + 1]) << 16));
+            __m128i lo = _mm_unpacklo_epi8(a, b);
+            __m128i hi = _mm_unpackhi_epi8(a, b);
+            s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), mmk));
+            s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), mmk));
+            s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), mmk));
+            s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), mmk));
+        }
+        if(k < n){
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k] + i));
+            __m128i mmk = _mm_set1_epi32(w[k] & 0xffff);
+            __m128i lo = _mm_unpacklo_epi8(a, zero);
+            __m128i hi = _mm_unpackhi_epi8(a, zero);
+            s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi16(lo, zero), mmk));
+            s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi16(lo, zero), mmk));
+            s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi16(hi, zero), mmk));
+            s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi16(hi, zero), mmk));
+        }
+        s0 = _mm_srai_epi32(s0, PRECISION);
+        s1 = _mm_srai_epi32(s1, PRECISION);
+        s2 = _mm_srai_epi32(s2, PRECISION);
+        s3 = _mm_srai_epi32(s3, PRECISION);
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(s0, s1), _mm_packs_epi32(s2, s3));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), packed);
+    }
+    return i;
+}
+#endif
+
+#ifdef IV_AVX2
+//same as verticalSse2 with 32 bytes per step. unpack and pack both work per
+//128-bit lane, so the bytes come out in order
+IV_TARGET_AVX2
+int verticalAvx2(const uchar *const *rows, const qint16 *w, int n, uchar *dst, int from, int bytes){
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i half = _mm256_set1_epi32(1 << (PRECISION - 1));
+    int i = from;
+    for(; i + 32 <= bytes; i += 32){
+        __m256i s0 = half, s1 = half, s2 = half, s3 = half;
+        int k = 0;
+        for(; k + 1 < n; k += 2){
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rows[k] + i));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rows[k + 1] + i));
+            __m256i mmk = _mm256_set1_epi32((w[k] & 0xffff) | (int(w[k + 1]) << 16));
+            __m256i lo = _mm256_unpacklo_epi8(a, b);
+            __m256i hi = _mm256_unpackhi_epi8(a, b);
+            s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), mmk));
+            s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), mmk));
+            s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), mmk));
+            s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), mmk));
+        }
+        if(k < n){
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rows[k] + i));
+            __m256i mmk = _mm256_set1_epi32(w[k] & 0xffff);
+            __m256i lo = _mm256_unpacklo_epi8(a, zero);
+            __m256i hi = _mm256_unpackhi_epi8(a, zero);
+            s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_unpacklo_epi16(lo, zero), mmk));
+            s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_unpackhi_epi16(lo, zero), mmk));
+            s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_unpacklo_epi16(hi, zero), mmk));
+            s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(_mm256_unpackhi_epi16(hi, zero), mmk));
+        }
+        s0 = _mm256_srai_epi32(s0, PRECISION);
+        s1 = _mm256_srai_epi32(s1, PRECISION);
+        s2 = _mm256_srai_epi32(s2, PRECISION);
+        s3 = _mm256_srai_epi32(s3, PRECISION);
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(s0, s1), _mm256_packs_epi32(s2, s3));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), packed);
+    }
+    return i;
+}
+#endif
+
+void horizontalPass(const uchar *src, uchar *dst, int channels, const Coefficients &c, int width){
+    //no avx2 here: an output pixel is bound by loading its taps, wider registers didn't make it faster
+#ifdef IV_SSE2
+    switch(channels){
+    case 4: horizontalRgbSse2<4>(src, dst, c, width); return;
+    case 3: horizontalRgbSse2<3>(src, dst, c, width); return;
+    case 1: horizontalGraySse2(src, dst, c, width); return;
+    }
+#endif
+    horizontalScalar(src, dst, channels, c, width);
+}
+
+void verticalPass(const uchar *const *rows, const qint16 *w, int n, uchar *dst, int bytes){
+    int done = 0;
+#ifdef IV_AVX2
+    if(cpuHasAvx2())
+        done = verticalAvx2(rows, w, n, dst, done, bytes);
+#endif
+#ifdef IV_SSE2
+    done = verticalSse2(rows, w, n, dst, done, bytes);
+#endif
+    verticalScalar(rows, w, n, dst, done, bytes);
+}
+
+//negative lobes can push a color above its alpha, which premultiplied pixels can't have
+void fixPremultiplied(QRgb *line, int width){
+    for(int x = 0; x < width; x++){
+        QRgb p = line[x];
+        int a = qAlpha(p);
+        if(qRed(p) > a || qGreen(p) > a || qBlue(p) > a)
+            line[x] = qRgba(qMin(qRed(p), a), qMin(qGreen(p), a), qMin(qBlue(p), a), a);
+    }
+}
+
+QImage prepare(const QImage &image){
+    switch(image.format()){
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGB888:
+    case QImage::Format_Grayscale8:
+        return image;
+    default:
+        //straight alpha would bleed the color of transparent pixels
+        return image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied
+                                                             : QImage::Format_RGB32);
+    }
+}
+
+//both passes, src is prepared and cx, cy have the size of the output
+QImage convolved(const QImage &src, const Coefficients &cx, const Coefficients &cy, TraceSpan *span){
+    const QSize size(cx.start.size(), cy.start.size());
+    const int channels = src.depth() / 8;
+
+    //horizontal pass over the source rows the vertical pass will read
+    int firstRow = cy.start.first();
+    int lastRow = cy.start.last() + cy.count.last();
+    QImage tmp(size.width(), lastRow - firstRow, src.format());
+    QImage out(size, src.format());
+    if(tmp.isNull() || out.isNull())
+        return QImage();
+    span->addBytes(tmp.sizeInBytes() + out.sizeInBytes());
+
+    //raw pointers, the bands must not detach the images concurrently
+    const uchar *srcBits = src.constBits();
+    const int srcStride = src.bytesPerLine();
+    uchar *tmpBits = tmp.bits();
+    const int tmpStride = tmp.bytesPerLine();
+    uchar *outBits = out.bits();
+    const int outStride = out.bytesPerLine();
+
+    parallelFor(tmp.height(), MIN_BAND_ROWS, [&](int begin, int end){
+        for(int y = begin; y < end; y++)
+            horizontalPass(srcBits + (firstRow + y) * srcStride, tmpBits + y * tmpStride, channels, cx, size.width());
+    });
+
+    const int bytes = size.width() * channels;
+    const bool premultiplied = out.format() == QImage::Format_ARGB32_Premultiplied;
+    parallelFor(size.height(), MIN_BAND_ROWS, [&](int begin, int end){
+        QVector<const uchar *> rows(cy.taps);
+        for(int y = begin; y < end; y++){
+            int n = cy.count[y];
+            for(int k = 0; k < n; k++)
+                rows[k] = tmpBits + (cy.start[y] - firstRow + k) * tmpStride;
+            uchar *line = outBits + y * outStride;
+            verticalPass(rows.constData(), cy.weights.constData() + y * cy.taps, n, line, bytes);
+            if(premultiplied)
+                fixPremultiplied(reinterpret_cast<QRgb *>(line), size.width());
+        }
+    });
+    return out;
+}
+
+}
+
+QImage Resampler::scaled(const QImage &image, const QSize &size, Filter filter){
+    if(image.isNull() || size.isEmpty())
+        return QImage();
+    TraceSpan span("Resampler::scaled", size);
+    QImage src = prepare(image);
+    if(src.size() == size)
+        return src;
+    return convolved(src, coefficients(src.width(), size.width(), filter),
+                     coefficients(src.height(), size.height(), filter), &span);
+}
+
+QImage Resampler::blurred(const QImage &image, double sigma){
+    if(image.isNull())
+        return QImage();
+    TraceSpan span("Resampler::blurred", image.size());
+    QImage src = prepare(image);
+    //less than that doesn't move a pixel value
+    if(sigma < 0.2)
+        return src;
+    return convolved(src, gaussian(src.width(), sigma), gaussian(src.height(), sigma), &span);
+}
+
+QImage Resampler::scaled(const QImage &image, const QSize &size){
+    return scaled(image, size, filterFor(1.0 * size.width() / qMax(1, image.width())));
+}
+
+Resampler::Filter Resampler::filterFor(double scale){
+    return scale > 1.0 ? Bicubic : Lanczos3;
+}
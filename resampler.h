@@ -0,0 +1,26 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <QImage>
+
+// separable image resampling with fixed-point weights. both passes are
+// vectorized with SSE2 for 4, 3 and 1 byte pixels, the vertical pass uses
+// AVX2 when the cpu has it. the rows of each pass are split across threads.
+// works directly on 8-bit RGB32/ARGB32, RGB888 and Grayscale8 images,
+// anything else is converted.
+// a gaussian blur is the same two passes at the same size.
+class Resampler
+{
+public:
+    enum Filter { Bilinear, Bicubic, Lanczos3 };
+
+    static QImage scaled(const QImage &image, const QSize &size, Filter filter);
+    static QImage scaled(const QImage &image, const QSize &size);
+    //sigma is the standard deviation of the gaussian in pixels
+    static QImage blurred(const QImage &image, double sigma);
+
+    //sharp filter when magnifying, antialiasing one when reducing
+    static Filter filterFor(double scale);
+};
+
+#endif // RESAMPLER_H
@@ -0,0 +1,28 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// which vector instruction sets the kernels can use. SSE2 is always there on
+// x86-64, AVX2 code is compiled with a target attribute and only called
+// when the cpu reports it at runtime.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IV_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(IV_SSE2) && defined(__GNUC__)
+#define IV_AVX2
+#define IV_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+
+inline bool cpuHasAvx2(){
+#ifdef IV_AVX2
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+#else
+    return false;
+#endif
+}
+
+#endif // SIMD_H
@@ -0,0 +1,79 @@
+#include "singleinstance.h"
+
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QDataStream>
+#include <QDir>
+
+namespace {
+//a viewer that doesn't answer this quickly is hung, the launch opens its own window
+const int FORWARD_TIMEOUT_MS = 500;
+}
+
+SingleInstance::SingleInstance(QObject *parent) :
+    QObject(parent)
+{
+}
+
+QString SingleInstance::serverName(){
+    //per user, several users of one machine each have their own viewer
+    return QString("ImageViewer-%1").arg(qHash(QDir::homePath()));
+}
+
+bool SingleInstance::forward(const QStringList &files){
+    QLocalSocket socket;
+    socket.connectToServer(serverName());
+    if(!socket.waitForConnected(FORWARD_TIMEOUT_MS))
+        return false;
+    QByteArray message;
+    QDataStream stream(&message, QIODevice::WriteOnly);
+    stream << files;
+    socket.write(message);
+    if(!socket.waitForBytesWritten(FORWARD_TIMEOUT_MS))
+        return false;
+    socket.disconnectFromServer();
+    if(socket.state() != QLocalSocket::UnconnectedState)
+        socket.waitForDisconnected(FORWARD_TIMEOUT_MS);
+    return true;
+}
+
+bool SingleInstance::listen(){
+    server = new QLocalServer(this);
+    server->setSocketOptions(QLocalServer::UserAccessOption);
+    if(!server->listen(serverName())){
+        //someone answers: another viewer started at the same time
+        QLocalSocket probe;
+        probe.connectToServer(serverName());
+        if(probe.waitForConnected(FORWARD_TIMEOUT_MS))
+            return false;
+        //left behind by a viewer that crashed
+        QLocalServer::removeServer(serverName());
+        if(!server->listen(serverName()))
+            return false;
+    }
+    connect(server, SIGNAL(newConnection()), this, SLOT(accept()));
+    return true;
+}
+
+void SingleInstance::accept(){
+    while(QLocalSocket *socket = server->nextPendingConnection()){
+        connect(socket, SIGNAL(disconnected()), this, SLOT(receive()));
+        //the sender may be gone already
+        if(socket->state() == QLocalSocket::UnconnectedState)
+            read(socket);
+    }
+}
+
+void SingleInstance::receive(){
+    if(QLocalSocket *socket = qobject_cast<QLocalSocket *>(sender()))
+        read(socket);
+}
+
+void SingleInstance::read(QLocalSocket *socket){
+    disconnect(socket, 0, this, 0);
+    QStringList files;
+    QDataStream stream(socket->readAll());
+    stream >> files;
+    socket->deleteLater();
+    emit filesReceived(files);
+}
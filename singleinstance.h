@@ -0,0 +1,40 @@
+#ifndef SINGLEINSTANCE_H
+#define SINGLEINSTANCE_H
+
+#include <QObject>
+#include <QStringList>
+
+class QLocalServer;
+class QLocalSocket;
+
+// one viewer per user. the first one listens on a local socket, later
+// launches hand it their files and exit, before any gui is set up. the
+// message is the list of absolute file names, read once the sender
+// disconnects.
+class SingleInstance : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit SingleInstance(QObject *parent = 0);
+
+    //true when a running viewer took the files, works without an application object
+    static bool forward(const QStringList &files);
+    //false when another viewer is listening already or the socket can't be created
+    bool listen();
+
+signals:
+    void filesReceived(const QStringList &files);
+
+private slots:
+    void accept();
+    void receive();
+
+private:
+    static QString serverName();
+    void read(QLocalSocket *socket);
+
+    QLocalServer *server = 0;
+};
+
+#endif // SINGLEINSTANCE_H
@@ -0,0 +1,114 @@
+#include "statisticspanel.h"
+
+#include <QPainter>
+#include <QPainterPath>
+#include <QVBoxLayout>
+#include <QtMath>
+
+HistogramView::HistogramView(QWidget *parent) :
+    QWidget(parent)
+{
+    setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Fixed);
+}
+
+void HistogramView::setResult(const ImageStatistics::Result &result){
+    this->result = result;
+    update();
+}
+
+QSize HistogramView::sizeHint() const{
+    return QSize(256, 120);
+}
+
+void HistogramView::paintEvent(QPaintEvent *){
+    QPainter painter(this);
+    painter.fillRect(rect(), palette().base());
+    if(result.pixels == 0)
+        return;
+
+    //the clipped ends are left out of the scale, they are reported below
+    qint64 peak = 1;
+    for(int c = 0; c < ImageStatistics::CHANNELS; c++){
+        for(int v = 1; v < 255; v++)
+            peak = qMax(peak, result.bins[c][v]);
+    }
+    double top = qSqrt(double(peak));
+    const QColor colors[ImageStatistics::CHANNELS] = {Qt::red, Qt::green, Qt::blue, palette().color(QPalette::Mid)};
+
+    painter.setRenderHint(QPainter::Antialiasing);
+    for(int c = ImageStatistics::CHANNELS - 1; c >= 0; c--){
+        QPainterPath path;
+        path.moveTo(0, height());
+        for(int v = 0; v < 256; v++){
+            double y = qMin(1.0, qSqrt(double(result.bins[c][v])) / top);
+            path.lineTo((v + 0.5) * width() / 256.0, height() * (1 - y));
+        }
+        path.lineTo(width(), height());
+        if(c == ImageStatistics::Luma){
+            painter.fillPath(path, colors[c]);
+        }else{
+            //lighter while the counts are only approximate
+            QColor color = colors[c];
+            color.setAlpha(result.exact ? 255 : 128);
+            painter.setPen(color);
+            painter.drawPath(path);
+        }
+    }
+}
+
+StatisticsPanel::StatisticsPanel(QWidget *parent) :
+    QWidget(parent)
+{
+    statistics = new ImageStatistics(this);
+    histogram = new HistogramView();
+    numbers = new QLabel();
+    numbers->setTextFormat(Qt::RichText);
+    numbers->setAlignment(Qt::AlignTop | Qt::AlignLeft);
+
+    QVBoxLayout *vbox = new QVBoxLayout();
+    vbox->addWidget(histogram);
+    vbox->addWidget(numbers);
+    vbox->addStretch();
+    setLayout(vbox);
+
+    connect(statistics, SIGNAL(ready(ImageStatistics::Result)), this, SLOT(setResult(ImageStatistics::Result)));
+}
+
+void StatisticsPanel::showStatistics(const EditPipeline &pipeline, const QRect &region){
+    size = pipeline.size();
+    this->region = region.intersected(pipeline.rect());
+    setResult(statistics->request(pipeline, region));
+}
+
+void StatisticsPanel::clear(){
+    statistics->cancel();
+    region = QRect();
+    size = QSize();
+    setResult(ImageStatistics::Result());
+}
+
+void StatisticsPanel::setResult(const ImageStatistics::Result &result){
+    histogram->setResult(result);
+    if(result.pixels == 0){
+        numbers->clear();
+        return;
+    }
+
+    const char *names[ImageStatistics::CHANNELS] = {"red", "green", "blue", "luma"};
+    QString text = region.isEmpty() ? tr("Image %1x%2").arg(size.width()).arg(size.height())
+                                    : tr("Selection %1x%2").arg(region.width()).arg(region.height());
+    if(!result.exact)
+        text += tr(" (approximate)");
+    text += "<table cellspacing=\"4\"><tr><th></th><th>min</th><th>max</th><th>mean</th><th>at 0</th><th>at 255</th></tr>";
+    for(int c = 0; c < ImageStatistics::CHANNELS; c++){
+        text += QString("<tr><td>%1</td><td>%2</td><td>%3</td><td>%4</td><td>%5%</td><td>%6%</td></tr>")
+                .arg(names[c])
+                .arg(result.minimum(c))
+                .arg(result.maximum(c))
+                .arg(result.mean(c), 0, 'f', 1)
+                .arg(100.0 * result.clippedLow(c) / result.pixels, 0, 'f', 2)
+                .arg(100.0 * result.clippedHigh(c) / result.pixels, 0, 'f', 2);
+    }
+    text += "</table>";
+    numbers->setText(text);
+}
@@ -0,0 +1,54 @@
+#ifndef STATISTICSPANEL_H
+#define STATISTICSPANEL_H
+
+#include <QWidget>
+#include <QLabel>
+
+#include "imagestatistics.h"
+
+// the red, green, blue and luma histograms drawn over each other. counts
+// are shown on a square root scale, so the shape of sparse tones stays
+// visible next to a large peak.
+class HistogramView : public QWidget
+{
+    Q_OBJECT
+
+public:
+    explicit HistogramView(QWidget *parent = 0);
+
+    void setResult(const ImageStatistics::Result &result);
+    QSize sizeHint() const;
+
+protected:
+    void paintEvent(QPaintEvent *e);
+
+private:
+    ImageStatistics::Result result;
+};
+
+// histograms and per channel minimum, maximum, mean and clipped pixels of
+// the image or of the selection. the approximate result is shown at once
+// and marked as such until the exact one replaces it.
+class StatisticsPanel : public QWidget
+{
+    Q_OBJECT
+
+public:
+    explicit StatisticsPanel(QWidget *parent = 0);
+
+    //an empty region is the whole image
+    void showStatistics(const EditPipeline &pipeline, const QRect &region);
+    void clear();
+
+private slots:
+    void setResult(const ImageStatistics::Result &result);
+
+private:
+    ImageStatistics *statistics;
+    HistogramView *histogram;
+    QLabel *numbers;
+    QSize size;
+    QRect region;
+};
+
+#endif // STATISTICSPANEL_H
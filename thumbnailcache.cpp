@@ -0,0 +1,191 @@
+#include "thumbnailcache.h"
+#include "trace.h"
+
+#include <QRunnable>
+#include <QThread>
+#include <QFileInfo>
+#include <QDir>
+#include <QDateTime>
+#include <QBuffer>
+#include <QImageReader>
+#include <QStandardPaths>
+#include <QtEndian>
+
+namespace {
+
+const quint32 MAGIC = 0x54686d62;    //"Thmb"
+const int HEADER = 12;               //magic, key length, data length
+//the file is started over past this, old versions of thumbnails pile up
+const qint64 MAX_FILE_SIZE = qint64(512) * 1024 * 1024;
+
+class ThumbnailJob : public QRunnable
+{
+public:
+    ThumbnailJob(QObject *cache, const QString &fileName, const QString &key) :
+        cache(cache), fileName(fileName), key(key)
+    {
+    }
+
+    void run(){
+        QImage thumbnail = ThumbnailCache::generate(fileName);
+        QMetaObject::invokeMethod(cache, "store", Qt::QueuedConnection,
+                                  Q_ARG(QString, fileName), Q_ARG(QString, key), Q_ARG(QImage, thumbnail));
+    }
+
+private:
+    QObject *cache;
+    QString fileName;
+    QString key;
+};
+
+}
+
+ThumbnailCache::ThumbnailCache(const QString &directory, QObject *parent) :
+    QObject(parent)
+{
+    QString dir = directory;
+    if(dir.isEmpty())
+        dir = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/ImageViewer";
+    QDir().mkpath(dir);
+    file.setFileName(dir + "/thumbnails.pack");
+    if(file.open(QIODevice::ReadWrite)){
+        if(file.size() > MAX_FILE_SIZE)
+            file.resize(0);
+        readRecords();
+    }
+
+    //one thread stays free for the ui and the image loader
+    pool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1));
+}
+
+ThumbnailCache::~ThumbnailCache()
+{
+    pool.clear();
+    pool.waitForDone();
+}
+
+QString ThumbnailCache::key(const QString &fileName){
+    QFileInfo info(fileName);
+    return QString("%1\n%2\n%3").arg(info.absoluteFilePath()).arg(info.lastModified().toMSecsSinceEpoch()).arg(info.size());
+}
+
+void ThumbnailCache::readRecords(){
+    TraceSpan span("ThumbnailCache::readRecords");
+    mappedSize = file.size();
+    mapped = mappedSize > 0 ? file.map(0, mappedSize) : 0;
+    if(!mapped){
+        mappedSize = 0;
+        return;
+    }
+    //the headers are walked, the thumbnails themselves aren't touched
+    qint64 offset = 0;
+    while(offset + HEADER <= mappedSize){
+        const uchar *p = mapped + offset;
+        quint32 keyLength = qFromLittleEndian<quint32>(p + 4);
+        quint32 dataLength = qFromLittleEndian<quint32>(p + 8);
+        qint64 end = offset + HEADER + keyLength + dataLength;
+        if(qFromLittleEndian<quint32>(p) != MAGIC || end > mappedSize)
+            break;
+        Record record;
+        record.offset = offset + HEADER + keyLength;
+        record.length = int(dataLength);
+        records.insert(QString::fromUtf8(reinterpret_cast<const char *>(p + HEADER), int(keyLength)), record);
+        offset = end;
+    }
+    //a record cut short by a crash is dropped
+    if(offset < mappedSize){
+        file.unmap(mapped);
+        file.resize(offset);
+        mappedSize = offset;
+        mapped = offset > 0 ? file.map(0, offset) : 0;
+    }
+}
+
+const uchar *ThumbnailCache::map(const Record &record){
+    //records appended since the last mapping
+    if(record.offset + record.length > mappedSize){
+        if(mapped)
+            file.unmap(mapped);
+        mappedSize = file.size();
+        mapped = file.map(0, mappedSize);
+        if(!mapped){
+            mappedSize = 0;
+            return 0;
+        }
+    }
+    return mapped + record.offset;
+}
+
+QImage ThumbnailCache::thumbnail(const QString &fileName){
+    QHash<QString, Record>::const_iterator it = records.constFind(key(fileName));
+    if(it == records.constEnd())
+        return QImage();
+    const uchar *data = map(it.value());
+    if(!data)
+        return QImage();
+    return QImage::fromData(data, it.value().length);
+}
+
+void ThumbnailCache::request(const QString &fileName){
+    if(pending.contains(fileName))
+        return;
+    pending.insert(fileName);
+    //what was asked for last is what is on screen now
+    pool.start(new ThumbnailJob(this, fileName, key(fileName)), ++requests);
+}
+
+void ThumbnailCache::cancelRequests(){
+    pool.clear();
+    pending.clear();
+}
+
+int ThumbnailCache::count() const{
+    return records.size();
+}
+
+QImage ThumbnailCache::generate(const QString &fileName, int size){
+    TraceSpan span("ThumbnailCache::generate");
+    QImageReader reader(fileName);
+    reader.setAutoTransform(true);
+    QSize full = reader.size();
+    //jpeg is decoded straight at the reduced size (dct scaling), the others are scaled while read
+    if(full.isValid() && (full.width() > size || full.height() > size))
+        reader.setScaledSize(full.scaled(size, size, Qt::KeepAspectRatio).expandedTo(QSize(1, 1)));
+    QImage image = reader.read();
+    if(image.isNull())
+        return image;
+    span.setSize(full);
+    //rotated by the exif orientation, or read by a plugin that ignores the scaled size
+    if(image.width() > size || image.height() > size)
+        image = image.scaled(size, size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    return image;
+}
+
+void ThumbnailCache::store(const QString &fileName, const QString &key, const QImage &thumbnail){
+    pending.remove(fileName);
+    if(!thumbnail.isNull() && file.isOpen()){
+        QByteArray data;
+        QBuffer buffer(&data);
+        buffer.open(QIODevice::WriteOnly);
+        thumbnail.save(&buffer, thumbnail.hasAlphaChannel() ? "PNG" : "JPG", 85);
+        QByteArray name = key.toUtf8();
+
+        uchar header[HEADER];
+        qToLittleEndian<quint32>(MAGIC, header);
+        qToLittleEndian<quint32>(quint32(name.size()), header + 4);
+        qToLittleEndian<quint32>(quint32(data.size()), header + 8);
+        qint64 offset = file.size();
+        file.seek(offset);
+        if(file.write(reinterpret_cast<const char *>(header), HEADER) == HEADER
+                && file.write(name) == name.size() && file.write(data) == data.size()){
+            file.flush();
+            Record record;
+            record.offset = offset + HEADER + name.size();
+            record.length = data.size();
+            records.insert(key, record);
+        }else{
+            file.resize(offset);
+        }
+    }
+    emit ready(fileName, thumbnail);
+}
@@ -0,0 +1,66 @@
+#ifndef THUMBNAILCACHE_H
+#define THUMBNAILCACHE_H
+
+#include <QObject>
+#include <QFile>
+#include <QHash>
+#include <QSet>
+#include <QImage>
+#include <QThreadPool>
+
+// thumbnails kept across runs in one packed file. every record is the key
+// (path, mtime and size of the image file) followed by the thumbnail
+// encoded as jpeg or png; the file is memory-mapped and only the record
+// headers are walked when it is opened, so a folder seen before is shown
+// without decoding anything but the visible thumbnails. missing thumbnails
+// are made on a worker pool with reduced-size decoding.
+class ThumbnailCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    //longest side of a thumbnail
+    static const int SIZE = 128;
+
+    //the cache file lives in directory, the user cache location when empty
+    explicit ThumbnailCache(const QString &directory = QString(), QObject *parent = 0);
+    ~ThumbnailCache();
+
+    //null when there is none for the current version of the file
+    QImage thumbnail(const QString &fileName);
+    //made in the background, the latest requests first; ready follows
+    void request(const QString &fileName);
+    //drops the requests not started yet
+    void cancelRequests();
+    int count() const;
+
+    static QImage generate(const QString &fileName, int size = SIZE);
+
+signals:
+    //a null thumbnail when the file can't be decoded
+    void ready(const QString &fileName, const QImage &thumbnail);
+
+private slots:
+    void store(const QString &fileName, const QString &key, const QImage &thumbnail);
+
+private:
+    struct Record
+    {
+        qint64 offset;
+        int length;
+    };
+
+    static QString key(const QString &fileName);
+    void readRecords();
+    const uchar *map(const Record &record);
+
+    QFile file;
+    uchar *mapped = 0;
+    qint64 mappedSize = 0;
+    QHash<QString, Record> records;
+    QSet<QString> pending;
+    QThreadPool pool;
+    int requests = 0;
+};
+
+#endif // THUMBNAILCACHE_H
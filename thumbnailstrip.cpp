@@ -0,0 +1,120 @@
+#include "thumbnailstrip.h"
+
+#include <QFileInfo>
+#include <QScrollBar>
+
+ThumbnailModel::ThumbnailModel(ThumbnailCache *cache, QObject *parent) :
+    QAbstractListModel(parent), cache(cache), pixmaps(1000),
+    placeholder(ThumbnailCache::SIZE, ThumbnailCache::SIZE)
+{
+    placeholder.fill(Qt::transparent);
+    connect(cache, SIGNAL(ready(QString,QImage)), this, SLOT(thumbnailReady(QString,QImage)));
+}
+
+void ThumbnailModel::setFiles(const QStringList &fileNames){
+    //thumbnails of the previous folder aren't wanted any more
+    cache->cancelRequests();
+    beginResetModel();
+    files = fileNames;
+    rows.clear();
+    for(int i = 0; i < files.size(); i++)
+        rows.insert(files.at(i), i);
+    pixmaps.clear();
+    failed.clear();
+    endResetModel();
+}
+
+QString ThumbnailModel::fileName(int row) const{
+    return files.value(row);
+}
+
+int ThumbnailModel::row(const QString &fileName) const{
+    return rows.value(fileName, -1);
+}
+
+int ThumbnailModel::rowCount(const QModelIndex &parent) const{
+    return parent.isValid() ? 0 : files.size();
+}
+
+QVariant ThumbnailModel::data(const QModelIndex &index, int role) const{
+    if(!index.isValid() || index.row() >= files.size())
+        return QVariant();
+    const QString &fileName = files.at(index.row());
+    switch(role){
+    case Qt::DisplayRole:
+        return QFileInfo(fileName).fileName();
+    case Qt::ToolTipRole:
+        return fileName;
+    case Qt::DecorationRole:{
+        if(QPixmap *pixmap = pixmaps.object(fileName))
+            return *pixmap;
+        if(failed.contains(fileName))
+            return placeholder;
+        QImage thumbnail = cache->thumbnail(fileName);
+        if(thumbnail.isNull()){
+            cache->request(fileName);
+            return placeholder;
+        }
+        QPixmap *pixmap = new QPixmap(QPixmap::fromImage(thumbnail));
+        pixmaps.insert(fileName, pixmap);
+        return *pixmap;
+    }
+    default:
+        return QVariant();
+    }
+}
+
+void ThumbnailModel::thumbnailReady(const QString &fileName, const QImage &thumbnail){
+    int row = rows.value(fileName, -1);
+    if(row < 0)
+        return;
+    if(thumbnail.isNull())
+        failed.insert(fileName);
+    else
+        pixmaps.insert(fileName, new QPixmap(QPixmap::fromImage(thumbnail)));
+    QModelIndex changed = index(row);
+    emit dataChanged(changed, changed, QVector<int>() << Qt::DecorationRole);
+}
+
+ThumbnailStrip::ThumbnailStrip(QWidget *parent) :
+    QListView(parent)
+{
+    cache = new ThumbnailCache(QString(), this);
+    thumbnails = new ThumbnailModel(cache, this);
+    setModel(thumbnails);
+
+    //a single row; uniform items keep the view from asking every row for its size
+    setViewMode(QListView::ListMode);
+    setFlow(QListView::LeftToRight);
+    setWrapping(false);
+    setUniformItemSizes(true);
+    setIconSize(QSize(ThumbnailCache::SIZE, ThumbnailCache::SIZE));
+    setGridSize(QSize(ThumbnailCache::SIZE + 16, ThumbnailCache::SIZE + 24));
+    setTextElideMode(Qt::ElideMiddle);
+    setHorizontalScrollMode(QAbstractItemView::ScrollPerPixel);
+    setSelectionMode(QAbstractItemView::SingleSelection);
+    setMinimumHeight(ThumbnailCache::SIZE + 24 + horizontalScrollBar()->sizeHint().height() + 2 * frameWidth());
+
+    connect(this, SIGNAL(activated(QModelIndex)), this, SLOT(activate(QModelIndex)));
+    connect(this, SIGNAL(clicked(QModelIndex)), this, SLOT(activate(QModelIndex)));
+}
+
+void ThumbnailStrip::setFiles(const QStringList &fileNames){
+    thumbnails->setFiles(fileNames);
+}
+
+void ThumbnailStrip::setCurrentFile(const QString &fileName){
+    int row = thumbnails->row(fileName);
+    if(row < 0){
+        clearSelection();
+        return;
+    }
+    QModelIndex index = thumbnails->index(row);
+    setCurrentIndex(index);
+    scrollTo(index, QAbstractItemView::PositionAtCenter);
+}
+
+void ThumbnailStrip::activate(const QModelIndex &index){
+    if(index.isValid())
+        emit fileActivated(thumbnails->fileName(index.row()));
+}
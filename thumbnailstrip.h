@@ -0,0 +1,63 @@
+#ifndef THUMBNAILSTRIP_H
+#define THUMBNAILSTRIP_H
+
+#include <QListView>
+#include <QAbstractListModel>
+#include <QCache>
+#include <QSet>
+#include <QPixmap>
+
+#include "thumbnailcache.h"
+
+// the files of a folder as thumbnails. a thumbnail is looked up only when
+// the view asks for it, that is when it scrolls into sight, and made in
+// the background when it isn't in the cache yet.
+class ThumbnailModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    explicit ThumbnailModel(ThumbnailCache *cache, QObject *parent = 0);
+
+    void setFiles(const QStringList &fileNames);
+    QString fileName(int row) const;
+    int row(const QString &fileName) const;
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    QVariant data(const QModelIndex &index, int role) const;
+
+private slots:
+    void thumbnailReady(const QString &fileName, const QImage &thumbnail);
+
+private:
+    ThumbnailCache *cache;
+    QStringList files;
+    QHash<QString, int> rows;
+    //decoded thumbnails of the rows seen lately
+    mutable QCache<QString, QPixmap> pixmaps;
+    QSet<QString> failed;
+    QPixmap placeholder;
+};
+
+class ThumbnailStrip : public QListView
+{
+    Q_OBJECT
+
+public:
+    explicit ThumbnailStrip(QWidget *parent = 0);
+
+    void setFiles(const QStringList &fileNames);
+    void setCurrentFile(const QString &fileName);
+
+signals:
+    void fileActivated(const QString &fileName);
+
+private slots:
+    void activate(const QModelIndex &index);
+
+private:
+    ThumbnailCache *cache;
+    ThumbnailModel *thumbnails;
+};
+
+#endif // THUMBNAILSTRIP_H
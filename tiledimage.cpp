@@ -0,0 +1,571 @@
+#include "tiledimage.h"
+#include "resampler.h"
+#include "trace.h"
+
+#include <QCache>
+#include <QImageReader>
+#include <QTemporaryFile>
+#include <QFile>
+#include <QMutexLocker>
+#include <QAtomicInt>
+#include <QPixelFormat>
+#include <QDir>
+#include <QtMath>
+
+#include <cstring>
+#include <utility>
+
+namespace {
+
+const int T = TiledImage::TILE_SIZE;
+//longest side of the reduced image decoded for on-disk files
+const int OVERVIEW_SIZE = 4096;
+
+//decoded tiles of on-disk images, shared by all of them. cost is in KB
+QCache<quint64, QImage> tileCache(512 * 1024);
+QMutex cacheMutex;
+QAtomicInt nextBackingId(1);
+
+//in-memory pixels of all backings
+QAtomicInteger<qint64> liveBytes(0);
+QAtomicInt liveBuffers(0);
+QAtomicInteger<qint64> allocations(0);
+
+quint64 tileKey(int backing, int tx, int ty){
+    return (quint64(backing) << 40) | (quint64(ty) << 20) | quint64(tx);
+}
+
+int tileCost(const QImage &image){
+    return qMax(1, int(image.sizeInBytes() / 1024));
+}
+
+int bytesPerPixel(QImage::Format format){
+    return QImage(1, 1, format).depth() / 8;
+}
+
+bool isGrey(const QVector<QRgb> &colors){
+    foreach(QRgb c, colors)
+        if(qAlpha(c) != 255 || qRed(c) != qGreen(c) || qGreen(c) != qBlue(c))
+            return false;
+    return true;
+}
+
+//image sharing the pixels of another one, valid as long as the source lives
+QImage subImage(const QImage &image, const QRect &r){
+    QImage sub(image.constBits() + r.y() * image.bytesPerLine() + r.x() * (image.depth() / 8),
+               r.width(), r.height(), image.bytesPerLine(), image.format());
+    sub.setColorTable(image.colorTable());
+    return sub;
+}
+
+void appendHalvings(QVector<QImage> &levels, const QImage &first){
+    if(first.isNull())
+        return;
+    levels.append(first);
+    while(levels.last().width() > T || levels.last().height() > T){
+        const QImage &prev = levels.last();
+        levels.append(Resampler::scaled(prev, QSize(qMax(1, prev.width() / 2), qMax(1, prev.height() / 2)),
+                                        Resampler::Bilinear));
+    }
+}
+
+}
+
+class TileBacking
+{
+public:
+    TileBacking() : id(nextBackingId.fetchAndAddRelaxed(1)) {}
+    ~TileBacking();
+
+    void adopt(const QImage &pixels);
+    void countLevels();
+    QImage sourceTile(int tx, int ty);
+    QImage sourceRegion(const QRect &r);
+    const QVector<QImage> &reducedLevels();
+    bool spill(QString *error);
+    void prepare(QImageReader *reader);
+
+    int id;
+    QSize size;
+    QImage::Format format = QImage::Format_RGB32;
+    QImage memory;
+    QString fileName;
+    //kept open, tiles are still decoded from these contents when a save replaces the file
+    QFile file;
+    QByteArray fileFormat;
+    QImageIOHandler::Transformations orientation = QImageIOHandler::TransformationNone;
+    bool clipSupported = false;
+    QTemporaryFile scratch;
+    uchar *map = 0;
+    QVector<QImage> levels;
+    bool levelsBuilt = false;
+    qint64 levelBytes = 0;
+    QMutex decodeMutex;
+};
+
+TileBacking::~TileBacking()
+{
+    if(!memory.isNull()){
+        liveBytes.fetchAndAddRelaxed(-memory.sizeInBytes());
+        liveBuffers.fetchAndAddRelaxed(-1);
+    }
+    liveBytes.fetchAndAddRelaxed(-levelBytes);
+    if(map)
+        scratch.unmap(map);
+    QMutexLocker locker(&cacheMutex);
+    foreach(quint64 key, tileCache.keys())
+        if(int(key >> 40) == id)
+            tileCache.remove(key);
+}
+
+void TileBacking::adopt(const QImage &pixels){
+    //set once, right after construction
+    memory = pixels;
+    size = pixels.size();
+    format = pixels.format();
+    liveBytes.fetchAndAddRelaxed(pixels.sizeInBytes());
+    liveBuffers.fetchAndAddRelaxed(1);
+    allocations.fetchAndAddRelaxed(1);
+}
+
+void TileBacking::countLevels(){
+    foreach(const QImage &level, levels)
+        levelBytes += level.sizeInBytes();
+    liveBytes.fetchAndAddRelaxed(levelBytes);
+}
+
+QImage TileBacking::sourceTile(int tx, int ty){
+    QRect r = QRect(tx * T, ty * T, T, T).intersected(QRect(QPoint(0, 0), size));
+    if(r.isEmpty())
+        return QImage();
+    if(!memory.isNull())
+        return subImage(memory, r);
+    if(map){
+        //tiles are stored one after the other, each with a T pixels stride
+        int bpp = bytesPerPixel(format);
+        int columns = (size.width() + T - 1) / T;
+        uchar *bits = map + (qint64(ty) * columns + tx) * T * T * bpp;
+        return QImage(bits, r.width(), r.height(), T * bpp, format);
+    }
+
+    quint64 key = tileKey(id, tx, ty);
+    {
+        QMutexLocker locker(&cacheMutex);
+        if(QImage *cached = tileCache.object(key))
+            return *cached;
+    }
+
+    //decode the whole band of tiles at once, a clip rect decode reads every row above it anyway
+    QMutexLocker decodeLocker(&decodeMutex);
+    {
+        QMutexLocker locker(&cacheMutex);
+        if(QImage *cached = tileCache.object(key))
+            return *cached;
+    }
+    TraceSpan span("TiledImage::decodeBand", QSize(size.width(), r.height()));
+    QImageReader reader;
+    prepare(&reader);
+    reader.setClipRect(QRect(0, r.y(), size.width(), r.height()));
+    QImage band = reader.read();
+    if(band.isNull())
+        return QImage();
+    band = band.convertToFormat(format);
+    span.addBytes(band.sizeInBytes());
+
+    QImage result;
+    QMutexLocker locker(&cacheMutex);
+    for(int x = 0; x * T < size.width(); x++){
+        QImage t = band.copy(x * T, 0, qMin(T, size.width() - x * T), band.height());
+        if(x == tx)
+            result = t;
+        tileCache.insert(tileKey(id, x, ty), new QImage(t), tileCost(t));
+    }
+    return result;
+}
+
+QImage TileBacking::sourceRegion(const QRect &r){
+    if(!memory.isNull())
+        return r == memory.rect() ? memory : memory.copy(r);
+
+    QImage out(r.size(), format);
+    if(out.isNull())
+        return out;
+    int bpp = bytesPerPixel(format);
+    for(int ty = r.top() / T; ty <= r.bottom() / T; ty++){
+        for(int tx = r.left() / T; tx <= r.right() / T; tx++){
+            QImage t = sourceTile(tx, ty);
+            if(t.isNull())
+                continue;
+            QRect part = QRect(tx * T, ty * T, t.width(), t.height()).intersected(r);
+            int bytes = part.width() * bpp;
+            for(int y = part.top(); y <= part.bottom(); y++){
+                memcpy(out.scanLine(y - r.top()) + (part.left() - r.left()) * bpp,
+                       t.constScanLine(y - ty * T) + (part.left() - tx * T) * bpp, bytes);
+            }
+        }
+    }
+    return out;
+}
+
+const QVector<QImage> &TileBacking::reducedLevels(){
+    QMutexLocker locker(&decodeMutex);
+    if(levelsBuilt)
+        return levels;
+    levelsBuilt = true;
+    TraceSpan span("TiledImage::levels", size);
+
+    QImage first;
+    if(!memory.isNull()){
+        if(size.width() > T || size.height() > T)
+            first = Resampler::scaled(memory, QSize(qMax(1, size.width() / 2), qMax(1, size.height() / 2)),
+                                      Resampler::Bilinear);
+    }else{
+        QImageReader reader;
+        prepare(&reader);
+        reader.setScaledSize(size.scaled(OVERVIEW_SIZE, OVERVIEW_SIZE, Qt::KeepAspectRatio));
+        first = reader.read().convertToFormat(format);
+    }
+    appendHalvings(levels, first);
+    countLevels();
+    return levels;
+}
+
+bool TileBacking::spill(QString *error){
+    //the format can't decode a region: decode once and keep the tiles in a mapped scratch file.
+    //the decoder holds the whole image for that, refuse what it can't hold instead of trying
+    if(qint64(size.width()) * size.height() * qMax(4, bytesPerPixel(format)) > TiledImage::MATERIALIZE_LIMIT){
+        if(error)
+            *error = QString("%1x%2 pixels is too large, this format can't be decoded in parts")
+                    .arg(size.width()).arg(size.height());
+        return false;
+    }
+    QImageReader reader;
+    prepare(&reader);
+    QImage image = reader.read();
+    if(image.isNull()){
+        if(error)
+            *error = reader.errorString();
+        return false;
+    }
+    image = image.convertToFormat(format);
+
+    QImage first = Resampler::scaled(image, size.scaled(OVERVIEW_SIZE, OVERVIEW_SIZE, Qt::KeepAspectRatio));
+    appendHalvings(levels, first);
+    countLevels();
+    levelsBuilt = true;
+
+    int bpp = bytesPerPixel(format);
+    int columns = (size.width() + T - 1) / T;
+    int rows = (size.height() + T - 1) / T;
+    qint64 bytes = qint64(columns) * rows * T * T * bpp;
+    scratch.setFileTemplate(QDir::tempPath() + "/imageviewer-XXXXXX.tiles");
+    if(scratch.open() && scratch.resize(bytes))
+        map = scratch.map(0, bytes);
+    if(!map){
+        //no scratch space, keep the pixels in memory instead
+        adopt(image);
+        return true;
+    }
+    for(int ty = 0; ty < rows; ty++){
+        for(int tx = 0; tx < columns; tx++){
+            QRect r = QRect(tx * T, ty * T, T, T).intersected(image.rect());
+            uchar *bits = map + (qint64(ty) * columns + tx) * T * T * bpp;
+            for(int y = 0; y < r.height(); y++)
+                memcpy(bits + y * T * bpp, image.constScanLine(r.top() + y) + r.left() * bpp, r.width() * bpp);
+        }
+    }
+    return true;
+}
+
+void TileBacking::prepare(QImageReader *reader){
+    //called with the decode mutex held, the readers share the file's position
+    file.seek(0);
+    reader->setDevice(&file);
+    reader->setFormat(fileFormat);
+}
+
+TiledImage::TiledImage(const QSharedPointer<TileBacking> &backing, const QRect &area) :
+    backing(backing), area(area)
+{
+}
+
+QSharedPointer<TiledImage> TiledImage::fromImage(QImage image, bool narrow){
+    if(image.isNull())
+        return QSharedPointer<TiledImage>();
+    QSharedPointer<TileBacking> b(new TileBacking);
+    b->adopt(narrow ? compact(std::move(image)) : std::move(image));
+    return QSharedPointer<TiledImage>(new TiledImage(b, b->memory.rect()));
+}
+
+QSharedPointer<TiledImage> TiledImage::open(const QString &fileName, QString *error){
+    QSharedPointer<TileBacking> b(new TileBacking);
+    b->file.setFileName(fileName);
+    if(!b->file.open(QIODevice::ReadOnly)){
+        if(error)
+            *error = b->file.errorString();
+        return QSharedPointer<TiledImage>();
+    }
+    //found as a reader on the name finds it, a device has no suffix to go by
+    b->fileFormat = QImageReader::imageFormat(fileName);
+    QImageReader reader;
+    b->prepare(&reader);
+    QSize size = reader.size();
+    if(!size.isValid()){
+        if(error)
+            *error = reader.errorString();
+        return QSharedPointer<TiledImage>();
+    }
+
+    b->fileName = fileName;
+    b->size = size;
+    b->orientation = reader.transformation();
+    //decoded tiles are kept in the smallest format the file can have, 16 bits per channel when it has them
+    QImage::Format stored = reader.imageFormat();
+    bool alpha = QImage::toPixelFormat(stored).alphaUsage() == QPixelFormat::UsesAlpha;
+    if(stored == QImage::Format_Grayscale16)
+        b->format = QImage::Format_Grayscale16;
+    else if(stored == QImage::Format_RGBX64)
+        b->format = QImage::Format_RGBX64;
+    else if(stored == QImage::Format_RGBA64 || stored == QImage::Format_RGBA64_Premultiplied)
+        b->format = QImage::Format_RGBA64;
+    else if(alpha)
+        b->format = QImage::Format_ARGB32;
+    else if(stored == QImage::Format_Grayscale8)
+        b->format = QImage::Format_Grayscale8;
+    else
+        b->format = QImage::Format_RGB888;
+    b->clipSupported = reader.supportsOption(QImageIOHandler::ClipRect);
+    if(!b->clipSupported && !b->spill(error))
+        return QSharedPointer<TiledImage>();
+    return QSharedPointer<TiledImage>(new TiledImage(b, QRect(QPoint(0, 0), size)));
+}
+
+bool TiledImage::needsTiling(const QSize &size){
+    return qint64(size.width()) * size.height() * 4 > IN_MEMORY_LIMIT;
+}
+
+QImage TiledImage::compact(QImage image){
+    if(image.isNull())
+        return image;
+    //tiles are addressed in whole bytes
+    if(image.depth() < 8)
+        return image.convertToFormat(isGrey(image.colorTable()) ? QImage::Format_Grayscale8 : QImage::Format_Indexed8);
+    if(image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32
+            && image.format() != QImage::Format_ARGB32_Premultiplied){
+        //8 and 24-bit already, or 16 bits per channel that are worth keeping
+        return image;
+    }
+    TraceSpan span("TiledImage::compact", image.size());
+
+    //one pass to find out whether any pixel is translucent or has a color
+    bool checkAlpha = image.hasAlphaChannel();
+    bool alpha = false;
+    bool color = false;
+    for(int y = 0; y < image.height() && !(color && (alpha || !checkAlpha)); y++){
+        const QRgb *line = reinterpret_cast<const QRgb *>(image.constScanLine(y));
+        for(int x = 0; x < image.width(); x++){
+            QRgb p = line[x];
+            alpha |= checkAlpha && qAlpha(p) != 255;
+            color |= qRed(p) != qGreen(p) || qGreen(p) != qBlue(p);
+        }
+    }
+    if(alpha)
+        return image;
+    //narrower pixels fit in the buffer they come from, an unshared image is converted in place
+    QImage out = std::move(image).convertToFormat(color ? QImage::Format_RGB888 : QImage::Format_Grayscale8);
+    span.addBytes(out.sizeInBytes());
+    return out;
+}
+
+void TiledImage::setMemoryBudget(qint64 bytes){
+    QMutexLocker locker(&cacheMutex);
+    tileCache.setMaxCost(int(qMax<qint64>(1, bytes / 1024)));
+}
+
+qint64 TiledImage::memoryBudget(){
+    QMutexLocker locker(&cacheMutex);
+    return qint64(tileCache.maxCost()) * 1024;
+}
+
+qint64 TiledImage::cacheBytes(){
+    QMutexLocker locker(&cacheMutex);
+    return qint64(tileCache.totalCost()) * 1024;
+}
+
+qint64 TiledImage::trimCache(qint64 bytes){
+    QMutexLocker locker(&cacheMutex);
+    //a smaller budget makes the cache drop its least recently used tiles
+    int budget = tileCache.maxCost();
+    int before = tileCache.totalCost();
+    tileCache.setMaxCost(int(qMax<qint64>(0, before - bytes / 1024)));
+    tileCache.setMaxCost(budget);
+    return qint64(before - tileCache.totalCost()) * 1024;
+}
+
+qint64 TiledImage::pixelBytes(){
+    return liveBytes.loadAcquire();
+}
+
+int TiledImage::pixelBuffers(){
+    return liveBuffers.loadAcquire();
+}
+
+qint64 TiledImage::allocationCount(){
+    return allocations.loadAcquire();
+}
+
+QSize TiledImage::size() const{
+    return area.size();
+}
+
+QRect TiledImage::rect() const{
+    return QRect(QPoint(0, 0), area.size());
+}
+
+int TiledImage::width() const{
+    return area.width();
+}
+
+int TiledImage::height() const{
+    return area.height();
+}
+
+QImage::Format TiledImage::format() const{
+    return backing->format;
+}
+
+bool TiledImage::isInMemory() const{
+    return !backing->memory.isNull();
+}
+
+bool TiledImage::isResident(const QRect &rect) const{
+    if(isInMemory() || backing->map)
+        return true;
+    QRect r = rect.intersected(this->rect()).translated(area.topLeft());
+    QMutexLocker locker(&cacheMutex);
+    for(int ty = r.top() / T; ty <= r.bottom() / T; ty++){
+        for(int tx = r.left() / T; tx <= r.right() / T; tx++){
+            if(!tileCache.contains(tileKey(backing->id, tx, ty)))
+                return false;
+        }
+    }
+    return true;
+}
+
+qint64 TiledImage::memoryBytes() const{
+    //views share the pixels of the whole backing
+    return backing->memory.sizeInBytes();
+}
+
+int TiledImage::backingId() const{
+    return backing->id;
+}
+
+QString TiledImage::sourceFile() const{
+    //tiles of a file that still has to be turned upright aren't what the viewer shows
+    if(area != QRect(QPoint(0, 0), backing->size) || backing->orientation != QImageIOHandler::TransformationNone)
+        return QString();
+    return backing->fileName;
+}
+
+void TiledImage::setSourceFile(const QString &fileName){
+    //only recorded for in-memory pixels, on-disk ones are read from their file already
+    if(isInMemory())
+        backing->fileName = fileName;
+}
+
+QImageIOHandler::Transformations TiledImage::orientation() const{
+    return backing->orientation;
+}
+
+int TiledImage::tileColumns() const{
+    return (area.width() + T - 1) / T;
+}
+
+int TiledImage::tileRows() const{
+    return (area.height() + T - 1) / T;
+}
+
+QImage TiledImage::tile(int tx, int ty) const{
+    QRect r = QRect(tx * T, ty * T, T, T).intersected(rect());
+    if(r.isEmpty())
+        return QImage();
+    r.translate(area.topLeft());
+    if(isInMemory())
+        return subImage(backing->memory, r);
+    if(r.x() % T == 0 && r.y() % T == 0){
+        QImage t = backing->sourceTile(r.x() / T, r.y() / T);
+        return t.size() == r.size() ? t : t.copy(0, 0, r.width(), r.height());
+    }
+    return backing->sourceRegion(r);
+}
+
+QImage TiledImage::region(const QRect &rect) const{
+    QRect r = rect.intersected(this->rect());
+    if(r.isEmpty())
+        return QImage();
+    return backing->sourceRegion(r.translated(area.topLeft()));
+}
+
+QImage TiledImage::toImage() const{
+    if(!isInMemory() && qint64(area.width()) * area.height() * qMax(4, bytesPerPixel(backing->format)) > MATERIALIZE_LIMIT)
+        return QImage();
+    return backing->sourceRegion(area);
+}
+
+QImage TiledImage::scaled(const QSize &size) const{
+    if(isInMemory())
+        return Resampler::scaled(toImage(), size);
+
+    //let the decoder scale, for jpeg this is DCT scaling of the cropped area only
+    QMutexLocker locker(&backing->decodeMutex);
+    QImageReader reader;
+    backing->prepare(&reader);
+    if(reader.supportsOption(QImageIOHandler::ScaledSize) && reader.supportsOption(QImageIOHandler::ScaledClipRect)){
+        double sx = 1.0 * size.width() / area.width();
+        double sy = 1.0 * size.height() / area.height();
+        reader.setScaledSize(QSize(qRound(backing->size.width() * sx), qRound(backing->size.height() * sy)));
+        reader.setScaledClipRect(QRect(QPoint(qRound(area.x() * sx), qRound(area.y() * sy)), size));
+        QImage out = reader.read();
+        if(!out.isNull())
+            return out.convertToFormat(backing->format);
+    }
+    locker.unlock();
+
+    //otherwise start from the smallest reduced level that still has enough detail
+    const QVector<QImage> &lv = levels();
+    for(int i = lv.size() - 1; i >= 0; i--){
+        if(lv.at(i).width() >= size.width() && lv.at(i).height() >= size.height())
+            return Resampler::scaled(lv.at(i), size);
+    }
+    QImage full = toImage();
+    return full.isNull() ? full : Resampler::scaled(full, size);
+}
+
+QSharedPointer<TiledImage> TiledImage::cropped(const QRect &rect) const{
+    QRect r = rect.intersected(this->rect());
+    return QSharedPointer<TiledImage>(new TiledImage(backing, r.translated(area.topLeft())));
+}
+
+const QVector<QImage> &TiledImage::levels() const{
+    QMutexLocker locker(&mutex);
+    if(reducedBuilt)
+        return reduced;
+    reducedBuilt = true;
+
+    const QVector<QImage> &source = backing->reducedLevels();
+    if(area == QRect(QPoint(0, 0), backing->size)){
+        reduced = source;
+        return reduced;
+    }
+    //views take the matching part of every level of the whole image
+    foreach(const QImage &level, source){
+        double s = 1.0 * level.width() / backing->size.width();
+        QRect r(qFloor(area.x() * s), qFloor(area.y() * s), qMax(1, qRound(area.width() * s)), qMax(1, qRound(area.height() * s)));
+        r = r.intersected(level.rect());
+        if(r.isEmpty())
+            break;
+        reduced.append(level.copy(r));
+    }
+    return reduced;
+}
@@ -0,0 +1,90 @@
+#ifndef TILEDIMAGE_H
+#define TILEDIMAGE_H
+
+#include <QImage>
+#include <QVector>
+#include <QSharedPointer>
+#include <QMutex>
+#include <QMetaType>
+#include <QImageIOHandler>
+
+class TileBacking;
+
+// image whose pixels are handed out in fixed-size tiles. small images are
+// kept in memory, large files stay on disk and their tiles are decoded on
+// demand (QImageReader clip rects) into a shared LRU cache, or spilled once
+// into a memory-mapped scratch file when the format can't decode a region.
+// cropping only creates a view on the same pixels. pixels are kept in the
+// narrowest format that holds them without loss (grayscale, 24-bit rgb,
+// indexed), painting converts only the tiles it draws. decoded pixels are
+// narrowed in place and then shared, implicitly, by the view, the edit
+// pipeline, the undo history and the encoder; none of them copies them.
+class TiledImage
+{
+public:
+    static const int TILE_SIZE = 256;
+    //images with more bytes than this aren't decoded into memory
+    static const qint64 IN_MEMORY_LIMIT = 256 * 1024 * 1024;
+    //largest image toImage() is willing to materialize
+    static const qint64 MATERIALIZE_LIMIT = 1024 * 1024 * 1024;
+
+    //pass a temporary (a decoder's result) to keep its buffer instead of copying it.
+    //narrow false keeps the format, narrowing looks at every pixel
+    static QSharedPointer<TiledImage> fromImage(QImage image, bool narrow = true);
+    static QSharedPointer<TiledImage> open(const QString &fileName, QString *error = 0);
+    static bool needsTiling(const QSize &size);
+    //the image in the narrowest format that loses nothing
+    static QImage compact(QImage image);
+
+    static void setMemoryBudget(qint64 bytes);
+    static qint64 memoryBudget();
+    //decoded tiles of on-disk images, least recently used are dropped first
+    static qint64 cacheBytes();
+    static qint64 trimCache(qint64 bytes);
+
+    //pixels held in memory by all images and their reduced levels (not the tile cache)
+    //and the number of their buffers, and how many such buffers were ever allocated
+    static qint64 pixelBytes();
+    static int pixelBuffers();
+    static qint64 allocationCount();
+
+    QSize size() const;
+    QRect rect() const;
+    int width() const;
+    int height() const;
+    QImage::Format format() const;
+    bool isInMemory() const;
+    //the pixels of rect can be had without decoding: in memory, spilled or in the tile cache
+    bool isResident(const QRect &rect) const;
+    qint64 memoryBytes() const;
+    int backingId() const;
+    //the file holding exactly these pixels, empty when there is none (views, edits, rotated on load)
+    QString sourceFile() const;
+    void setSourceFile(const QString &fileName);
+    //exif orientation of an on-disk file, its tiles are decoded as stored and turned upright by the edit pipeline
+    QImageIOHandler::Transformations orientation() const;
+
+    int tileColumns() const;
+    int tileRows() const;
+    QImage tile(int tx, int ty) const;
+    QImage region(const QRect &rect) const;
+    QImage toImage() const;
+    QImage scaled(const QSize &size) const;
+    QSharedPointer<TiledImage> cropped(const QRect &rect) const;
+
+    //reduced copies of the image, every level is half of the previous one
+    const QVector<QImage> &levels() const;
+
+private:
+    TiledImage(const QSharedPointer<TileBacking> &backing, const QRect &area);
+
+    QSharedPointer<TileBacking> backing;
+    QRect area;
+    mutable QVector<QImage> reduced;
+    mutable bool reducedBuilt = false;
+    mutable QMutex mutex;
+};
+
+Q_DECLARE_METATYPE(QSharedPointer<TiledImage>)
+
+#endif // TILEDIMAGE_H
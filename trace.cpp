@@ -0,0 +1,187 @@
+#include "trace.h"
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QCoreApplication>
+#include <QThread>
+#include <QFile>
+#include <QSet>
+
+#include <atomic>
+
+namespace {
+
+//the fields are relaxed atomics, a reader may copy them while a span overwrites
+//the slot. the fences order them against the sequence, as in a seqlock
+struct Event
+{
+    //index + 1 of the event once it is complete, anything else while it's written
+    std::atomic<quint64> sequence;
+    std::atomic<const char *> name;
+    std::atomic<qint64> start;
+    std::atomic<qint64> duration;
+    std::atomic<int> thread;
+    std::atomic<int> width;
+    std::atomic<int> height;
+    std::atomic<qint64> bytes;
+};
+
+//what writeJson copies out of a slot
+struct Copy
+{
+    const char *name;
+    qint64 start;
+    qint64 duration;
+    int thread;
+    int width;
+    int height;
+    qint64 bytes;
+};
+
+Event events[Trace::CAPACITY];
+QAtomicInteger<quint64> head(0);
+QAtomicInt enabled(0);
+QAtomicInt nextThread(1);
+
+QElapsedTimer &epoch(){
+    static QElapsedTimer clock;
+    static bool started = (clock.start(), true);
+    Q_UNUSED(started);
+    return clock;
+}
+
+qint64 now(){
+    return epoch().nsecsElapsed() / 1000;
+}
+
+//small stable numbers read better in the trace viewer than thread handles, 0 is the gui
+int threadNumber(){
+    static thread_local int number = QCoreApplication::instance() && QThread::currentThread() == QCoreApplication::instance()->thread()
+            ? 0 : nextThread.fetchAndAddRelaxed(1);
+    return number;
+}
+
+}
+
+void Trace::setEpoch(const QElapsedTimer &clock){
+    epoch() = clock;
+}
+
+void Trace::setEnabled(bool on){
+    now();
+    enabled.storeRelease(on ? 1 : 0);
+}
+
+bool Trace::isEnabled(){
+    return enabled.loadAcquire() != 0;
+}
+
+void Trace::clear(){
+    for(int i = 0; i < CAPACITY; i++)
+        events[i].sequence.store(0, std::memory_order_release);
+}
+
+bool Trace::writeJson(const QString &fileName){
+    QJsonArray list;
+    quint64 end = head.loadAcquire();
+    quint64 begin = end > quint64(CAPACITY) ? end - CAPACITY : 0;
+    QSet<int> threads;
+    for(quint64 i = begin; i < end; i++){
+        //copy first, then check that no span overwrote it meanwhile
+        const Event &slot = events[i % CAPACITY];
+        if(slot.sequence.load(std::memory_order_acquire) != i + 1)
+            continue;
+        Copy e;
+        e.name = slot.name.load(std::memory_order_relaxed);
+        e.start = slot.start.load(std::memory_order_relaxed);
+        e.duration = slot.duration.load(std::memory_order_relaxed);
+        e.thread = slot.thread.load(std::memory_order_relaxed);
+        e.width = slot.width.load(std::memory_order_relaxed);
+        e.height = slot.height.load(std::memory_order_relaxed);
+        e.bytes = slot.bytes.load(std::memory_order_relaxed);
+        //the copies above can't move below the check
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(slot.sequence.load(std::memory_order_relaxed) != i + 1)
+            continue;
+        QJsonObject event;
+        event["name"] = QString(e.name);
+        event["ph"] = QString("X");
+        event["ts"] = e.start;
+        event["dur"] = e.duration;
+        event["pid"] = int(QCoreApplication::applicationPid());
+        event["tid"] = e.thread;
+        QJsonObject args;
+        if(e.width > 0 || e.height > 0){
+            args["width"] = e.width;
+            args["height"] = e.height;
+        }
+        if(e.bytes > 0)
+            args["bytes"] = e.bytes;
+        event["args"] = args;
+        list.append(event);
+        threads.insert(e.thread);
+    }
+    foreach(int thread, threads){
+        QJsonObject meta;
+        meta["name"] = QString("thread_name");
+        meta["ph"] = QString("M");
+        meta["pid"] = int(QCoreApplication::applicationPid());
+        meta["tid"] = thread;
+        QJsonObject args;
+        args["name"] = thread == 0 ? QString("gui") : QString("worker %1").arg(thread);
+        meta["args"] = args;
+        list.append(meta);
+    }
+
+    QJsonObject root;
+    root["traceEvents"] = list;
+    root["displayTimeUnit"] = QString("ms");
+    QFile file(fileName);
+    if(!file.open(QIODevice::WriteOnly))
+        return false;
+    return file.write(QJsonDocument(root).toJson(QJsonDocument::Compact)) >= 0;
+}
+
+TraceSpan::TraceSpan(const char *name) :
+    name(name), recording(Trace::isEnabled()), start(recording ? now() : 0)
+{
+}
+
+TraceSpan::TraceSpan(const char *name, const QSize &size) :
+    name(name), recording(Trace::isEnabled()), start(recording ? now() : 0), size(size)
+{
+}
+
+TraceSpan::~TraceSpan()
+{
+    if(!recording)
+        return;
+    quint64 index = head.fetchAndAddRelaxed(1);
+    Event &e = events[index % Trace::CAPACITY];
+    e.sequence.store(0, std::memory_order_relaxed);
+    //the fields written below can't move above the slot being marked incomplete
+    std::atomic_thread_fence(std::memory_order_release);
+    e.name.store(name, std::memory_order_relaxed);
+    e.start.store(start, std::memory_order_relaxed);
+    e.duration.store(now() - start, std::memory_order_relaxed);
+    e.thread.store(threadNumber(), std::memory_order_relaxed);
+    e.width.store(size.width(), std::memory_order_relaxed);
+    e.height.store(size.height(), std::memory_order_relaxed);
+    e.bytes.store(bytes, std::memory_order_relaxed);
+    e.sequence.store(index + 1, std::memory_order_release);
+}
+
+void TraceSpan::setSize(const QSize &size){
+    this->size = size;
+}
+
+void TraceSpan::addBytes(qint64 bytes){
+    this->bytes += bytes;
+}
+
+void TraceSpan::backdate(qint64 msecs){
+    start -= msecs * 1000;
+}
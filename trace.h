@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QString>
+#include <QSize>
+#include <QElapsedTimer>
+
+// timing of the hot operations. a TraceSpan records the wall time, thread,
+// image size and bytes of pixels an operation allocated into a fixed ring
+// buffer that any thread appends to without locking. the buffer is written
+// as chrome trace_event json (chrome://tracing, ui.perfetto.dev). when
+// tracing is off a span costs one atomic load.
+class Trace
+{
+public:
+    //events kept, the oldest ones are overwritten
+    static const int CAPACITY = 1 << 16;
+
+    //times are counted from clock, set it before the first span to include what ran before tracing was enabled
+    static void setEpoch(const QElapsedTimer &clock);
+    static void setEnabled(bool enabled);
+    static bool isEnabled();
+    static void clear();
+    static bool writeJson(const QString &fileName);
+};
+
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char *name);
+    TraceSpan(const char *name, const QSize &size);
+    ~TraceSpan();
+
+    void setSize(const QSize &size);
+    void addBytes(qint64 bytes);
+    //the operation began msecs before the span was made
+    void backdate(qint64 msecs);
+
+private:
+    const char *name;
+    bool recording;
+    qint64 start;
+    QSize size;
+    qint64 bytes = 0;
+};
+
+#endif // TRACE_H
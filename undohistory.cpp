@@ -0,0 +1,323 @@
+#include "undohistory.h"
+#include "trace.h"
+
+#include <QSet>
+#include <QTemporaryFile>
+#include <QDataStream>
+#include <QDir>
+#include <QtConcurrent/QtConcurrentRun>
+
+#include <cstring>
+
+namespace {
+
+//rows compressed at a time, bounds the memory a spill needs
+const int SPILL_ROWS = 256;
+
+//entries with a state of their own, replay starts from the closest one
+bool hasState(const UndoHistory::Entry &entry){
+    return !entry.checkpoint.isNull() || entry.spilled || entry.kind == UndoHistory::Close;
+}
+
+//a default future counts as canceled, one that was run never is
+bool isSpilling(const UndoHistory::Entry &entry){
+    return !entry.spilling.isCanceled();
+}
+
+bool writePixels(const QImage &image, const QString &sourceFile, QIODevice *out){
+    QDataStream stream(out);
+    stream << image.size() << qint32(image.format()) << image.colorTable() << sourceFile;
+    //whole rows, the padding at the end of a scan line isn't written
+    int rowBytes = image.width() * image.depth() / 8;
+    for(int y = 0; y < image.height(); y += SPILL_ROWS){
+        int rows = qMin(SPILL_ROWS, image.height() - y);
+        QByteArray band(rowBytes * rows, Qt::Uninitialized);
+        for(int r = 0; r < rows; r++)
+            memcpy(band.data() + r * rowBytes, image.constScanLine(y + r), rowBytes);
+        stream << qCompress(band, 1);
+    }
+    return stream.status() == QDataStream::Ok;
+}
+
+QImage readPixels(QIODevice *in, QString *sourceFile){
+    QDataStream stream(in);
+    QSize size;
+    qint32 format;
+    QVector<QRgb> colors;
+    stream >> size >> format >> colors >> *sourceFile;
+    QImage image(size, QImage::Format(format));
+    if(image.isNull())
+        return image;
+    image.setColorTable(colors);
+    int rowBytes = image.width() * image.depth() / 8;
+    for(int y = 0; y < image.height(); y += SPILL_ROWS){
+        int rows = qMin(SPILL_ROWS, image.height() - y);
+        QByteArray compressed;
+        stream >> compressed;
+        QByteArray band = qUncompress(compressed);
+        if(band.size() != rowBytes * rows)
+            return QImage();
+        for(int r = 0; r < rows; r++)
+            memcpy(image.scanLine(y + r), band.constData() + r * rowBytes, rowBytes);
+    }
+    return image;
+}
+
+}
+
+UndoHistory::UndoHistory()
+{
+}
+
+void UndoHistory::clear(){
+    entries.clear();
+    position = -1;
+    cachedIndex = -1;
+    cachedImage = EditPipeline();
+}
+
+void UndoHistory::push(const Entry &entry){
+    //a new operation drops everything that could be redone
+    entries.resize(position + 1);
+    entries.append(entry);
+    position = entries.size() - 1;
+    if(cachedIndex >= position){
+        cachedIndex = -1;
+        cachedImage = EditPipeline();
+    }
+    trim();
+}
+
+bool UndoHistory::undo(){
+    if(position <= 0)
+        return false;
+    position--;
+    return true;
+}
+
+bool UndoHistory::redo(){
+    if(position >= entries.size() - 1)
+        return false;
+    position++;
+    return true;
+}
+
+void UndoHistory::reset(){
+    if(position < 0)
+        return;
+    position = 0;
+    entries.resize(1);
+}
+
+bool UndoHistory::isEmpty() const{
+    return entries.isEmpty();
+}
+
+bool UndoHistory::canUndo() const{
+    return position > 0;
+}
+
+bool UndoHistory::canRedo() const{
+    return position < entries.size() - 1;
+}
+
+UndoHistory::Entry &UndoHistory::current(){
+    return entries[position];
+}
+
+EditPipeline UndoHistory::image() const{
+    if(position < 0)
+        return EditPipeline();
+    return replay(position);
+}
+
+void UndoHistory::setMemoryLimit(qint64 bytes){
+    limit = bytes;
+    trim();
+}
+
+qint64 UndoHistory::memoryLimit() const{
+    return limit;
+}
+
+qint64 UndoHistory::memoryUsed() const{
+    return entries.size() * sizeof(Entry) + pixelsUsed();
+}
+
+qint64 UndoHistory::pixelsUsed() const{
+    //views on the same pixels are only counted once
+    QSet<int> seen;
+    qint64 bytes = 0;
+    foreach(const Entry &e, entries){
+        QSharedPointer<TiledImage> source = e.checkpoint.source();
+        if(source && !seen.contains(source->backingId())){
+            seen.insert(source->backingId());
+            bytes += source->memoryBytes();
+        }
+    }
+    return bytes;
+}
+
+bool UndoHistory::sharesPixels(int index) const{
+    QSharedPointer<TiledImage> source = entries.at(index).checkpoint.source();
+    for(int i = 0; source && i < entries.size(); i++){
+        QSharedPointer<TiledImage> other = entries.at(i).checkpoint.source();
+        if(i != index && other && other->backingId() == source->backingId())
+            return true;
+    }
+    return false;
+}
+
+EditPipeline UndoHistory::replay(int index) const{
+    if(cachedIndex == index)
+        return cachedImage;
+
+    int start = index;
+    while(start > 0 && !hasState(entries.at(start)))
+        start--;
+    EditPipeline image = checkpoint(entries.at(start));
+    int from = start + 1;
+    if(cachedIndex > start && cachedIndex < index){
+        image = cachedImage;
+        from = cachedIndex + 1;
+    }
+    for(int i = from; i <= index; i++)
+        image = apply(entries.at(i), image);
+
+    cachedIndex = index;
+    cachedImage = image;
+    return image;
+}
+
+EditPipeline UndoHistory::apply(const Entry &entry, const EditPipeline &image) const{
+    if(hasState(entry))
+        return checkpoint(entry);
+    //edits only change the transform of the pipeline, replaying them is cheap
+    EditPipeline result = image;
+    switch(entry.kind){
+    case Crop:
+        result.crop(entry.crop);
+        break;
+    case Rotate:
+        result.rotate(entry.rotation);
+        break;
+    case Resize:
+        result.resize(entry.size);
+        break;
+    default:
+        break;
+    }
+    return result;
+}
+
+EditPipeline UndoHistory::checkpoint(const Entry &entry) const{
+    if(!entry.spilled)
+        return entry.checkpoint;
+    TraceSpan span("UndoHistory::restore");
+    entry.spilled->seek(0);
+    QString sourceFile;
+    QSharedPointer<TiledImage> image = TiledImage::fromImage(readPixels(entry.spilled.data(), &sourceFile));
+    if(!image)
+        return EditPipeline();
+    image->setSourceFile(sourceFile);
+    span.setSize(image->size());
+    return EditPipeline(image);
+}
+
+qint64 UndoHistory::release(qint64 bytes, qint64 *pending){
+    TraceSpan span("UndoHistory::release");
+    qint64 released = collectSpills();
+
+    //the state shown is replayed from this one, its pixels are in use anyway
+    int base = position;
+    while(base > 0 && !hasState(entries.at(base)))
+        base--;
+
+    //pixels being written count as released already, the next call frees them
+    qint64 writing = 0;
+    for(int i = 0; i < entries.size() && released + writing < bytes; i++){
+        Entry &entry = entries[i];
+        QSharedPointer<TiledImage> source = entry.checkpoint.source();
+        if(isSpilling(entry)){
+            writing += source ? source->memoryBytes() : 0;
+            continue;
+        }
+        //only plain pixels are written out, pixels another checkpoint uses stay in memory anyway
+        if(i == base || !source || !source->isInMemory() || !entry.checkpoint.isIdentity() || sharesPixels(i))
+            continue;
+        QSharedPointer<QTemporaryFile> file(new QTemporaryFile(QDir::tempPath() + "/imageviewer-XXXXXX.undo"));
+        if(!file->open())
+            break;
+        //the worker gets its own reference to the pixels, the entry keeps them until it is done
+        QImage pixels = source->toImage();
+        QString sourceFile = source->sourceFile();
+        entry.spilling = QtConcurrent::run([file, pixels, sourceFile](){
+            TraceSpan span("UndoHistory::spill", pixels.size());
+            if(!writePixels(pixels, sourceFile, file.data()) || !file->flush())
+                return QSharedPointer<QTemporaryFile>();
+            return file;
+        });
+        writing += source->memoryBytes();
+    }
+    if(pending)
+        *pending = writing;
+    span.addBytes(released);
+    return released;
+}
+
+qint64 UndoHistory::collectSpills(){
+    int base = position;
+    while(base > 0 && !hasState(entries.at(base)))
+        base--;
+
+    qint64 released = 0;
+    for(int i = 0; i < entries.size(); i++){
+        Entry &entry = entries[i];
+        if(!isSpilling(entry) || !entry.spilling.isFinished())
+            continue;
+        QSharedPointer<QTemporaryFile> file = entry.spilling.result();
+        entry.spilling = QFuture<QSharedPointer<QTemporaryFile> >();
+        //undo may have come back to it while it was written, then it stays
+        if(!file || i == base)
+            continue;
+        QSharedPointer<TiledImage> source = entry.checkpoint.source();
+        qint64 held = source ? source->memoryBytes() : 0;
+        QWeakPointer<TiledImage> pixels = source;
+        source.clear();
+        entry.spilled = file;
+        entry.checkpoint = EditPipeline();
+        //the replayed state may have started from it
+        if(cachedIndex >= 0 && cachedIndex < base){
+            cachedIndex = -1;
+            cachedImage = EditPipeline();
+        }
+        //the decode cache may still hold them, then nothing was freed
+        if(pixels.isNull())
+            released += held;
+    }
+    return released;
+}
+
+void UndoHistory::trim(){
+    //forget the oldest operations, the entry after the base takes over its state.
+    //entries whose pixels a later state still uses free nothing, they only go together
+    //with one that does. when none does, a single large checkpoint keeps the history
+    while(memoryUsed() > limit && position > 1){
+        QVector<Entry> kept = entries;
+        int keptPosition = position;
+        qint64 pixels = pixelsUsed();
+        while(position > 1 && pixelsUsed() >= pixels){
+            if(!hasState(entries.at(2)))
+                entries[2].checkpoint = replay(2);
+            entries.remove(1);
+            position--;
+            cachedIndex = -1;
+            cachedImage = EditPipeline();
+        }
+        if(pixelsUsed() >= pixels){
+            entries = kept;
+            position = keptPosition;
+            break;
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef UNDOHISTORY_H
+#define UNDOHISTORY_H
+
+#include <QVector>
+#include <QRect>
+#include <QSharedPointer>
+#include <QFuture>
+
+#include "editpipeline.h"
+
+class QTemporaryFile;
+
+// undo/redo history that records operations instead of whole images. only
+// checkpoint entries (a newly loaded or filtered image) hold pixels, any other state is
+// replayed onto the edit pipeline of the closest checkpoint before it. when
+// the checkpoints use more memory than allowed, the oldest entries are
+// folded into the base. under memory pressure the pixels of checkpoints
+// other than the one shown are written to compressed temporary files and
+// read back when undo reaches them. they are written on a worker thread, the
+// checkpoint keeps its pixels until the file is complete.
+class UndoHistory
+{
+public:
+    enum Kind { Load, View, Crop, Rotate, Resize, Filter, Close };
+
+    struct Entry{
+        Kind kind = View;
+        //view state
+        double scale = 1;
+        QRect rectangle;
+        bool need_rectangle = false;
+        //edit parameters
+        double rotation = 0;
+        QRect crop;
+        QSize size;
+        //full state, only kept on checkpoints
+        EditPipeline checkpoint;
+        //the pixels of the checkpoint once they were moved out of memory
+        QSharedPointer<QTemporaryFile> spilled;
+        //the file being written, null when writing failed
+        QFuture<QSharedPointer<QTemporaryFile> > spilling;
+    };
+
+    UndoHistory();
+
+    void clear();
+    void push(const Entry &entry);
+    bool undo();
+    bool redo();
+    void reset();
+
+    bool isEmpty() const;
+    bool canUndo() const;
+    bool canRedo() const;
+    Entry &current();
+    EditPipeline image() const;
+
+    void setMemoryLimit(qint64 bytes);
+    qint64 memoryLimit() const;
+    qint64 memoryUsed() const;
+    //moves checkpoints out of memory, the oldest first, returns the bytes they held.
+    //the files are written in the background, a later call frees the pixels of those done;
+    //pending gets the bytes still being written
+    qint64 release(qint64 bytes, qint64 *pending = 0);
+
+private:
+    EditPipeline replay(int index) const;
+    EditPipeline apply(const Entry &entry, const EditPipeline &image) const;
+    EditPipeline checkpoint(const Entry &entry) const;
+    qint64 pixelsUsed() const;
+    bool sharesPixels(int index) const;
+    qint64 collectSpills();
+    void trim();
+
+    QVector<Entry> entries;
+    int position = -1;
+    qint64 limit = 512 * 1024 * 1024;
+
+    mutable int cachedIndex = -1;
+    mutable EditPipeline cachedImage;
+};
+
+#endif // UNDOHISTORY_H